@@ -38,12 +38,736 @@
 #include "WriteCompactTiffRGB.h"
 #include <iostream>
 #include <future>
+#include <fstream>
+#include <chrono>
+#include <new>
+#ifdef _WIN32
+#include <windows.h>
+#include <psapi.h>
+#else
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/resource.h>
+#endif
 
 using namespace std;
 const double CIDSPeak::nominalPixelSizeUm_ = 1.0;
 double g_IntensityFactor_ = 1.0;
 const char* g_PixelType_8bit = "8bit";
 const char* g_PixelType_32bitRGBA = "32bit RGBA";
+const char* g_HdrMode_Off = "Off";
+const char* g_HdrMode_16bit = "16bit";
+const char* g_HdrMode_32bit = "32bit float";
+const char* g_InterleavedOutput_Tagged = "Tagged stream";
+const char* g_InterleavedOutput_Separate = "Separate channels";
+const char* g_OutputLine_None = "None";
+const char* g_ExposureControl_Timed = "Timed";
+const char* g_ExposureControl_TriggerWidth = "Trigger width";
+const char* g_CameraSync_Off = "Off";
+const char* g_CameraSync_HardwareChain = "Hardware chain";
+const char* g_Composite_Off = "Off";
+const char* g_Composite_SideBySide = "Side by side";
+const char* g_Composite_Channels = "Channels";
+const char* g_Composite_Staggered = "Staggered (2 cameras)";
+const char* g_ShutterMode_Default = "Default";
+const char* g_Fault_None = "None";
+const char* g_Fault_Timeout = "Frame timeout";
+const char* g_Fault_Aborted = "Acquisition aborted";
+const char* g_Fault_Incomplete = "Incomplete frame";
+const char* g_Fault_DeviceLost = "Device lost";
+const char* g_Fault_SlowControl = "Slow control transfer";
+const char* g_Demosaic_IPL = "IDS IPL";
+const char* g_Demosaic_Nearest = "Nearest";
+const char* g_Demosaic_Bilinear = "Bilinear";
+const char* g_Demosaic_Malvar = "Malvar-He-Cutler";
+const char* g_Demosaic_EdgeAware = "Edge-aware";
+const char* g_LogLevel_Debug = "Debug";
+const char* g_LogLevel_Info = "Info";
+const char* g_LogLevel_Warning = "Warning";
+const char* g_LogLevel_Error = "Error";
+
+static double secondsSince(std::chrono::steady_clock::time_point start)
+{
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+/**
+* Resident memory and open handles (file descriptors on Linux) of the process,
+* the first things to grow when something leaks over days.
+*/
+static bool getProcessResources(double& residentBytes, long& handles)
+{
+#ifdef _WIN32
+    PROCESS_MEMORY_COUNTERS counters;
+    DWORD handleCount = 0;
+    if (!GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters))) { return false; }
+    if (!GetProcessHandleCount(GetCurrentProcess(), &handleCount)) { return false; }
+    residentBytes = (double)counters.WorkingSetSize;
+    handles = (long)handleCount;
+#else
+    long pages = 0;
+    long residentPages = 0;
+    FILE* statm = fopen("/proc/self/statm", "r");
+    if (statm == NULL) { return false; }
+    int nRead = fscanf(statm, "%ld %ld", &pages, &residentPages);
+    fclose(statm);
+    if (nRead != 2) { return false; }
+    residentBytes = (double)residentPages * sysconf(_SC_PAGESIZE);
+    DIR* fds = opendir("/proc/self/fd");
+    if (fds == NULL) { return false; }
+    handles = 0;
+    while (readdir(fds) != NULL) { handles++; }
+    closedir(fds);
+    handles -= 3; // ., .. and the descriptor of the listing itself
+#endif
+    return true;
+}
+
+/**
+* CPU time (user + system) used by the process so far.
+*/
+static double getProcessCpuSeconds()
+{
+#ifdef _WIN32
+    FILETIME creation, exit, kernel, user;
+    if (!GetProcessTimes(GetCurrentProcess(), &creation, &exit, &kernel, &user)) { return 0; }
+    ULARGE_INTEGER k, u;
+    k.LowPart = kernel.dwLowDateTime;
+    k.HighPart = kernel.dwHighDateTime;
+    u.LowPart = user.dwLowDateTime;
+    u.HighPart = user.dwHighDateTime;
+    return (k.QuadPart + u.QuadPart) * 1e-7;
+#else
+    struct rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) != 0) { return 0; }
+    return usage.ru_utime.tv_sec + usage.ru_stime.tv_sec + (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) * 1e-6;
+#endif
+}
+
+#ifdef IDS_PEAK_ALLOCATION_COUNTER
+// Every operator new of the adapter (of the whole process on Linux, where the
+// replacement is global), for the allocations per frame of the benchmarks
+static std::atomic<uint64_t> g_Allocations(0);
+
+void* operator new(size_t size)
+{
+    g_Allocations.fetch_add(1, std::memory_order_relaxed);
+    void* p = malloc(size > 0 ? size : 1);
+    if (p == NULL) { throw std::bad_alloc(); }
+    return p;
+}
+void* operator new[](size_t size) { return operator new(size); }
+void operator delete(void* p) noexcept { free(p); }
+void operator delete[](void* p) noexcept { free(p); }
+void operator delete(void* p, size_t) noexcept { free(p); }
+void operator delete[](void* p, size_t) noexcept { free(p); }
+#endif
+
+/**
+* Number of allocations so far, -1 in builds without IDS_PEAK_ALLOCATION_COUNTER.
+*/
+static int64_t allocationCount()
+{
+#ifdef IDS_PEAK_ALLOCATION_COUNTER
+    return (int64_t)g_Allocations.load(std::memory_order_relaxed);
+#else
+    return -1;
+#endif
+}
+
+/**
+* Minimal readers for the benchmark files, which have one JSON object per
+* line (see writeBenchmarkResults). They return false if the key is missing.
+*/
+static bool jsonNumber(const string& object, const char* key, double& value)
+{
+    size_t pos = object.find("\"" + string(key) + "\":");
+    if (pos == string::npos) { return false; }
+    pos += strlen(key) + 3;
+    return sscanf(object.c_str() + pos, " %lf", &value) == 1;
+}
+
+static bool jsonString(const string& object, const char* key, string& value)
+{
+    size_t pos = object.find("\"" + string(key) + "\":");
+    if (pos == string::npos) { return false; }
+    size_t begin = object.find('"', pos + strlen(key) + 3);
+    if (begin == string::npos) { return false; }
+    size_t end = object.find('"', begin + 1);
+    if (end == string::npos) { return false; }
+    value = object.substr(begin + 1, end - begin - 1);
+    return true;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Transfer kernels
+///////////////////////////////////////////////////////////////////////////////
+
+/**
+* Copies length bytes, split into one stripe per pool thread.
+*/
+static void copyStriped(unsigned char* dst, const unsigned char* src, size_t length, WorkerPool* pool)
+{
+    unsigned nStripes = pool->GetSize();
+    if (nStripes == 1)
+    {
+        memcpy(dst, src, length);
+        return;
+    }
+    size_t stripeSize = (length + nStripes - 1) / nStripes;
+    pool->ParallelFor(nStripes, [&](unsigned begin, unsigned end) {
+        for (unsigned i = begin; i < end; i++)
+        {
+            size_t offset = i * stripeSize;
+            if (offset >= length) { break; }
+            size_t stripeLength = (offset + stripeSize > length) ? length - offset : stripeSize;
+            memcpy(dst + offset, src + offset, stripeLength);
+        }
+    });
+}
+
+// Straight copy, for formats Micro-Manager understands natively
+template <unsigned BytesPerPixel>
+struct CopyKernel
+{
+    static inline peak_status Transfer(peak_camera_handle, peak_frame_handle hFrame,
+        unsigned char* pBuf, size_t bufSize, WorkerPool* pool)
+    {
+        peak_buffer peakBuffer;
+        peak_status status = peak_Frame_Buffer_Get(hFrame, &peakBuffer);
+        if (status != PEAK_STATUS_SUCCESS) { return status; }
+        // Never write past the MM buffer, even if the frame is larger
+        size_t length = peakBuffer.memorySize < bufSize ? peakBuffer.memorySize : bufSize;
+        length -= length % BytesPerPixel;
+        copyStriped(pBuf, peakBuffer.memoryAddress, length, pool);
+        return status;
+    }
+};
+
+// Conversion by the IDS image processing library, followed by a straight copy
+template <peak_pixel_format DestFormat, unsigned BytesPerPixel>
+struct IplKernel
+{
+    static inline peak_status Transfer(peak_camera_handle hDev, peak_frame_handle hFrame,
+        unsigned char* pBuf, size_t bufSize, WorkerPool* pool)
+    {
+        peak_frame_handle hFrameConverted;
+        peak_status status = peak_IPL_ProcessFrame(hDev, hFrame, &hFrameConverted);
+        if (status != PEAK_STATUS_SUCCESS) { return status; }
+        status = CopyKernel<BytesPerPixel>::Transfer(hDev, hFrameConverted, pBuf, bufSize, pool);
+        peak_Frame_Release(hDev, hFrameConverted);
+        return status;
+    }
+
+    static peak_status Configure(peak_camera_handle hDev)
+    {
+        return peak_IPL_PixelFormat_Set(hDev, DestFormat);
+    }
+};
+
+///////////////////////////////////////////////////////////////////////////////
+// Demosaic kernels (BayerRG8 to BGRA8)
+///////////////////////////////////////////////////////////////////////////////
+
+// Border of the padded Bayer image, enough for the 5x5 filters around the
+// outermost green estimates of the edge-aware algorithm
+static const int g_BayerPad = 3;
+
+static inline int mirrorIndex(int i, int n)
+{
+    // Mirroring around the edge pixel keeps the color filter phase
+    if (i < 0) { return -i; }
+    if (i >= n) { return 2 * (n - 1) - i; }
+    return i;
+}
+
+static inline uint8_t clampByte(int value)
+{
+    return (uint8_t)(value < 0 ? 0 : (value > 255 ? 255 : value));
+}
+
+// Pixel access relative to the current pixel of the padded Bayer image
+struct PaddedPlane
+{
+    const uint8_t* p;
+    ptrdiff_t stride;
+    inline int operator()(int dx, int dy) const { return p[dy * stride + dx]; }
+};
+
+// Same, mirroring at the borders of an unpadded image (reference implementation)
+struct MirroredPlane
+{
+    const uint8_t* p;
+    int width;
+    int height;
+    int x;
+    int y;
+    inline int operator()(int dx, int dy) const
+    {
+        return p[(size_t)mirrorIndex(y + dy, height) * width + mirrorIndex(x + dx, width)];
+    }
+};
+
+/**
+* Green at a red or blue site along the direction of the smaller gradient
+* (Hamilton-Adams), the first pass of the edge-aware algorithm. Green sites
+* keep their value.
+*/
+template <class Plane>
+static inline uint8_t demosaicGreen(const Plane& r, bool greenSite)
+{
+    int c = r(0, 0);
+    if (greenSite) { return (uint8_t)c; }
+    int gradH = abs(r(-1, 0) - r(1, 0)) + abs(2 * c - r(-2, 0) - r(2, 0));
+    int gradV = abs(r(0, -1) - r(0, 1)) + abs(2 * c - r(0, -2) - r(0, 2));
+    int greenH = 2 * (r(-1, 0) + r(1, 0)) + 2 * c - r(-2, 0) - r(2, 0);
+    int greenV = 2 * (r(0, -1) + r(0, 1)) + 2 * c - r(0, -2) - r(0, 2);
+    if (gradH < gradV) { return clampByte((greenH + 2) >> 2); }
+    if (gradV < gradH) { return clampByte((greenV + 2) >> 2); }
+    return clampByte((greenH + greenV + 4) >> 3);
+}
+
+/**
+* Demosaics one pixel into BGRA. site is the RGGB position: 0 red, 1 green in
+* a red row, 2 green in a blue row, 3 blue. g is the green plane of the first
+* pass, only used by the edge-aware algorithm.
+*/
+template <int Mode, class Plane>
+static inline void demosaicPixel(const Plane& r, const Plane& g, int site, uint8_t* bgra)
+{
+    int c = r(0, 0);
+    int red, green, blue;
+    if (Mode == DEMOSAIC_NEAREST)
+    {
+        // The colors of the 2x2 block the pixel is in
+        switch (site)
+        {
+        case 0: red = c; green = r(1, 0); blue = r(1, 1); break;
+        case 1: red = r(-1, 0); green = c; blue = r(0, 1); break;
+        case 2: red = r(0, -1); green = c; blue = r(1, 0); break;
+        default: red = r(-1, -1); green = r(-1, 0); blue = c; break;
+        }
+    }
+    else if (Mode == DEMOSAIC_BILINEAR)
+    {
+        int cross = r(-1, 0) + r(1, 0) + r(0, -1) + r(0, 1);
+        int diagonal = r(-1, -1) + r(1, -1) + r(-1, 1) + r(1, 1);
+        int horizontal = (r(-1, 0) + r(1, 0) + 1) >> 1;
+        int vertical = (r(0, -1) + r(0, 1) + 1) >> 1;
+        switch (site)
+        {
+        case 0: red = c; green = (cross + 2) >> 2; blue = (diagonal + 2) >> 2; break;
+        case 1: red = horizontal; green = c; blue = vertical; break;
+        case 2: red = vertical; green = c; blue = horizontal; break;
+        default: red = (diagonal + 2) >> 2; green = (cross + 2) >> 2; blue = c; break;
+        }
+    }
+    else if (Mode == DEMOSAIC_MALVAR)
+    {
+        // The 5x5 filters of Malvar, He and Cutler (2004), scaled by 16
+        int cross = r(-1, 0) + r(1, 0) + r(0, -1) + r(0, 1);
+        int cross2 = r(-2, 0) + r(2, 0) + r(0, -2) + r(0, 2);
+        int diagonal = r(-1, -1) + r(1, -1) + r(-1, 1) + r(1, 1);
+        int horizontal = r(-1, 0) + r(1, 0);
+        int vertical = r(0, -1) + r(0, 1);
+        int horizontal2 = r(-2, 0) + r(2, 0);
+        int vertical2 = r(0, -2) + r(0, 2);
+        int greenAtRB = (8 * c + 4 * cross - 2 * cross2 + 8) >> 4;
+        int rbAtBR = (12 * c + 4 * diagonal - 3 * cross2 + 8) >> 4;
+        int rbAlongRow = (10 * c + 8 * horizontal - 2 * horizontal2 - 2 * diagonal + vertical2 + 8) >> 4;
+        int rbAlongColumn = (10 * c + 8 * vertical - 2 * vertical2 - 2 * diagonal + horizontal2 + 8) >> 4;
+        switch (site)
+        {
+        case 0: red = c; green = greenAtRB; blue = rbAtBR; break;
+        case 1: red = rbAlongRow; green = c; blue = rbAlongColumn; break;
+        case 2: red = rbAlongColumn; green = c; blue = rbAlongRow; break;
+        default: red = rbAtBR; green = greenAtRB; blue = c; break;
+        }
+    }
+    else
+    {
+        // Bilinear interpolation of the color differences to the green plane
+        green = g(0, 0);
+        int diagonal = r(-1, -1) - g(-1, -1) + r(1, -1) - g(1, -1) + r(-1, 1) - g(-1, 1) + r(1, 1) - g(1, 1);
+        int horizontal = r(-1, 0) - g(-1, 0) + r(1, 0) - g(1, 0);
+        int vertical = r(0, -1) - g(0, -1) + r(0, 1) - g(0, 1);
+        switch (site)
+        {
+        case 0: red = c; blue = green + ((diagonal + 2) >> 2); break;
+        case 1: red = green + ((horizontal + 1) >> 1); blue = green + ((vertical + 1) >> 1); break;
+        case 2: red = green + ((vertical + 1) >> 1); blue = green + ((horizontal + 1) >> 1); break;
+        default: red = green + ((diagonal + 2) >> 2); blue = c; break;
+        }
+    }
+    bgra[0] = clampByte(blue);
+    bgra[1] = clampByte(green);
+    bgra[2] = clampByte(red);
+    bgra[3] = 255;
+}
+
+/**
+* Demosaics one row. The color sites are template parameters, so the site
+* switch of demosaicPixel folds away and every pair of pixels runs straight
+* line code.
+*/
+template <int Mode, int RowSite>
+static inline void demosaicRow(const uint8_t* rowRaw, ptrdiff_t stride, const uint8_t* rowGreen,
+    ptrdiff_t greenStride, uint8_t* out, int width)
+{
+    int x = 0;
+    for (; x + 1 < width; x += 2)
+    {
+        PaddedPlane r0 = { rowRaw + x, stride };
+        PaddedPlane g0 = { rowGreen + x, greenStride };
+        PaddedPlane r1 = { rowRaw + x + 1, stride };
+        PaddedPlane g1 = { rowGreen + x + 1, greenStride };
+        demosaicPixel<Mode>(r0, g0, RowSite, out + x * 4);
+        demosaicPixel<Mode>(r1, g1, RowSite + 1, out + x * 4 + 4);
+    }
+    if (x < width)
+    {
+        PaddedPlane r0 = { rowRaw + x, stride };
+        PaddedPlane g0 = { rowGreen + x, greenStride };
+        demosaicPixel<Mode>(r0, g0, RowSite, out + x * 4);
+    }
+}
+
+/**
+* Demosaics a BayerRG8 image into BGRA8, in row stripes over the pool. The
+* image is first copied into a buffer with a mirrored border, so the filters
+* run without bounds checks.
+*/
+template <int Mode>
+static void demosaicBayerRG8(const uint8_t* src, uint8_t* dst, unsigned width, unsigned height, WorkerPool* pool)
+{
+    static thread_local vector<uint8_t> padded;
+    static thread_local vector<uint8_t> greenPlane;
+    const int pad = g_BayerPad;
+    int w = (int)width;
+    int h = (int)height;
+    ptrdiff_t stride = w + 2 * pad;
+    padded.resize((size_t)stride * (h + 2 * pad));
+    uint8_t* pPadded = padded.data();
+    pool->ParallelFor(h + 2 * pad, [&](unsigned begin, unsigned end) {
+        for (int py = (int)begin; py < (int)end; py++)
+        {
+            const uint8_t* row = src + (size_t)mirrorIndex(py - pad, h) * w;
+            uint8_t* out = pPadded + py * stride;
+            for (int x = -pad; x < 0; x++) { out[x + pad] = row[mirrorIndex(x, w)]; }
+            memcpy(out + pad, row, width);
+            for (int x = w; x < w + pad; x++) { out[x + pad] = row[mirrorIndex(x, w)]; }
+        }
+    });
+
+    // Green plane with a border of one pixel, for the edge-aware algorithm
+    ptrdiff_t gStride = w + 2;
+    uint8_t* pGreen = NULL;
+    if (Mode == DEMOSAIC_EDGE_AWARE)
+    {
+        greenPlane.resize((size_t)gStride * (h + 2));
+        pGreen = greenPlane.data();
+        pool->ParallelFor(h + 2, [&](unsigned begin, unsigned end) {
+            for (int gy = (int)begin; gy < (int)end; gy++)
+            {
+                int y = gy - 1;
+                for (int x = -1; x <= w; x++)
+                {
+                    PaddedPlane r = { pPadded + (y + pad) * stride + x + pad, stride };
+                    pGreen[gy * gStride + x + 1] = demosaicGreen(r, ((x ^ y) & 1) != 0);
+                }
+            }
+        });
+    }
+
+    pool->ParallelFor(height, [&](unsigned begin, unsigned end) {
+        for (int y = (int)begin; y < (int)end; y++)
+        {
+            const uint8_t* rowRaw = pPadded + (y + pad) * stride + pad;
+            const uint8_t* rowGreen = pGreen != NULL ? pGreen + (y + 1) * gStride + 1 : rowRaw;
+            ptrdiff_t greenStride = pGreen != NULL ? gStride : stride;
+            uint8_t* out = dst + (size_t)y * width * 4;
+            if (y & 1) { demosaicRow<Mode, 2>(rowRaw, stride, rowGreen, greenStride, out, w); }
+            else { demosaicRow<Mode, 0>(rowRaw, stride, rowGreen, greenStride, out, w); }
+        }
+    });
+}
+
+/**
+* Straightforward per pixel implementation with mirrored access, the reference
+* the striped and padded kernels are checked against.
+*/
+template <int Mode>
+static void demosaicBayerRG8Reference(const uint8_t* src, uint8_t* dst, unsigned width, unsigned height)
+{
+    int w = (int)width;
+    int h = (int)height;
+    vector<uint8_t> greenPlane((size_t)w * h);
+    for (int y = 0; y < h; y++)
+    {
+        for (int x = 0; x < w; x++)
+        {
+            MirroredPlane r = { src, w, h, x, y };
+            greenPlane[(size_t)y * w + x] = demosaicGreen(r, ((x ^ y) & 1) != 0);
+        }
+    }
+    for (int y = 0; y < h; y++)
+    {
+        for (int x = 0; x < w; x++)
+        {
+            MirroredPlane r = { src, w, h, x, y };
+            MirroredPlane g = { greenPlane.data(), w, h, x, y };
+            demosaicPixel<Mode>(r, g, (y & 1) * 2 + (x & 1), dst + ((size_t)y * w + x) * 4);
+        }
+    }
+}
+
+// Demosaicing in the adapter instead of the IPL, with a selectable algorithm
+template <int Mode>
+struct DemosaicKernel
+{
+    static inline peak_status Transfer(peak_camera_handle, peak_frame_handle hFrame,
+        unsigned char* pBuf, size_t bufSize, WorkerPool* pool)
+    {
+        peak_buffer peakBuffer;
+        peak_roi roi;
+        peak_status status = peak_Frame_Buffer_Get(hFrame, &peakBuffer);
+        if (status != PEAK_STATUS_SUCCESS) { return status; }
+        status = peak_Frame_ROI_Get(hFrame, &roi);
+        if (status != PEAK_STATUS_SUCCESS) { return status; }
+        size_t nPixels = (size_t)roi.size.width * roi.size.height;
+        if (roi.size.width < 4 || roi.size.height < 4 || nPixels > peakBuffer.memorySize || nPixels * 4 > bufSize)
+        {
+            return PEAK_STATUS_BUFFER_TOO_SMALL;
+        }
+        demosaicBayerRG8<Mode>(peakBuffer.memoryAddress, pBuf, roi.size.width, roi.size.height, pool);
+        return status;
+    }
+};
+
+/**
+* Copies a frame into a wider composite frame at column xOffset, top aligned.
+* Rows below a shorter frame are left as they are.
+*/
+static void copySideBySide(unsigned char* dst, unsigned dstWidth, unsigned bytesPerPixel,
+    const unsigned char* src, unsigned srcWidth, unsigned srcHeight, unsigned xOffset)
+{
+    size_t rowBytes = (size_t)srcWidth * bytesPerPixel;
+    for (unsigned y = 0; y < srcHeight; y++)
+    {
+        memcpy(dst + ((size_t)y * dstWidth + xOffset) * bytesPerPixel, src + y * rowBytes, rowBytes);
+    }
+}
+
+// Average of a 2x2 block, rounded to nearest for integer pixels
+static inline uint8_t boxAverage(uint8_t a, uint8_t b, uint8_t c, uint8_t d) { return (uint8_t)((a + b + c + d + 2) >> 2); }
+static inline uint16_t boxAverage(uint16_t a, uint16_t b, uint16_t c, uint16_t d) { return (uint16_t)((a + b + c + d + 2) >> 2); }
+static inline float boxAverage(float a, float b, float c, float d) { return (a + b + c + d) * 0.25f; }
+
+/**
+* One pyramid level: halves a frame by averaging 2x2 blocks, striped over the
+* worker threads. An odd last row or column is dropped. Components is a
+* template parameter so the inner loop has a fixed stride and vectorizes.
+*/
+template <typename T, unsigned Components>
+static void boxDownsample2(const T* src, T* dst, unsigned srcWidth, unsigned srcHeight, WorkerPool* pool)
+{
+    unsigned dstWidth = srcWidth / 2;
+    size_t srcStride = (size_t)srcWidth * Components;
+    size_t dstStride = (size_t)dstWidth * Components;
+    pool->ParallelFor(srcHeight / 2, [&](unsigned begin, unsigned end) {
+        for (unsigned y = begin; y < end; y++)
+        {
+            const T* row0 = src + 2 * y * srcStride;
+            const T* row1 = row0 + srcStride;
+            T* out = dst + y * dstStride;
+            for (size_t i = 0; i < dstStride; i++)
+            {
+                size_t j = (i / Components) * 2 * Components + i % Components;
+                out[i] = boxAverage(row0[j], row0[j + Components], row1[j], row1[j + Components]);
+            }
+        }
+    });
+}
+
+/**
+* Bounding box of the samples above threshold, testing every
+* ROI_TRACK_SAMPLE_STEP-th pixel of every ROI_TRACK_SAMPLE_STEP-th row (the
+* color channels of BGRA, not alpha). Returns false if no sample is above.
+*/
+template <typename T, unsigned Components>
+static bool findActiveRegion(const T* pixels, unsigned width, unsigned height, T threshold,
+    unsigned& x0, unsigned& y0, unsigned& x1, unsigned& y1)
+{
+    const unsigned nColors = Components > 3 ? 3 : Components;
+    x0 = width;
+    y0 = height;
+    x1 = 0;
+    y1 = 0;
+    for (unsigned y = 0; y < height; y += ROI_TRACK_SAMPLE_STEP)
+    {
+        const T* row = pixels + (size_t)y * width * Components;
+        for (unsigned x = 0; x < width; x += ROI_TRACK_SAMPLE_STEP)
+        {
+            bool active = false;
+            for (unsigned c = 0; c < nColors; c++) { active = active || row[x * Components + c] > threshold; }
+            if (!active) { continue; }
+            if (x < x0) { x0 = x; }
+            if (x > x1) { x1 = x; }
+            if (y < y0) { y0 = y; }
+            y1 = y;
+        }
+    }
+    return x0 <= x1;
+}
+
+template <typename T, unsigned Components>
+static void boxDownsample2Reference(const uint8_t* srcBytes, uint8_t* dstBytes, unsigned width, unsigned height)
+{
+    const T* src = (const T*)srcBytes;
+    T* dst = (T*)dstBytes;
+    for (unsigned y = 0; y + 1 < height; y += 2)
+    {
+        for (unsigned x = 0; x + 1 < width; x += 2)
+        {
+            for (unsigned c = 0; c < Components; c++)
+            {
+                unsigned sum = src[((size_t)y * width + x) * Components + c] + src[((size_t)y * width + x + 1) * Components + c]
+                    + src[((size_t)(y + 1) * width + x) * Components + c] + src[((size_t)(y + 1) * width + x + 1) * Components + c];
+                dst[((size_t)(y / 2) * (width / 2) + x / 2) * Components + c] = (T)((sum + 2) / 4);
+            }
+        }
+    }
+}
+
+template <class Kernel>
+static int transferKernel(peak_camera_handle hDev, peak_frame_handle hFrame, ImgBuffer& img, WorkerPool* pool)
+{
+    unsigned char* pBuf = const_cast<unsigned char*>(img.GetPixels());
+    size_t bufSize = (size_t)img.Width() * img.Height() * img.Depth();
+    if (Kernel::Transfer(hDev, hFrame, pBuf, bufSize, pool) != PEAK_STATUS_SUCCESS)
+    {
+        return DEVICE_UNSUPPORTED_DATA_FORMAT;
+    }
+    return DEVICE_OK;
+}
+
+static int transferUnsupported(peak_camera_handle, peak_frame_handle, ImgBuffer&, WorkerPool*)
+{
+    return DEVICE_UNSUPPORTED_DATA_FORMAT;
+}
+
+// Adding a format only requires a new line here
+static const TransferKernelEntry g_TransferKernels[] = {
+    { PEAK_PIXEL_FORMAT_MONO8, g_PixelType_8bit, 8, DEMOSAIC_ANY,
+        &transferKernel<CopyKernel<1> >, NULL },
+    { PEAK_PIXEL_FORMAT_BAYER_RG8, g_PixelType_32bitRGBA, 8, DEMOSAIC_IPL,
+        &transferKernel<IplKernel<PEAK_PIXEL_FORMAT_BGRA8, 4> >, &IplKernel<PEAK_PIXEL_FORMAT_BGRA8, 4>::Configure },
+    { PEAK_PIXEL_FORMAT_BAYER_RG8, g_PixelType_32bitRGBA, 8, DEMOSAIC_NEAREST,
+        &transferKernel<DemosaicKernel<DEMOSAIC_NEAREST> >, NULL },
+    { PEAK_PIXEL_FORMAT_BAYER_RG8, g_PixelType_32bitRGBA, 8, DEMOSAIC_BILINEAR,
+        &transferKernel<DemosaicKernel<DEMOSAIC_BILINEAR> >, NULL },
+    { PEAK_PIXEL_FORMAT_BAYER_RG8, g_PixelType_32bitRGBA, 8, DEMOSAIC_MALVAR,
+        &transferKernel<DemosaicKernel<DEMOSAIC_MALVAR> >, NULL },
+    { PEAK_PIXEL_FORMAT_BAYER_RG8, g_PixelType_32bitRGBA, 8, DEMOSAIC_EDGE_AWARE,
+        &transferKernel<DemosaicKernel<DEMOSAIC_EDGE_AWARE> >, NULL },
+};
+
+/**
+* Looks up the kernel for a source format, bit depth and demosaic algorithm
+* (ignored for non Bayer formats). pixelType may be NULL for any.
+*/
+static const TransferKernelEntry* findTransferKernel(peak_pixel_format format, int bitDepth, int demosaic, const char* pixelType)
+{
+    for (size_t i = 0; i < sizeof(g_TransferKernels) / sizeof(g_TransferKernels[0]); i++)
+    {
+        const TransferKernelEntry& entry = g_TransferKernels[i];
+        if (entry.sourceFormat == format && entry.bitDepth == bitDepth
+            && (entry.demosaic == DEMOSAIC_ANY || entry.demosaic == demosaic)
+            && (pixelType == NULL || entry.pixelType == pixelType))
+        {
+            return &entry;
+        }
+    }
+    return NULL;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// HDR fusion kernels
+///////////////////////////////////////////////////////////////////////////////
+
+/**
+* Adds one 8bit exposure of the bracket to the running sums. With 8bit input
+* the weights are table lookups, the rest of the loop vectorizes.
+*/
+static void hdrAccumulate(const uint8_t* src, float* num, float* den,
+    const float* lutW, const float* lutWR, size_t nPixels)
+{
+    for (size_t i = 0; i < nPixels; i++)
+    {
+        uint8_t z = src[i];
+        num[i] += lutWR[z];
+        den[i] += lutW[z];
+    }
+}
+
+// Radiance in counts per ms
+static void hdrFuse32(const float* num, const float* den, float* dst, size_t nPixels)
+{
+    for (size_t i = 0; i < nPixels; i++)
+    {
+        dst[i] = den[i] > 0.0f ? num[i] / den[i] : 0.0f;
+    }
+}
+
+// Radiance scaled such that a saturated pixel in the shortest exposure is 65535
+static void hdrFuse16(const float* num, const float* den, uint16_t* dst, float scale, size_t nPixels)
+{
+    for (size_t i = 0; i < nPixels; i++)
+    {
+        float value = den[i] > 0.0f ? num[i] / den[i] * scale + 0.5f : 0.0f;
+        dst[i] = (uint16_t)(value > 65535.0f ? 65535.0f : value);
+    }
+}
+
+/**
+* Fills the per exposure lookup tables of the merge. The weight is a hat
+* function that ignores black and saturated pixels, except that saturated
+* pixels of the shortest and black pixels of the longest exposure get a tiny
+* weight, so that pixels outside the range of the whole bracket still end up
+* at the closest representable radiance.
+*/
+static void buildHdrLuts(AcqConfig& config)
+{
+    size_t nExposures = config.hdrExposures.size();
+    config.hdrLutW.assign(nExposures * 256, 0.0f);
+    config.hdrLutWR.assign(nExposures * 256, 0.0f);
+    config.hdrScale16 = 1.0f;
+    if (nExposures == 0) { return; }
+
+    double tMin = config.hdrExposures[0];
+    double tMax = config.hdrExposures[0];
+    for (size_t k = 1; k < nExposures; k++)
+    {
+        if (config.hdrExposures[k] < tMin) { tMin = config.hdrExposures[k]; }
+        if (config.hdrExposures[k] > tMax) { tMax = config.hdrExposures[k]; }
+    }
+    const float epsilon = 1e-3f;
+    for (size_t k = 0; k < nExposures; k++)
+    {
+        double t = config.hdrExposures[k];
+        for (int z = 0; z < 256; z++)
+        {
+            float w = (z <= 127 ? z : 255 - z) / 127.0f;
+            if (z == 255 && t == tMin) { w = epsilon; }
+            if (z == 0 && t == tMax) { w = epsilon; }
+            config.hdrLutW[k * 256 + z] = w;
+            config.hdrLutWR[k * 256 + z] = (float)(w * z / t);
+        }
+    }
+    config.hdrScale16 = (float)(65535.0 * tMin / 255.0);
+}
 
 // External names used used by the rest of the system
 // to load particular device from the "IDSPeak.dll" library
@@ -108,11 +832,66 @@ CIDSPeak::CIDSPeak() :
     sequenceMaxLength_(100),
     sequenceRunning_(false),
     sequenceIndex_(0),
+    gainSequenceable_(false),
+    gainSequenceRunning_(false),
     binSize_(1),
+    decimation_(1),
+    shutterMode_(g_ShutterMode_Default),
+    sensorReadoutMs_(0),
+    serialReadoutMs_(0),
+    clockLatchSupported_(true),
+    lastClockSample_(0),
+    frameTimestamp_(0),
+    benchmarkRunning_(false),
+    benchmarkStop_(false),
+    benchmarkDone_(0),
+    benchmarkTotal_(0),
+    sequenceBenchmarkValid_(false),
+    sequenceBenchCpuStart_(0),
+    sequenceBenchFramesStart_(0),
+    sequenceBenchAllocationsStart_(-1),
+    benchmarkTolerancePct_(10),
+    benchmarkComparison_("Not compared"),
+    benchmarkRegressions_(-1),
+    recoveryTimeoutMs_(5000),
+    lastRecoveryMs_(0),
+    lastRecoveryLostFrames_(0),
+    acqRestarted_(false),
+    lastFrameId_(0),
+    faultInjection_(FAULT_NONE),
+    faultInterval_(100),
+    faultCounter_(0),
+    selfTestRunning_(false),
+    selfTestStop_(false),
+    selfTestResult_("Not run"),
+    selfTestFailures_(-1),
+    soakTestMinutes_(60),
+    logStop_(false),
+    metricsIntervalS_(15),
+    metricsStop_(false),
     cameraCCDXSize_(512),
     cameraCCDYSize_(512),
     ccdT_(0.0),
     triggerDevice_(""),
+    transferKernel_(NULL),
+    snapTransferKernel_(NULL),
+    demosaicLive_(DEMOSAIC_IPL),
+    demosaicSnap_(DEMOSAIC_IPL),
+    previewDownsampling_(1),
+    previewActiveFactor_(1),
+    roiTracking_(false),
+    roiTrackThresholdPct_(25.0),
+    roiTrackMarginPx_(32),
+    roiTrackSearchS_(5.0),
+    roiTrackActive_(false),
+    roiTrackFramerate_(0.0),
+    roiTrackShrinkFrames_(0),
+    roiTrackLostFrames_(0),
+    roiTrackX_(0),
+    roiTrackY_(0),
+    roiTrackWidth_(0),
+    roiTrackHeight_(0),
+    roiTrackReconfigurations_(0),
     stopOnOverflow_(false),
     supportsMultiROI_(false),
     multiROIFillValue_(0),
@@ -125,16 +904,81 @@ CIDSPeak::CIDSPeak() :
     framerateMax_(200),
     framerateMin_(0.1),
     framerateInc_(0.1),
+    framerateLimitsDirty_(false),
+    exposureChangeLatencyUs_(0.0),
+    triggerConfig_(TRIGGER_CONFIG_UNKNOWN),
+    snapFramerate_(10.0),
+    snapTimeoutMs_(100),
+    triggerWidthExposure_(false),
+    triggerLine_("Line0"),
+    triggerLevelHigh_(true),
+    externalTriggerTimeoutMs_(10000),
+    syncEnabled_(false),
+    syncMasterLine_("Line1"),
+    syncSlaveLine_("Line0"),
+    syncToleranceUs_(50.0),
+    syncCheck_("Not checked"),
+    syncMasterLastTs_(0),
+    compositeMode_(COMPOSITE_OFF),
+    compositeDropped_(0),
+    staggerDelayUs_(0),
+    staggerOffsetNs_(0),
+    staggerOffsetValid_(false),
+    staggerRemaining_(0),
+    hdrMode_(HDR_MODE_OFF),
+    interleavedChannels_(0),
+    separateChannels_(false),
+    cycleOnSequencer_(false),
+    cycleNext_(0),
+    cycleFirstFrameId_(0),
+    cycleFrameIdValid_(false),
+    roiCycling_(false),
     imageCounter_(0),
     gainMaster_(1.0),
     gainRed_(1.0),
     gainGreen_(1.0),
-    gainBlue_(1.0)
+    gainBlue_(1.0),
+    acqThreadPriority_(THREAD_PRIORITY_LEVEL_NORMAL),
+    acqThreadCore_(-1),
+    workerThreads_(1),
+    workerThreadPriority_(THREAD_PRIORITY_LEVEL_NORMAL),
+    workerThreadCore_(-1),
+    configCurrent_(0),
+    configVersion_(0)
 {
+    for (unsigned i = 0; i < CONFIG_SLOTS; i++) { configSlots_[i].readers = 0; }
+    for (int s = 0; s < AcqMetrics::STAGE_COUNT; s++) { sequenceBenchSamples_[s] = 0; }
+    for (int d = 0; d < DEMOSAIC_COUNT; d++) { demosaicMsPerMP_[d] = 0; }
+
     // call the base class method to set-up default error codes/messages
     InitializeDefaultErrorMessages();
+    SetErrorText(ERR_HDR_NEEDS_MONO, "HDR mode requires the 8bit (monochrome) pixel type");
+    SetErrorText(ERR_HDR_EXPOSURES, "HDR exposures must be 2 to 4 comma separated exposure times (ms) within the exposure range of the camera");
+    SetErrorText(ERR_TRIGGER_WIDTH_CONFLICT, "Trigger width exposure can not be combined with HDR, interleaved channels, multi ROI cycling or sequences");
+    SetErrorText(ERR_SYNC_WIRING, "Slave camera did not follow the master trigger, check the wiring (see Sync check)");
+    SetErrorText(ERR_SYNC_UNCHECKED, "The sync wiring can't be checked, the master camera has no software trigger");
+    SetErrorText(ERR_SYNC_SLAVE_START, "The acquisition of a slave camera could not be started (see Sync check)");
+    SetErrorText(ERR_STAGGER_OVERLAP, "Staggered cameras: the exposure is longer than half the frame period, lower the exposure or the frame rate");
+    SetErrorText(ERR_SYNC_NO_SLAVES, "No other opened camera to synchronize");
+    SetErrorText(ERR_COMPOSITE_NEEDS_SYNC, "Composite output needs Camera sync (hardware chain)");
+    SetErrorText(ERR_COMPOSITE_FORMAT, "A slave camera has an unsupported pixel format, or (for channels) a different image size");
+    SetErrorText(ERR_COMPOSITE_CONFLICT, "Composite output can only be used for plain acquisitions (no HDR, cycles or trigger width exposure)");
+    SetErrorText(ERR_METRICS_FILE, "Can not write the metrics file, check the path and its permissions");
+    SetErrorText(ERR_BENCHMARK_FILE, "Can not write the benchmark results or read the baseline file");
+    SetErrorText(ERR_BENCHMARK_REGRESSION, "Benchmark results are worse than the baseline, see Benchmark comparison and the log");
+    SetErrorText(ERR_CYCLE_CONFLICT, "Only one of HDR, interleaved channels and multi ROI cycling can be active");
+    hdrExposures_.push_back(1.0);
+    hdrExposures_.push_back(10.0);
+    for (int k = 0; k < MAX_INTERLEAVED_CHANNELS; k++)
+    {
+        FrameSetting setting = { 10.0, 1.0, "" };
+        channelSettings_.push_back(setting);
+    }
+    channelImgs_.resize(MAX_INTERLEAVED_CHANNELS);
     readoutStartTime_ = GetCurrentMMTime();
     thd_ = new MySequenceThread(this);
+    pool_ = new WorkerPool();
+    publishConfig();
 }
 
 /**
@@ -147,7 +991,11 @@ CIDSPeak::CIDSPeak() :
 CIDSPeak::~CIDSPeak()
 {
     StopSequenceAcquisition();
+    stopKernelBenchmark();
+    stopMetricsWriter();
+    stopLogFlusher();
     delete thd_;
+    delete pool_;
 }
 
 /**
@@ -192,32 +1040,29 @@ int CIDSPeak::Initialize()
     // exit program if no camera was found
     if (status != PEAK_STATUS_SUCCESS) { return ERR_CAMERA_NOT_FOUND; }
 
-    // allocate memory for the camera list
-    peak_camera_descriptor* cameraList = (peak_camera_descriptor*)calloc(
-        cameraListLength, sizeof(peak_camera_descriptor));
-
     // get the camera list
-    status = peak_CameraList_Get(cameraList, &cameraListLength);
+    vector<peak_camera_descriptor> cameraList(cameraListLength);
+    status = peak_CameraList_Get(cameraList.data(), &cameraListLength);
     if (status != PEAK_STATUS_SUCCESS) { return ERR_CAMERA_NOT_FOUND; }
     
-    // Open the cameras and assign cameraIDs
+    // Open the cameras and assign cameraIDs. hCams has an entry for every
+    // camera in the list, so the camera ID is also the index in hCams.
     vector<string> cameraIndices;
     CPropertyAction* pAct = new CPropertyAction(this, &CIDSPeak::OnChangeCamera);
     int nRet = CreateStringProperty(MM::g_Keyword_CameraID, "0", false, pAct);
-    for (int i = 0; i < cameraListLength; i++)
+    hCams.assign(cameraListLength, PEAK_INVALID_HANDLE);
+    for (size_t i = 0; i < cameraListLength; i++)
     {
         if (peak_Camera_GetAccessStatus(cameraList[i].cameraID) == PEAK_ACCESS_READWRITE)
         {
-            hCams.push_back(PEAK_INVALID_HANDLE);
             status = peak_Camera_Open(cameraList[i].cameraID, &hCams[i]);
             if (status == PEAK_STATUS_SUCCESS)
             {
-                cameraIndices.push_back(CDeviceUtils::ConvertToString(i));
+                cameraIndices.push_back(CDeviceUtils::ConvertToString((long)i));
             }
+            else { hCams[i] = PEAK_INVALID_HANDLE; }
         }
     }
-    // free the camera list, not needed any longer
-    free(cameraList);
     if (cameraIndices.size() == 0) { return ERR_CAMERA_NOT_FOUND; }
     
     CamID_ = stoi(cameraIndices[0]);
@@ -260,6 +1105,11 @@ int CIDSPeak::Initialize()
     nRet = CreateIntegerProperty(MM::g_Keyword_Binning, 0, false, pAct);
     assert(nRet == DEVICE_OK);
 
+    // decimation (skipping), reduces the readout time where binning doesn't
+    pAct = new CPropertyAction(this, &CIDSPeak::OnDecimation);
+    nRet = CreateIntegerProperty("Decimation", 1, false, pAct);
+    assert(nRet == DEVICE_OK);
+
     // pixel type
     pAct = new CPropertyAction(this, &CIDSPeak::OnPixelType);
     nRet = CreateStringProperty(MM::g_Keyword_PixelType, "pixeltype placeholder", false, pAct);
@@ -269,6 +1119,26 @@ int CIDSPeak::Initialize()
     nRet = CreateFloatProperty(MM::g_Keyword_Exposure, exposureCur_, false);
     assert(nRet == DEVICE_OK);
 
+    // Sensor shutter (rolling, global reset, global), allowed values are filled
+    // in per camera (cameraChanged)
+    pAct = new CPropertyAction(this, &CIDSPeak::OnShutterMode);
+    nRet = CreateStringProperty("Shutter mode", g_ShutterMode_Default, false, pAct);
+    assert(nRet == DEVICE_OK);
+
+    pAct = new CPropertyAction(this, &CIDSPeak::OnSensorReadoutTime);
+    nRet = CreateFloatProperty("Sensor readout time (ms)", 0, true, pAct);
+    assert(nRet == DEVICE_OK);
+
+    // Drift of the camera clock relative to the host clock
+    pAct = new CPropertyAction(this, &CIDSPeak::OnClockDrift);
+    nRet = CreateFloatProperty("Clock drift (ppm)", 0, true, pAct);
+    assert(nRet == DEVICE_OK);
+
+    // Time spent in the last SetExposure call
+    pAct = new CPropertyAction(this, &CIDSPeak::OnExposureChangeLatency);
+    nRet = CreateFloatProperty("Exposure change latency (us)", 0, true, pAct);
+    assert(nRet == DEVICE_OK);
+
     // Frame rate
     pAct = new CPropertyAction(this, &CIDSPeak::OnFrameRate);
     nRet = CreateFloatProperty("MDA framerate", 1, false, pAct);
@@ -366,19 +1236,395 @@ int CIDSPeak::Initialize()
     nRet = SetPropertyLimits("MultiROIFillValue", 0, 65536);
     assert(nRet == DEVICE_OK);
 
-    // Whether or not to use exposure time sequencing
-    pAct = new CPropertyAction(this, &CIDSPeak::OnIsSequenceable);
-    std::string propName = "UseExposureSequences";
-    nRet = CreateStringProperty(propName.c_str(), "No", false, pAct);
+    // Read the ROIs of SetMultiROI one per frame instead of their bounding box
+    pAct = new CPropertyAction(this, &CIDSPeak::OnMultiROICycling);
+    nRet = CreateIntegerProperty("MultiROICycling", 0, false, pAct);
     assert(nRet == DEVICE_OK);
-    nRet = AddAllowedValue(propName.c_str(), "Yes");
+    nRet = AddAllowedValue("MultiROICycling", "0");
     assert(nRet == DEVICE_OK);
-    nRet = AddAllowedValue(propName.c_str(), "No");
+    nRet = AddAllowedValue("MultiROICycling", "1");
     assert(nRet == DEVICE_OK);
 
-    // initialize image buffer
-    GenerateEmptyImage(img_);
-
+    // Exposure time set by the width of an external trigger pulse, e.g. from
+    // an illumination controller
+    pAct = new CPropertyAction(this, &CIDSPeak::OnExposureControl);
+    nRet = CreateStringProperty("Exposure control", g_ExposureControl_Timed, false, pAct);
+    assert(nRet == DEVICE_OK);
+    nRet = AddAllowedValue("Exposure control", g_ExposureControl_Timed);
+    assert(nRet == DEVICE_OK);
+    nRet = AddAllowedValue("Exposure control", g_ExposureControl_TriggerWidth);
+    assert(nRet == DEVICE_OK);
+
+    // Allowed lines are filled in per camera (cameraChanged)
+    pAct = new CPropertyAction(this, &CIDSPeak::OnTriggerLine);
+    nRet = CreateStringProperty("Trigger line", triggerLine_.c_str(), false, pAct);
+    assert(nRet == DEVICE_OK);
+
+    pAct = new CPropertyAction(this, &CIDSPeak::OnTriggerLevel);
+    nRet = CreateStringProperty("Trigger exposure level", "High", false, pAct);
+    assert(nRet == DEVICE_OK);
+    nRet = AddAllowedValue("Trigger exposure level", "High");
+    assert(nRet == DEVICE_OK);
+    nRet = AddAllowedValue("Trigger exposure level", "Low");
+    assert(nRet == DEVICE_OK);
+
+    pAct = new CPropertyAction(this, &CIDSPeak::OnExternalTriggerTimeout);
+    nRet = CreateIntegerProperty("External trigger timeout (ms)", externalTriggerTimeoutMs_, false, pAct);
+    assert(nRet == DEVICE_OK);
+    nRet = SetPropertyLimits("External trigger timeout (ms)", 100, 600000);
+    assert(nRet == DEVICE_OK);
+
+    // Hardware chaining of the other opened cameras to this one
+    pAct = new CPropertyAction(this, &CIDSPeak::OnCameraSync);
+    nRet = CreateStringProperty("Camera sync", g_CameraSync_Off, false, pAct);
+    assert(nRet == DEVICE_OK);
+    nRet = AddAllowedValue("Camera sync", g_CameraSync_Off);
+    assert(nRet == DEVICE_OK);
+    nRet = AddAllowedValue("Camera sync", g_CameraSync_HardwareChain);
+    assert(nRet == DEVICE_OK);
+
+    // Allowed lines are filled in per camera (cameraChanged)
+    pAct = new CPropertyAction(this, &CIDSPeak::OnSyncMasterLine);
+    nRet = CreateStringProperty("Sync master output line", syncMasterLine_.c_str(), false, pAct);
+    assert(nRet == DEVICE_OK);
+
+    pAct = new CPropertyAction(this, &CIDSPeak::OnSyncSlaveLine);
+    nRet = CreateStringProperty("Sync slave trigger line", syncSlaveLine_.c_str(), false, pAct);
+    assert(nRet == DEVICE_OK);
+
+    // Comma separated CameraIDs, empty for all other opened cameras
+    pAct = new CPropertyAction(this, &CIDSPeak::OnSyncSlaveCameras);
+    nRet = CreateStringProperty("Sync slave cameras", "", false, pAct);
+    assert(nRet == DEVICE_OK);
+
+    pAct = new CPropertyAction(this, &CIDSPeak::OnSyncTolerance);
+    nRet = CreateFloatProperty("Sync tolerance (us)", syncToleranceUs_, false, pAct);
+    assert(nRet == DEVICE_OK);
+    nRet = SetPropertyLimits("Sync tolerance (us)", 1, 10000);
+    assert(nRet == DEVICE_OK);
+
+    pAct = new CPropertyAction(this, &CIDSPeak::OnSyncCheck);
+    nRet = CreateStringProperty("Sync check", syncCheck_.c_str(), true, pAct);
+    assert(nRet == DEVICE_OK);
+
+    // Frames of the synchronized cameras combined into one image (or channels)
+    pAct = new CPropertyAction(this, &CIDSPeak::OnCompositeOutput);
+    nRet = CreateStringProperty("Composite output", g_Composite_Off, false, pAct);
+    assert(nRet == DEVICE_OK);
+    nRet = AddAllowedValue("Composite output", g_Composite_Off);
+    assert(nRet == DEVICE_OK);
+    nRet = AddAllowedValue("Composite output", g_Composite_SideBySide);
+    assert(nRet == DEVICE_OK);
+    nRet = AddAllowedValue("Composite output", g_Composite_Channels);
+    assert(nRet == DEVICE_OK);
+    nRet = AddAllowedValue("Composite output", g_Composite_Staggered);
+    assert(nRet == DEVICE_OK);
+
+    // Whether or not to use exposure time sequencing
+    pAct = new CPropertyAction(this, &CIDSPeak::OnIsSequenceable);
+    std::string propName = "UseExposureSequences";
+    nRet = CreateStringProperty(propName.c_str(), "No", false, pAct);
+    assert(nRet == DEVICE_OK);
+    nRet = AddAllowedValue(propName.c_str(), "Yes");
+    assert(nRet == DEVICE_OK);
+    nRet = AddAllowedValue(propName.c_str(), "No");
+    assert(nRet == DEVICE_OK);
+
+    // Whether or not "Gain Master" can be sequenced (like the exposure time)
+    pAct = new CPropertyAction(this, &CIDSPeak::OnIsGainSequenceable);
+    nRet = CreateStringProperty("UseGainSequences", "No", false, pAct);
+    assert(nRet == DEVICE_OK);
+    nRet = AddAllowedValue("UseGainSequences", "Yes");
+    assert(nRet == DEVICE_OK);
+    nRet = AddAllowedValue("UseGainSequences", "No");
+    assert(nRet == DEVICE_OK);
+
+    // HDR fusion of an exposure bracket into one 16bit or 32bit frame
+    pAct = new CPropertyAction(this, &CIDSPeak::OnHdrMode);
+    nRet = CreateStringProperty("HDR mode", g_HdrMode_Off, false, pAct);
+    assert(nRet == DEVICE_OK);
+    nRet = AddAllowedValue("HDR mode", g_HdrMode_Off);
+    assert(nRet == DEVICE_OK);
+    nRet = AddAllowedValue("HDR mode", g_HdrMode_16bit);
+    assert(nRet == DEVICE_OK);
+    nRet = AddAllowedValue("HDR mode", g_HdrMode_32bit);
+    assert(nRet == DEVICE_OK);
+
+    pAct = new CPropertyAction(this, &CIDSPeak::OnHdrExposures);
+    nRet = CreateStringProperty("HDR exposures (ms)", "1,10", false, pAct);
+    assert(nRet == DEVICE_OK);
+
+    // Interleaved channels, the camera alternates settings frame by frame
+    pAct = new CPropertyAction(this, &CIDSPeak::OnInterleavedChannels);
+    nRet = CreateIntegerProperty("Interleaved channels", 0, false, pAct);
+    assert(nRet == DEVICE_OK);
+    nRet = AddAllowedValue("Interleaved channels", "0");
+    assert(nRet == DEVICE_OK);
+    for (int k = 2; k <= MAX_INTERLEAVED_CHANNELS; k++)
+    {
+        nRet = AddAllowedValue("Interleaved channels", CDeviceUtils::ConvertToString(k));
+        assert(nRet == DEVICE_OK);
+    }
+
+    pAct = new CPropertyAction(this, &CIDSPeak::OnInterleavedOutput);
+    nRet = CreateStringProperty("Interleaved output", g_InterleavedOutput_Tagged, false, pAct);
+    assert(nRet == DEVICE_OK);
+    nRet = AddAllowedValue("Interleaved output", g_InterleavedOutput_Tagged);
+    assert(nRet == DEVICE_OK);
+    nRet = AddAllowedValue("Interleaved output", g_InterleavedOutput_Separate);
+    assert(nRet == DEVICE_OK);
+
+    for (long k = 0; k < MAX_INTERLEAVED_CHANNELS; k++)
+    {
+        ostringstream prefix;
+        prefix << "Channel " << k + 1;
+        CPropertyActionEx* pActEx = new CPropertyActionEx(this, &CIDSPeak::OnChannelExposure, k);
+        nRet = CreateFloatProperty((prefix.str() + " exposure (ms)").c_str(), channelSettings_[k].exposureMs, false, pActEx);
+        assert(nRet == DEVICE_OK);
+        pActEx = new CPropertyActionEx(this, &CIDSPeak::OnChannelGain, k);
+        nRet = CreateFloatProperty((prefix.str() + " gain").c_str(), channelSettings_[k].gain, false, pActEx);
+        assert(nRet == DEVICE_OK);
+        // Allowed lines are filled in per camera (cameraChanged)
+        pActEx = new CPropertyActionEx(this, &CIDSPeak::OnChannelOutputLine, k);
+        nRet = CreateStringProperty((prefix.str() + " output line").c_str(), g_OutputLine_None, false, pActEx);
+        assert(nRet == DEVICE_OK);
+    }
+
+    // Thread scheduling of the acquisition thread and the conversion workers
+    initializeThreadPriorityConversion();
+    vector<string> threadPriorityValues;
+    for (map<int, string>::iterator it = threadPriorityToString.begin(); it != threadPriorityToString.end(); ++it)
+    {
+        threadPriorityValues.push_back(it->second);
+    }
+    long nCores = (long)std::thread::hardware_concurrency();
+    if (nCores < 1) { nCores = 1; }
+
+    pAct = new CPropertyAction(this, &CIDSPeak::OnAcqThreadPriority);
+    nRet = CreateStringProperty("Acquisition thread priority", "Normal", false, pAct);
+    assert(nRet == DEVICE_OK);
+    nRet = SetAllowedValues("Acquisition thread priority", threadPriorityValues);
+    assert(nRet == DEVICE_OK);
+
+    // -1 lets the OS schedule the thread on any core
+    pAct = new CPropertyAction(this, &CIDSPeak::OnAcqThreadCore);
+    nRet = CreateIntegerProperty("Acquisition thread core", -1, false, pAct);
+    assert(nRet == DEVICE_OK);
+    nRet = SetPropertyLimits("Acquisition thread core", -1, nCores - 1);
+    assert(nRet == DEVICE_OK);
+
+    pAct = new CPropertyAction(this, &CIDSPeak::OnWorkerThreads);
+    nRet = CreateIntegerProperty("Worker threads", 1, false, pAct);
+    assert(nRet == DEVICE_OK);
+    nRet = SetPropertyLimits("Worker threads", 1, nCores);
+    assert(nRet == DEVICE_OK);
+
+    pAct = new CPropertyAction(this, &CIDSPeak::OnWorkerThreadPriority);
+    nRet = CreateStringProperty("Worker thread priority", "Normal", false, pAct);
+    assert(nRet == DEVICE_OK);
+    nRet = SetAllowedValues("Worker thread priority", threadPriorityValues);
+    assert(nRet == DEVICE_OK);
+
+    // Workers are pinned to consecutive cores starting from this one
+    pAct = new CPropertyAction(this, &CIDSPeak::OnWorkerThreadCore);
+    nRet = CreateIntegerProperty("Worker thread first core", -1, false, pAct);
+    assert(nRet == DEVICE_OK);
+    nRet = SetPropertyLimits("Worker thread first core", -1, nCores - 1);
+    assert(nRet == DEVICE_OK);
+
+    // Demosaic algorithm of color cameras, e.g. fast for live and good for snaps
+    vector<string> demosaicValues;
+    demosaicValues.push_back(g_Demosaic_IPL);
+    demosaicValues.push_back(g_Demosaic_Nearest);
+    demosaicValues.push_back(g_Demosaic_Bilinear);
+    demosaicValues.push_back(g_Demosaic_Malvar);
+    demosaicValues.push_back(g_Demosaic_EdgeAware);
+    CPropertyActionEx* pActDemosaic = new CPropertyActionEx(this, &CIDSPeak::OnDemosaic, 0);
+    nRet = CreateStringProperty("Demosaic (live)", g_Demosaic_IPL, false, pActDemosaic);
+    assert(nRet == DEVICE_OK);
+    nRet = SetAllowedValues("Demosaic (live)", demosaicValues);
+    assert(nRet == DEVICE_OK);
+    pActDemosaic = new CPropertyActionEx(this, &CIDSPeak::OnDemosaic, 1);
+    nRet = CreateStringProperty("Demosaic (snap)", g_Demosaic_IPL, false, pActDemosaic);
+    assert(nRet == DEVICE_OK);
+    nRet = SetAllowedValues("Demosaic (snap)", demosaicValues);
+    assert(nRet == DEVICE_OK);
+
+    pAct = new CPropertyAction(this, &CIDSPeak::OnDemosaicCost);
+    nRet = CreateStringProperty("Demosaic cost", "", true, pAct);
+    assert(nRet == DEVICE_OK);
+
+    // Live view on a downsampled frame, MDA sequences and snaps stay full size
+    pAct = new CPropertyAction(this, &CIDSPeak::OnPreviewDownsampling);
+    nRet = CreateStringProperty("Preview downsampling", "Off", false, pAct);
+    assert(nRet == DEVICE_OK);
+    AddAllowedValue("Preview downsampling", "Off");
+    AddAllowedValue("Preview downsampling", "2x");
+    AddAllowedValue("Preview downsampling", "4x");
+    AddAllowedValue("Preview downsampling", "8x");
+
+    // Live view ROI that follows the signal, for higher frame rates
+    pAct = new CPropertyAction(this, &CIDSPeak::OnRoiTracking);
+    nRet = CreateStringProperty("ROI tracking", "Off", false, pAct);
+    assert(nRet == DEVICE_OK);
+    AddAllowedValue("ROI tracking", "Off");
+    AddAllowedValue("ROI tracking", "On");
+
+    pAct = new CPropertyAction(this, &CIDSPeak::OnRoiTrackingThreshold);
+    nRet = CreateFloatProperty("ROI tracking threshold (%)", roiTrackThresholdPct_, false, pAct);
+    assert(nRet == DEVICE_OK);
+    nRet = SetPropertyLimits("ROI tracking threshold (%)", 0, 100);
+    assert(nRet == DEVICE_OK);
+
+    pAct = new CPropertyAction(this, &CIDSPeak::OnRoiTrackingMargin);
+    nRet = CreateIntegerProperty("ROI tracking margin (px)", roiTrackMarginPx_, false, pAct);
+    assert(nRet == DEVICE_OK);
+    nRet = SetPropertyLimits("ROI tracking margin (px)", 0, 1024);
+    assert(nRet == DEVICE_OK);
+
+    pAct = new CPropertyAction(this, &CIDSPeak::OnRoiTrackingSearchInterval);
+    nRet = CreateFloatProperty("ROI tracking search interval (s)", roiTrackSearchS_, false, pAct);
+    assert(nRet == DEVICE_OK);
+    nRet = SetPropertyLimits("ROI tracking search interval (s)", 0.5, 600);
+    assert(nRet == DEVICE_OK);
+
+    pAct = new CPropertyAction(this, &CIDSPeak::OnRoiTrackingRegion);
+    nRet = CreateStringProperty("ROI tracking region", "Not tracking", true, pAct);
+    assert(nRet == DEVICE_OK);
+
+    // Benchmark of the per frame pixel kernels on synthetic frames
+    pAct = new CPropertyAction(this, &CIDSPeak::OnKernelBenchmark);
+    nRet = CreateStringProperty("Kernel benchmark", "Idle", false, pAct);
+    assert(nRet == DEVICE_OK);
+    AddAllowedValue("Kernel benchmark", "Idle");
+    AddAllowedValue("Kernel benchmark", "Run");
+    AddAllowedValue("Kernel benchmark", "Running");
+    AddAllowedValue("Kernel benchmark", "Stop");
+
+    pAct = new CPropertyAction(this, &CIDSPeak::OnKernelBenchmarkResult);
+    nRet = CreateStringProperty("Kernel benchmark result", "Not run", true, pAct);
+    assert(nRet == DEVICE_OK);
+
+    // Results of the kernel benchmark and of every sequence, in JSON, and
+    // their comparison against a stored baseline
+    CPropertyActionEx* pActEx = new CPropertyActionEx(this, &CIDSPeak::OnBenchmarkFile, 0);
+    nRet = CreateStringProperty("Benchmark results file", "", false, pActEx);
+    assert(nRet == DEVICE_OK);
+
+    pActEx = new CPropertyActionEx(this, &CIDSPeak::OnBenchmarkFile, 1);
+    nRet = CreateStringProperty("Benchmark baseline file", "", false, pActEx);
+    assert(nRet == DEVICE_OK);
+
+    pAct = new CPropertyAction(this, &CIDSPeak::OnBenchmarkTolerance);
+    nRet = CreateFloatProperty("Benchmark tolerance (%)", benchmarkTolerancePct_, false, pAct);
+    assert(nRet == DEVICE_OK);
+    nRet = SetPropertyLimits("Benchmark tolerance (%)", 0, 100);
+    assert(nRet == DEVICE_OK);
+
+    pAct = new CPropertyAction(this, &CIDSPeak::OnBenchmarkComparison);
+    nRet = CreateStringProperty("Benchmark comparison", benchmarkComparison_.c_str(), true, pAct);
+    assert(nRet == DEVICE_OK);
+
+    // Number of regressions of the last comparison (-1 = not compared), for scripts to assert on
+    pAct = new CPropertyAction(this, &CIDSPeak::OnBenchmarkRegressions);
+    nRet = CreateIntegerProperty("Benchmark regressions", benchmarkRegressions_, true, pAct);
+    assert(nRet == DEVICE_OK);
+
+    // Plain acquisitions ride out camera errors for this long (0 = stop on the first error)
+    pAct = new CPropertyAction(this, &CIDSPeak::OnRecoveryTimeout);
+    nRet = CreateFloatProperty("Recovery timeout (ms)", recoveryTimeoutMs_, false, pAct);
+    assert(nRet == DEVICE_OK);
+    nRet = SetPropertyLimits("Recovery timeout (ms)", 0, 60000);
+    assert(nRet == DEVICE_OK);
+
+    pAct = new CPropertyAction(this, &CIDSPeak::OnLastRecovery);
+    nRet = CreateStringProperty("Last recovery", "None", true, pAct);
+    assert(nRet == DEVICE_OK);
+
+#ifdef IDS_PEAK_FAULT_INJECTION
+    // Faults injected every interval frames, to test the recovery without pulling cables
+    pAct = new CPropertyAction(this, &CIDSPeak::OnFaultInjection);
+    nRet = CreateStringProperty("Fault injection", g_Fault_None, false, pAct);
+    assert(nRet == DEVICE_OK);
+    AddAllowedValue("Fault injection", g_Fault_None);
+    AddAllowedValue("Fault injection", g_Fault_Timeout);
+    AddAllowedValue("Fault injection", g_Fault_Aborted);
+    AddAllowedValue("Fault injection", g_Fault_Incomplete);
+    AddAllowedValue("Fault injection", g_Fault_DeviceLost);
+    AddAllowedValue("Fault injection", g_Fault_SlowControl);
+
+    pAct = new CPropertyAction(this, &CIDSPeak::OnFaultInterval);
+    nRet = CreateIntegerProperty("Fault injection interval (frames)", faultInterval_, false, pAct);
+    assert(nRet == DEVICE_OK);
+    nRet = SetPropertyLimits("Fault injection interval (frames)", 1, 10000);
+    assert(nRet == DEVICE_OK);
+
+    // Live acquisitions with every fault, checking recovery time and lost frames
+    pAct = new CPropertyAction(this, &CIDSPeak::OnFaultTest);
+    nRet = CreateStringProperty("Fault recovery test", "Idle", false, pAct);
+    assert(nRet == DEVICE_OK);
+    AddAllowedValue("Fault recovery test", "Idle");
+    AddAllowedValue("Fault recovery test", "Run");
+    AddAllowedValue("Fault recovery test", "Running");
+    AddAllowedValue("Fault recovery test", "Stop");
+
+    // Hours of alternating workloads, checking memory, handles, latency and frame loss
+    pAct = new CPropertyAction(this, &CIDSPeak::OnSoakTest);
+    nRet = CreateStringProperty("Soak test", "Idle", false, pAct);
+    assert(nRet == DEVICE_OK);
+    AddAllowedValue("Soak test", "Idle");
+    AddAllowedValue("Soak test", "Run");
+    AddAllowedValue("Soak test", "Running");
+    AddAllowedValue("Soak test", "Stop");
+
+    pAct = new CPropertyAction(this, &CIDSPeak::OnSoakTestDuration);
+    nRet = CreateFloatProperty("Soak test duration (min)", soakTestMinutes_, false, pAct);
+    assert(nRet == DEVICE_OK);
+    nRet = SetPropertyLimits("Soak test duration (min)", 1, 10080);
+    assert(nRet == DEVICE_OK);
+
+    // One shrink and grow cycle of ROI tracking, on synthetic frames
+    pAct = new CPropertyAction(this, &CIDSPeak::OnRoiTrackTest);
+    nRet = CreateStringProperty("ROI tracking test", "Idle", false, pAct);
+    assert(nRet == DEVICE_OK);
+    AddAllowedValue("ROI tracking test", "Idle");
+    AddAllowedValue("ROI tracking test", "Run");
+    AddAllowedValue("ROI tracking test", "Running");
+
+    pAct = new CPropertyAction(this, &CIDSPeak::OnSelfTestResult);
+    nRet = CreateStringProperty("Self test result", "Not run", true, pAct);
+    assert(nRet == DEVICE_OK);
+
+    // Failed checks of the last self test (-1 = not run), for scripts to assert on
+    pAct = new CPropertyAction(this, &CIDSPeak::OnSelfTestFailures);
+    nRet = CreateIntegerProperty("Self test failures", selfTestFailures_, true, pAct);
+    assert(nRet == DEVICE_OK);
+#endif
+
+    // Messages below this level are discarded without formatting
+    pAct = new CPropertyAction(this, &CIDSPeak::OnLogLevel);
+    nRet = CreateStringProperty("Log level", g_LogLevel_Info, false, pAct);
+    assert(nRet == DEVICE_OK);
+    AddAllowedValue("Log level", g_LogLevel_Debug);
+    AddAllowedValue("Log level", g_LogLevel_Info);
+    AddAllowedValue("Log level", g_LogLevel_Warning);
+    AddAllowedValue("Log level", g_LogLevel_Error);
+    startLogFlusher();
+
+    // Metrics for node_exporter's textfile collector (empty = off)
+    pAct = new CPropertyAction(this, &CIDSPeak::OnMetricsFile);
+    nRet = CreateStringProperty("Metrics file", "", false, pAct);
+    assert(nRet == DEVICE_OK);
+
+    pAct = new CPropertyAction(this, &CIDSPeak::OnMetricsInterval);
+    nRet = CreateFloatProperty("Metrics interval (s)", metricsIntervalS_, false, pAct);
+    assert(nRet == DEVICE_OK);
+    nRet = SetPropertyLimits("Metrics interval (s)", 1, 3600);
+    assert(nRet == DEVICE_OK);
+
+    // initialize image buffer
+    GenerateEmptyImage(img_);
+
     // initialize first camera
     nRet = cameraChanged();
     if (nRet != DEVICE_OK) { return nRet; }
@@ -403,14 +1649,29 @@ int CIDSPeak::Initialize()
 */
 int CIDSPeak::Shutdown()
 {
+#ifdef IDS_PEAK_FAULT_INJECTION
+    stopSelfTest();
+#endif
+    stopKernelBenchmark();
+    stopMetricsWriter();
+    if (syncEnabled_)
+    {
+        teardownSync();
+        syncEnabled_ = false;
+    }
+
     // Close open camera and set pointer to NULL
-    for (size_t i = 0; i < nCameras_; i++)
-        peak_Camera_Close(hCams[i]);
+    for (size_t i = 0; i < hCams.size(); i++)
+    {
+        if (hCams[i] != PEAK_INVALID_HANDLE) { peak_Camera_Close(hCams[i]); }
+    }
+    hCams.clear();
     nCameras_ = 0;
     hCam = NULL;
 
     // Close peak library
     status = peak_Library_Exit();
+    stopLogFlusher();
 
     initialized_ = false;
 
@@ -426,32 +1687,112 @@ int CIDSPeak::Shutdown()
 int CIDSPeak::SnapImage()
 {
     int nRet = DEVICE_OK;
-    static int callCounter = 0;
-    ++callCounter;
 
-    MM::MMTime startTime = GetCurrentMMTime();
+    if (triggerWidthExposure_ && !getConfig()->cycle.empty()) { return ERR_TRIGGER_WIDTH_CONFLICT; }
+    if (getConfig()->compositeMode != COMPOSITE_OFF)
+    {
+        // The slaves follow the software triggered master through the chain
+        std::shared_ptr<const AcqConfig> config = getConfig();
+        if (!config->cycle.empty() || triggerWidthExposure_) { return ERR_COMPOSITE_CONFLICT; }
+        nRet = applyTriggerConfig(TRIGGER_CONFIG_SOFTWARE);
+        if (nRet != DEVICE_OK) { return nRet; }
+        startSyncSlaves(*config);
+        status = peak_Acquisition_Start(hCam, 1);
+        if (status == PEAK_STATUS_SUCCESS) { status = executeGFACommand(hCam, "TriggerSoftware"); }
+        peak_frame_handle hMasterFrame;
+        if (status == PEAK_STATUS_SUCCESS) { status = peak_Acquisition_WaitForFrame(hCam, snapTimeoutMs_ + 1000, &hMasterFrame); }
+        if (status == PEAK_STATUS_SUCCESS)
+        {
+            map<string, string> frameTags;
+            nRet = composeFrame(*config, hMasterFrame, frameTags);
+            peak_Frame_Release(hCam, hMasterFrame);
+            if (nRet == ERR_COMPOSITE_INCOMPLETE) { nRet = ERR_ACQ_TIMEOUT; }
+        }
+        else { nRet = status == PEAK_STATUS_TIMEOUT ? ERR_ACQ_TIMEOUT : ERR_ACQ_START; }
+        peak_Acquisition_Stop(hCam);
+        stopSyncSlaves(*config);
+        readoutStartTime_ = GetCurrentMMTime();
+        return nRet;
+    }
+    if (!getConfig()->cycle.empty())
+    {
+        // HDR brackets and interleaved channels are software triggered frame by frame
+        nRet = beginCycle(false);
+        if (nRet != DEVICE_OK) { return nRet; }
+        std::shared_ptr<const AcqConfig> config = getConfig();
+        status = peak_Acquisition_Start(hCam, PEAK_INFINITE);
+        if (status != PEAK_STATUS_SUCCESS) { return ERR_ACQ_START; }
+        if (config->hdrMode != HDR_MODE_OFF)
+        {
+            nRet = acquireHdrBracket(*config, img_);
+        }
+        else
+        {
+            // One frame per channel, channel 0 goes to the regular image buffer
+            if (channelImgs_.size() < config->cycle.size()) { channelImgs_.resize(config->cycle.size()); }
+            size_t cycleIndex;
+            for (size_t k = 0; k < config->cycle.size() && nRet == DEVICE_OK; k++)
+            {
+                ImgBuffer& channelImg = k == 0 ? img_ : channelImgs_[k];
+                channelImg.Resize(config->width, config->height, config->bytesPerPixel);
+                nRet = acquireCycleFrame(*config, channelImg, cycleIndex);
+            }
+        }
+        peak_Acquisition_Stop(hCam);
+        endCycle(*config);
+        readoutStartTime_ = GetCurrentMMTime();
+        return nRet;
+    }
 
-    unsigned int framesToAcquire = 1;
-    unsigned int pendingFrames = framesToAcquire;
     unsigned int timeoutCount = 0;
-
-    // Make SnapImage responsive, even if low framerate has been set
+    unsigned int maxTimeouts = 99;
+    uint32_t timeoutMs = snapTimeoutMs_;
     double framerateTemp = framerateCur_;
-    nRet = framerateSet(1000 / exposureCur_);
+    bool restoreFramerate = false;
 
-    uint32_t three_frame_times_timeout_ms = (uint32_t)((3000.0 / framerateCur_) + 0.5);
+    if (triggerWidthExposure_)
+    {
+        // Wait for one external pulse, which defines the exposure
+        nRet = applyTriggerConfig(TRIGGER_CONFIG_WIDTH);
+        if (nRet != DEVICE_OK) { return nRet; }
+        maxTimeouts = 0;
+        timeoutMs = (uint32_t)externalTriggerTimeoutMs_;
+    }
+    // Snaps are software triggered, so the MDA frame rate doesn't slow them down
+    // and doesn't have to be touched. The trigger mode is only written when
+    // switching between snaps and sequences.
+    else if (applyTriggerConfig(TRIGGER_CONFIG_SOFTWARE) != DEVICE_OK && framerateCur_ < snapFramerate_)
+    {
+        // No software trigger available, make SnapImage responsive even if
+        // a low framerate has been set.
+        nRet = framerateSet(snapFramerate_);
+        restoreFramerate = true;
+    }
 
-    status = peak_Acquisition_Start(hCam, framesToAcquire);
+    status = peak_Acquisition_Start(hCam, 1);
     if (status != PEAK_STATUS_SUCCESS) { return ERR_ACQ_START; }
+    if (triggerConfig_ == TRIGGER_CONFIG_SOFTWARE)
+    {
+        status = executeGFACommand(hCam, "TriggerSoftware");
+        if (status != PEAK_STATUS_SUCCESS)
+        {
+            peak_Acquisition_Stop(hCam);
+            return ERR_ACQ_START;
+        }
+    }
 
-    while (pendingFrames > 0)
+    while (true)
     {
         peak_frame_handle hFrame;
-        status = peak_Acquisition_WaitForFrame(hCam, three_frame_times_timeout_ms, &hFrame);
+        status = peak_Acquisition_WaitForFrame(hCam, timeoutMs, &hFrame);
         if (status == PEAK_STATUS_TIMEOUT)
         {
             timeoutCount++;
-            if (timeoutCount > 99) { return ERR_ACQ_TIMEOUT; }
+            if (timeoutCount > maxTimeouts)
+            {
+                peak_Acquisition_Stop(hCam);
+                return ERR_ACQ_TIMEOUT;
+            }
             else { continue; }
         }
         else if (status == PEAK_STATUS_ABORTED) { break; }
@@ -463,11 +1804,14 @@ int CIDSPeak::SnapImage()
         // Now we have transfered all information, we can release the frame.
         status = peak_Frame_Release(hCam, hFrame);
         if (PEAK_ERROR(status)) { return ERR_ACQ_RELEASE; }
-        pendingFrames--;
+        break;
     }
     readoutStartTime_ = GetCurrentMMTime();
-    // Revert framerate back to framerate before snapshot
-    nRet = framerateSet(framerateTemp);
+    if (restoreFramerate)
+    {
+        // Revert framerate back to framerate before snapshot
+        nRet = framerateSet(framerateTemp);
+    }
     return nRet;
 }
 
@@ -488,6 +1832,9 @@ const unsigned char* CIDSPeak::GetImageBuffer()
     MM::MMTime readoutTime(readoutUs_);
     while (readoutTime > (GetCurrentMMTime() - readoutStartTime_)) {}
     unsigned char* pB = (unsigned char*)(img_.GetPixels());
+    int compositeMode = getConfig()->compositeMode;
+    if (compositeMode == COMPOSITE_SIDE_BY_SIDE) { pB = (unsigned char*)(compositeImg_.GetPixels()); }
+    else if (compositeMode == COMPOSITE_CHANNELS || compositeMode == COMPOSITE_STAGGERED) { pB = (unsigned char*)(compositeImgs_[0].GetPixels()); }
     return pB;
 }
 
@@ -497,7 +1844,8 @@ const unsigned char* CIDSPeak::GetImageBuffer()
 */
 unsigned CIDSPeak::GetImageWidth() const
 {
-    return img_.Width();
+    unsigned width = roiTrackWidth_ != 0 ? roiTrackWidth_.load() : getConfig()->width;
+    return width / previewActiveFactor_;
 }
 
 /**
@@ -506,7 +1854,8 @@ unsigned CIDSPeak::GetImageWidth() const
 */
 unsigned CIDSPeak::GetImageHeight() const
 {
-    return img_.Height();
+    unsigned height = roiTrackHeight_ != 0 ? roiTrackHeight_.load() : getConfig()->height;
+    return height / previewActiveFactor_;
 }
 
 /**
@@ -515,7 +1864,7 @@ unsigned CIDSPeak::GetImageHeight() const
 */
 unsigned CIDSPeak::GetImageBytesPerPixel() const
 {
-    return img_.Depth();
+    return getConfig()->bytesPerPixel;
 }
 
 /**
@@ -526,7 +1875,7 @@ unsigned CIDSPeak::GetImageBytesPerPixel() const
 */
 unsigned CIDSPeak::GetBitDepth() const
 {
-    return bitDepth_;
+    return getConfig()->bitDepth;
 }
 
 /**
@@ -535,7 +1884,7 @@ unsigned CIDSPeak::GetBitDepth() const
 */
 long CIDSPeak::GetImageBufferSize() const
 {
-    return img_.Width() * img_.Height() * GetImageBytesPerPixel();
+    return GetImageWidth() * GetImageHeight() * GetImageBytesPerPixel();
 }
 
 /**
@@ -559,6 +1908,7 @@ int CIDSPeak::SetROI(unsigned x, unsigned y, unsigned xSize, unsigned ySize)
         multiROIYs_.clear();
         multiROIWidths_.clear();
         multiROIHeights_.clear();
+        roiCycleSettings_.clear();
         if (xSize == 0 && ySize == 0)
         {
             // effectively clear ROI
@@ -595,6 +1945,7 @@ int CIDSPeak::SetROI(unsigned x, unsigned y, unsigned xSize, unsigned ySize)
         roi.size.width = xSize;
         roi.size.height = ySize;
         status = peak_ROI_Set(hCam, roi);
+        publishConfig();
     }
     else { return DEVICE_CAN_NOT_SET_PROPERTY; }
     return nRet;
@@ -603,15 +1954,26 @@ int CIDSPeak::SetROI(unsigned x, unsigned y, unsigned xSize, unsigned ySize)
 /**
 * Returns the actual dimensions of the current ROI.
 * If multiple ROIs are set, then the returned ROI should encompass all of them.
+* While ROI tracking runs this is the tracked ROI, which the images have.
 * Required by the MM::Camera API.
 */
 int CIDSPeak::GetROI(unsigned& x, unsigned& y, unsigned& xSize, unsigned& ySize)
 {
-    x = roiX_;
-    y = roiY_;
+    if (roiTrackWidth_ != 0)
+    {
+        x = roiTrackX_;
+        y = roiTrackY_;
+        xSize = roiTrackWidth_;
+        ySize = roiTrackHeight_;
+        return DEVICE_OK;
+    }
 
-    xSize = img_.Width();
-    ySize = img_.Height();
+    std::shared_ptr<const AcqConfig> config = getConfig();
+    x = config->roiX;
+    y = config->roiY;
+
+    xSize = config->width;
+    ySize = config->height;
 
     return DEVICE_OK;
 }
@@ -680,36 +2042,95 @@ int CIDSPeak::SetMultiROI(const unsigned int* xs, const unsigned int* ys,
     multiROIYs_.clear();
     multiROIWidths_.clear();
     multiROIHeights_.clear();
-    unsigned int minX = UINT_MAX;
-    unsigned int minY = UINT_MAX;
-    unsigned int maxX = 0;
-    unsigned int maxY = 0;
     for (unsigned int i = 0; i < numROIs; ++i)
     {
         multiROIXs_.push_back(xs[i]);
         multiROIYs_.push_back(ys[i]);
         multiROIWidths_.push_back(widths[i]);
         multiROIHeights_.push_back(heights[i]);
-        if (minX > xs[i])
-        {
-            minX = xs[i];
-        }
-        if (minY > ys[i])
-        {
-            minY = ys[i];
-        }
-        if (xs[i] + widths[i] > maxX)
-        {
-            maxX = xs[i] + widths[i];
-        }
-        if (ys[i] + heights[i] > maxY)
+    }
+    return applyMultiROI();
+}
+
+/**
+* Sets up the camera for the ROIs of SetMultiROI. Without cycling the image is
+* the bounding box of all ROIs. With cycling every frame reads one ROI, all
+* frames having the size of the largest ROI (the sensor readout size can't
+* change frame by frame, only its offset), see publishConfig for the cycle.
+*/
+int CIDSPeak::applyMultiROI()
+{
+    roiCycleSettings_.clear();
+    size_t numROIs = multiROIXs_.size();
+    if (!roiCycling_ || numROIs < 2)
+    {
+        unsigned int minX = UINT_MAX;
+        unsigned int minY = UINT_MAX;
+        unsigned int maxX = 0;
+        unsigned int maxY = 0;
+        for (size_t i = 0; i < numROIs; ++i)
         {
-            maxY = ys[i] + heights[i];
+            if (minX > multiROIXs_[i])
+            {
+                minX = multiROIXs_[i];
+            }
+            if (minY > multiROIYs_[i])
+            {
+                minY = multiROIYs_[i];
+            }
+            if (multiROIXs_[i] + multiROIWidths_[i] > maxX)
+            {
+                maxX = multiROIXs_[i] + multiROIWidths_[i];
+            }
+            if (multiROIYs_[i] + multiROIHeights_[i] > maxY)
+            {
+                maxY = multiROIYs_[i] + multiROIHeights_[i];
+            }
         }
+        img_.Resize(maxX - minX, maxY - minY);
+        roiX_ = minX;
+        roiY_ = minY;
+        publishConfig();
+        return DEVICE_OK;
+    }
+
+    if (peak_ROI_GetAccessStatus(hCam) != PEAK_ACCESS_READWRITE) { return DEVICE_CAN_NOT_SET_PROPERTY; }
+    unsigned xSize = roiMinSizeX_;
+    unsigned ySize = roiMinSizeY_;
+    for (size_t i = 0; i < numROIs; ++i)
+    {
+        if (multiROIWidths_[i] > xSize) { xSize = multiROIWidths_[i]; }
+        if (multiROIHeights_[i] > ySize) { ySize = multiROIHeights_[i]; }
     }
-    img_.Resize(maxX - minX, maxY - minY);
-    roiX_ = minX;
-    roiY_ = minY;
+    // Round up to the increment, without exceeding the sensor
+    if (xSize % roiInc_ != 0) { xSize += roiInc_ - xSize % roiInc_; }
+    if (ySize % roiInc_ != 0) { ySize += roiInc_ - ySize % roiInc_; }
+    if (xSize > (unsigned int)cameraCCDXSize_) { xSize = cameraCCDXSize_ - cameraCCDXSize_ % roiInc_; }
+    if (ySize > (unsigned int)cameraCCDYSize_) { ySize = cameraCCDYSize_ - cameraCCDYSize_ % roiInc_; }
+    for (size_t i = 0; i < numROIs; ++i)
+    {
+        // Check if the region goes out of bounds, if so, push it in
+        unsigned x = multiROIXs_[i];
+        unsigned y = multiROIYs_[i];
+        if (x + xSize > (unsigned int)cameraCCDXSize_) { x = cameraCCDXSize_ - xSize; }
+        if (y + ySize > (unsigned int)cameraCCDYSize_) { y = cameraCCDYSize_ - ySize; }
+        FrameSetting setting = { -1.0, -1.0, "" };
+        setting.roiX = x - x % roiInc_;
+        setting.roiY = y - y % roiInc_;
+        roiCycleSettings_.push_back(setting);
+    }
+
+    peak_roi roi;
+    roi.offset.x = (uint32_t)roiCycleSettings_[0].roiX;
+    roi.offset.y = (uint32_t)roiCycleSettings_[0].roiY;
+    roi.size.width = xSize;
+    roi.size.height = ySize;
+    status = peak_ROI_Set(hCam, roi);
+    if (status != PEAK_STATUS_SUCCESS) { return ERR_NO_WRITE_ACCESS; }
+    img_.Resize(xSize, ySize);
+    roiX_ = roi.offset.x;
+    roiY_ = roi.offset.y;
+    publishConfig();
     return DEVICE_OK;
 }
 
@@ -778,42 +2199,71 @@ double CIDSPeak::GetSequenceExposure()
 /**
 * Sets exposure in milliseconds.
 * Required by the MM::Camera API.
+* This is called for every MDA event with per-channel exposures, so it does a
+* single SDK write. The frame rate range is only marked for recomputation (by
+* framerateSet) when the new or old exposure is long enough to limit it, and
+* only then the exposure range is re-read before clamping. When the camera
+* refuses the exposure, the unchanged one is reported back to the core.
 */
 void CIDSPeak::SetExposure(double exp)
 {
-    // Convert milliseconds to microseconds (peak cameras expect time in microseconds)
-    // and make exposure set multiple of increment.
-    double exposureSet = ceil(exp / exposureInc_) * exposureInc_ * 1000;
-    // Check if we can write to the exposure time of the camera, if not do nothing
-    if (peak_ExposureTime_GetAccessStatus(hCam) == PEAK_ACCESS_READWRITE)
-    {
-        // Check if exposure time is less than the minimun exposure time
-        // If so, set it to minimum exposure time.
-        if (exp <= exposureMin_) {
-            printf("Exposure time too short. Exposure time set to minimum.");
-            status = peak_ExposureTime_Set(hCam, exposureMin_ * 1000);
-        }
-        // Check if exposure time is less than the maximum exposure time
-        // If so, set it to maximum exposure time.
-        else if (exp >= exposureMax_) {
-            printf("Exposure time too long. Exposure time set to maximum.");
-            status = peak_ExposureTime_Set(hCam, exposureMax_ * 1000);
-        }
-        // 
-        else
+    MM::MMTime startTime = GetCurrentMMTime();
+
+    if (peak_ExposureTime_GetAccessStatus(hCam) != PEAK_ACCESS_READWRITE)
+    {
+        LogMessage("Exposure time is not writable, keeping " + string(CDeviceUtils::ConvertToString(exposureCur_)) + " ms");
+        GetCoreCallback()->OnExposureChanged(this, exposureCur_);
+        return;
+    }
+    // A long exposure may have lowered the frame rate, and with it the
+    // longest possible exposure
+    if (framerateLimitsDirty_)
+    {
+        readExposureRange();
+        updateFramerateLimits();
+    }
+
+    // Clamp to the range of the camera and round up to its exposure grid,
+    // which starts at the minimum exposure (a tiny tolerance keeps values
+    // already on the grid from moving up a step).
+    double exposureSet;
+    if (exp <= exposureMin_) { exposureSet = exposureMin_; }
+    else if (exp >= exposureMax_) { exposureSet = exposureMax_; }
+    else if (exposureInc_ <= 0) { exposureSet = exp; }
+    else
+    {
+        exposureSet = exposureMin_ + ceil((exp - exposureMin_) / exposureInc_ - 1e-6) * exposureInc_;
+        if (exposureSet > exposureMax_) { exposureSet = exposureMax_; }
+    }
+
+    if (exposureSet != exposureCur_)
+    {
+        // peak cameras expect time in microseconds. If we can't write to the
+        // exposure time of the camera, do nothing.
+        status = peak_ExposureTime_Set(hCam, exposureSet * 1000);
+        if (status != PEAK_STATUS_SUCCESS)
         {
-            status = peak_ExposureTime_Set(hCam, exposureSet);
+            LogMessage("Could not set the exposure time to " + string(CDeviceUtils::ConvertToString(exposureSet))
+                + " ms, keeping " + CDeviceUtils::ConvertToString(exposureCur_) + " ms");
+            SetProperty(MM::g_Keyword_Exposure, CDeviceUtils::ConvertToString(exposureCur_));
+            GetCoreCallback()->OnExposureChanged(this, exposureCur_);
+            exposureChangeLatencyUs_ = (GetCurrentMMTime() - startTime).getUsec();
+            return;
         }
-        // Update framerate range
-        status = peak_FrameRate_GetRange(hCam, &framerateMin_, &framerateMax_, &framerateInc_);
-        SetPropertyLimits("MDA framerate", framerateMin_, framerateMax_);
 
-        // Set displayed exposure time
-        status = peak_ExposureTime_Get(hCam, &exposureCur_);
-        exposureCur_ /= 1000;
+        // Exposures well below the shortest frame period don't change the
+        // frame rate range. With a global reset shutter the readout follows
+        // the exposure, so it adds to the frame period.
+        double longestExposure = exposureSet > exposureCur_ ? exposureSet : exposureCur_;
+        if ((longestExposure + serialReadoutMs_) * framerateMax_ >= FRAMERATE_LIMIT_EXPOSURE_FRACTION * 1000) { framerateLimitsDirty_ = true; }
+
+        exposureCur_ = exposureSet;
+        updateSnapConfig();
+        publishConfig();
         SetProperty(MM::g_Keyword_Exposure, CDeviceUtils::ConvertToString(exposureCur_));
-        GetCoreCallback()->OnExposureChanged(this, exp);
     }
+    GetCoreCallback()->OnExposureChanged(this, exposureCur_);
+    exposureChangeLatencyUs_ = (GetCurrentMMTime() - startTime).getUsec();
 }
 
 /**
@@ -838,10 +2288,21 @@ int CIDSPeak::SetBinning(int binF)
     status = peak_Binning_Set(hCam, (uint32_t)binF, (uint32_t)binF);
     if (status != PEAK_STATUS_SUCCESS) { return DEVICE_ERR; }
     binSize_ = binF;
+    publishConfig();
     int nRet = SetProperty(MM::g_Keyword_Binning, CDeviceUtils::ConvertToString(binF));
     return nRet;
 }
 
+/**
+* Sets the decimation (line and column skipping) factor of the sensor.
+*/
+int CIDSPeak::SetDecimation(int decF)
+{
+    // The property handler writes the camera and resizes the image
+    int nRet = SetProperty("Decimation", CDeviceUtils::ConvertToString(decF));
+    return nRet;
+}
+
 int CIDSPeak::IsExposureSequenceable(bool& isSequenceable) const
 {
     isSequenceable = isSequenceable_;
@@ -915,20 +2376,52 @@ int CIDSPeak::SendExposureSequence() const {
     return DEVICE_OK;
 }
 
-int CIDSPeak::SetAllowedBinning()
+/**
+* Turns the running exposure and gain sequences into the setting cycle of the
+* next sequence acquisition. Frame i gets element i of each sequence (shorter
+* sequences repeat). The cycle is applied by the camera sequencer, or at the
+* frame boundaries by the acquisition thread, and dropped in endCycle.
+*/
+int CIDSPeak::buildSequenceCycle()
 {
-    int nRet = DEVICE_OK;
-    if (peak_Binning_GetAccessStatus(hCam) == PEAK_ACCESS_READWRITE)
+    vector<FrameSetting> cycle;
+    size_t nExposures = sequenceRunning_ ? exposureSequence_.size() : 0;
+    size_t nGains = gainSequenceRunning_ ? gainSequence_.size() : 0;
+    size_t nFrames = nExposures > nGains ? nExposures : nGains;
+    for (size_t i = 0; i < nFrames; i++)
     {
-        // Get the binning factors, uses two staged data query (first get length of list, then get list)
-        size_t binningFactorCount;
-        status = peak_Binning_FactorY_GetList(hCam, NULL, &binningFactorCount);
-        if (status != PEAK_STATUS_SUCCESS) { return DEVICE_ERR; }
-        uint32_t* binningFactorList = (uint32_t*)calloc(binningFactorCount, sizeof(uint32_t));
-        status = peak_Binning_FactorY_GetList(hCam, binningFactorList, &binningFactorCount);
-        if (status != PEAK_STATUS_SUCCESS) { return DEVICE_ERR; }
-
-        bool curr_bin_invalid = true;
+        FrameSetting setting = { -1.0, -1.0, "" };
+        if (nExposures > 0) { setting.exposureMs = exposureSequence_[i % nExposures]; }
+        if (nGains > 0) { setting.gain = gainSequence_[i % nGains]; }
+        cycle.push_back(setting);
+    }
+    if (!cycle.empty() && (hdrMode_ != HDR_MODE_OFF || interleavedChannels_ > 0 || !roiCycleSettings_.empty()))
+    {
+        return ERR_CYCLE_CONFLICT;
+    }
+
+    {
+        MMThreadGuard g(configWriteLock_);
+        sequenceCycle_ = cycle;
+    }
+    publishConfig();
+    return DEVICE_OK;
+}
+
+int CIDSPeak::SetAllowedBinning()
+{
+    int nRet = DEVICE_OK;
+    if (peak_Binning_GetAccessStatus(hCam) == PEAK_ACCESS_READWRITE)
+    {
+        // Get the binning factors, uses two staged data query (first get length of list, then get list)
+        size_t binningFactorCount;
+        status = peak_Binning_FactorY_GetList(hCam, NULL, &binningFactorCount);
+        if (status != PEAK_STATUS_SUCCESS) { return DEVICE_ERR; }
+        vector<uint32_t> binningFactorList(binningFactorCount);
+        status = peak_Binning_FactorY_GetList(hCam, binningFactorList.data(), &binningFactorCount);
+        if (status != PEAK_STATUS_SUCCESS) { return DEVICE_ERR; }
+
+        bool curr_bin_invalid = true;
         vector<string> binValues;
         for (size_t i = 0; i < binningFactorCount; i++)
         {
@@ -953,6 +2446,45 @@ int CIDSPeak::SetAllowedBinning()
 }
 
 
+/**
+* Same as SetAllowedBinning, for decimation. Cameras without decimation only
+* allow 1.
+*/
+int CIDSPeak::SetAllowedDecimation()
+{
+    int nRet = DEVICE_OK;
+    vector<string> decimationValues;
+    bool curr_dec_invalid = true;
+    if (peak_Decimation_GetAccessStatus(hCam) == PEAK_ACCESS_READWRITE)
+    {
+        // Get the decimation factors, uses two staged data query (first get length of list, then get list)
+        size_t decimationFactorCount = 0;
+        status = peak_Decimation_FactorY_GetList(hCam, NULL, &decimationFactorCount);
+        if (status != PEAK_STATUS_SUCCESS) { return DEVICE_ERR; }
+        vector<uint32_t> decimationFactorList(decimationFactorCount);
+        status = peak_Decimation_FactorY_GetList(hCam, decimationFactorList.data(), &decimationFactorCount);
+        if (status != PEAK_STATUS_SUCCESS) { return DEVICE_ERR; }
+
+        for (size_t i = 0; i < decimationFactorCount; i++)
+        {
+            if (decimationFactorList[i] == (uint32_t)decimation_) { curr_dec_invalid = false; }
+
+            decimationValues.push_back(to_string(decimationFactorList[i]));
+        }
+    }
+    if (decimationValues.empty()) { decimationValues.push_back("1"); }
+
+    nRet = ClearAllowedValues("Decimation");
+    nRet = SetAllowedValues("Decimation", decimationValues);
+    if (peak_Decimation_GetAccessStatus(hCam) != PEAK_ACCESS_READWRITE)
+    {
+        decimation_ = 1;
+        return nRet;
+    }
+    nRet = SetDecimation(curr_dec_invalid ? 1 : decimation_);
+    return nRet;
+}
+
 /**
  * Required by the MM::Camera API
  * Please implement this yourself and do not rely on the base class implementation
@@ -983,19 +2515,94 @@ int CIDSPeak::StopSequenceAcquisition()
 */
 int CIDSPeak::StartSequenceAcquisition(long numImages, double interval_ms, bool stopOnOverflow)
 {
-    if (IsCapturing())
+    // The kernel benchmark would compete with the acquisition for the cores
+    if (IsCapturing() || benchmarkRunning_)
     {
         return DEVICE_CAMERA_BUSY_ACQUIRING;
     }
-    int nRet = DEVICE_OK;
+    int nRet = buildSequenceCycle();
+    if (nRet != DEVICE_OK)
+        return nRet;
+
+    if (compositeMode_ != COMPOSITE_OFF && (triggerWidthExposure_ || !getConfig()->cycle.empty()))
+        return ERR_COMPOSITE_CONFLICT;
+
+    if (triggerWidthExposure_)
+    {
+        // Every external pulse exposes one frame, so the exposure times and
+        // the frame rate are entirely up to the trigger source
+        if (!getConfig()->cycle.empty())
+            return ERR_TRIGGER_WIDTH_CONFLICT;
+        nRet = applyTriggerConfig(TRIGGER_CONFIG_WIDTH);
+        if (nRet != DEVICE_OK)
+            return nRet;
+    }
+    else if (!getConfig()->cycle.empty())
+    {
+        // Settings cycled frame by frame, on the camera sequencer if it has one
+        nRet = beginCycle(true);
+        if (nRet != DEVICE_OK)
+            return nRet;
+    }
+    else
+    {
+        // Sequences run free at the MDA frame rate. Cameras without trigger
+        // features always run free, so a failure here is not fatal.
+        nRet = applyTriggerConfig(TRIGGER_CONFIG_FREERUN);
+        if (nRet != DEVICE_OK)
+            LogMessage("Could not switch the trigger off, assuming the camera runs free");
+    }
 
     // Adjust framerate to match requested interval between frames
-    nRet = framerateSet(1000 / interval_ms);
+    if (compositeMode_ == COMPOSITE_STAGGERED)
+    {
+        // Each camera takes every other frame
+        nRet = framerateSet(500 / interval_ms);
+        if (nRet != DEVICE_OK)
+            return nRet;
+        nRet = applyStaggerDelay();
+        if (nRet != DEVICE_OK)
+            return nRet;
+        staggerRemaining_ = numImages;
+        if (numImages != LONG_MAX)
+            numImages = (numImages + 1) / 2;
+    }
+    else if (!triggerWidthExposure_)
+        nRet = framerateSet(1000 / interval_ms);
+
+    if (compositeMode_ != COMPOSITE_OFF)
+    {
+        // Fresh clock offsets (and a wiring check) with the final trigger
+        // delay of the slaves, to anchor the first set in absolute time
+        nRet = validateSync();
+        if (nRet != DEVICE_OK)
+            return nRet;
+        if (applyTriggerConfig(TRIGGER_CONFIG_FREERUN) != DEVICE_OK)
+            LogMessage("Could not switch the trigger off, assuming the camera runs free");
+    }
 
     // Wait until shutter is ready
     nRet = GetCoreCallback()->PrepareForAcq(this);
     if (nRet != DEVICE_OK)
         return nRet;
+
+    // Live view (the only unbounded sequence) can run on a downsampled
+    // preview, MDA sequences always get full resolution frames. The core
+    // sized its buffer before this call, so it is resized here.
+    bool plainLive = numImages == LONG_MAX && compositeMode_ == COMPOSITE_OFF && getConfig()->cycle.empty();
+    roiTrackActive_ = plainLive && roiTracking_ && syncSlaves_.empty();
+    roiTrackFramerate_ = 1000 / interval_ms;
+    previewActiveFactor_ = 1;
+    if (plainLive && previewDownsampling_ > 1)
+    {
+        previewActiveFactor_ = previewDownsampling_;
+        if (!GetCoreCallback()->InitializeImageBuffer(GetNumberOfChannels(), 1,
+            GetImageWidth(), GetImageHeight(), GetImageBytesPerPixel()))
+        {
+            previewActiveFactor_ = 1;
+            return DEVICE_ERR;
+        }
+    }
     sequenceStartTime_ = GetCurrentMMTime();
     imageCounter_ = 0;
     thd_->Start(numImages, interval_ms);
@@ -1008,6 +2615,23 @@ int CIDSPeak::StartSequenceAcquisition(long numImages, double interval_ms, bool
  */
 int CIDSPeak::InsertImage()
 {
+    return InsertImage(map<string, string>());
+}
+
+/*
+ * Same as above, with extra per frame metadata
+ */
+int CIDSPeak::InsertImage(const map<string, string>& frameTags)
+{
+    return InsertImage(img_, frameTags);
+}
+
+/*
+ * Same as above, for an image other than img_ (e.g. composites)
+ */
+int CIDSPeak::InsertImage(const ImgBuffer& fullImg, const map<string, string>& frameTags)
+{
+    const ImgBuffer& img = previewActiveFactor_ > 1 ? downsamplePreview(fullImg) : fullImg;
     MM::MMTime timeStamp = this->GetCurrentMMTime();
     char label[MM::MaxStrLength];
     this->GetLabel(label);
@@ -1016,33 +2640,359 @@ int CIDSPeak::InsertImage()
     Metadata md;
     md.put("Camera", label);
     md.put(MM::g_Keyword_Elapsed_Time_ms, CDeviceUtils::ConvertToString((timeStamp - sequenceStartTime_).getMsec()));
-    md.put(MM::g_Keyword_Metadata_ROI_X, CDeviceUtils::ConvertToString((long)roiX_));
-    md.put(MM::g_Keyword_Metadata_ROI_Y, CDeviceUtils::ConvertToString((long)roiY_));
-
-    char buf[MM::MaxStrLength];
-    GetProperty(MM::g_Keyword_Binning, buf);
-    md.put(MM::g_Keyword_Binning, buf);
+    md.put(MM::g_Keyword_Metadata_ROI_X, CDeviceUtils::ConvertToString((long)threadConfig_->roiX));
+    md.put(MM::g_Keyword_Metadata_ROI_Y, CDeviceUtils::ConvertToString((long)threadConfig_->roiY));
+    md.put(MM::g_Keyword_Binning, CDeviceUtils::ConvertToString(threadConfig_->binning));
+    md.put("Decimation", CDeviceUtils::ConvertToString(threadConfig_->decimation));
+    md.put("Shutter mode", threadConfig_->shutterMode);
+    if (frameTimestamp_ != 0)
+    {
+        // Exposure start in the host clock, same origin as ElapsedTime-ms, so
+        // it doesn't include the variable latency of the transfer and insert
+        md.put("Device-Timestamp-ns", CDeviceUtils::ConvertToString((double)frameTimestamp_));
+        if (clock_.IsValid())
+        {
+            double hostUs = clock_.ToHostUs(frameTimestamp_);
+            md.put("Exposure-Start-Elapsed-ms", CDeviceUtils::ConvertToString((hostUs - sequenceStartTime_.getUsec()) / 1000));
+            md.put("Clock-Drift-ppm", CDeviceUtils::ConvertToString(clock_.DriftPpm()));
+        }
+    }
+    if (threadConfig_->triggerWidthExposure)
+    {
+        md.put("Exposure control", g_ExposureControl_TriggerWidth);
+    }
+    if (threadConfig_->hdrMode != HDR_MODE_OFF)
+    {
+        ostringstream exposures;
+        for (size_t k = 0; k < threadConfig_->hdrExposures.size(); k++)
+        {
+            exposures << (k > 0 ? "," : "") << threadConfig_->hdrExposures[k];
+        }
+        md.put("HDR-Exposures-ms", exposures.str());
+    }
+    if (previewActiveFactor_ > 1)
+    {
+        md.put("Preview-Downsampling", CDeviceUtils::ConvertToString((long)previewActiveFactor_));
+    }
+    for (map<string, string>::const_iterator it = frameTags.begin(); it != frameTags.end(); ++it)
+    {
+        md.put(it->first, it->second);
+    }
 
     imageCounter_++;
 
+    std::chrono::steady_clock::time_point insertStart = std::chrono::steady_clock::now();
     MMThreadGuard g(imgPixelsLock_);
-    int nRet = GetCoreCallback()->InsertImage(this, img_.GetPixels(),
-        img_.Width(),
-        img_.Height(),
-        img_.Depth(),
+    int nRet = GetCoreCallback()->InsertImage(this, img.GetPixels(),
+        img.Width(),
+        img.Height(),
+        img.Depth(),
         md.Serialize().c_str());
 
+    if (nRet == DEVICE_BUFFER_OVERFLOW) { metrics_.Increment(AcqMetrics::BUFFER_OVERFLOWS); }
     if (!stopOnOverflow_ && nRet == DEVICE_BUFFER_OVERFLOW)
     {
         // do not stop on overflow - just reset the buffer
         GetCoreCallback()->ClearImageBuffer(this);
-        return GetCoreCallback()->InsertImage(this, img_.GetPixels(),
-            img_.Width(),
-            img_.Height(),
-            img_.Depth(),
+        nRet = GetCoreCallback()->InsertImage(this, img.GetPixels(),
+            img.Width(),
+            img.Height(),
+            img.Depth(),
             md.Serialize().c_str());
     }
-    else { return nRet; }
+    observeLatency(AcqMetrics::STAGE_INSERT, secondsSince(insertStart));
+    if (nRet == DEVICE_OK) { metrics_.FrameInserted(); }
+    return nRet;
+}
+
+/**
+* Builds the preview pyramid of a frame, one 2x box filter level at a time up
+* to the active downsampling, and returns the last level.
+*/
+const ImgBuffer& CIDSPeak::downsamplePreview(const ImgBuffer& img)
+{
+    size_t nLevels = 0;
+    for (unsigned f = previewActiveFactor_; f > 1; f /= 2) { nLevels++; }
+    if (previewLevels_.size() != nLevels) { previewLevels_.resize(nLevels); }
+
+    const ImgBuffer* src = &img;
+    for (size_t k = 0; k < nLevels; k++)
+    {
+        ImgBuffer& dst = previewLevels_[k];
+        if (dst.Width() != src->Width() / 2 || dst.Height() != src->Height() / 2 || dst.Depth() != src->Depth())
+        {
+            dst.Resize(src->Width() / 2, src->Height() / 2, src->Depth());
+        }
+        const unsigned char* pSrc = src->GetPixels();
+        unsigned char* pDst = const_cast<unsigned char*>(dst.GetPixels());
+        if (src->Depth() == 2)
+        {
+            boxDownsample2<uint16_t, 1>((const uint16_t*)pSrc, (uint16_t*)pDst, src->Width(), src->Height(), pool_);
+        }
+        else if (src->Depth() == 4 && nComponents_ == 4)
+        {
+            boxDownsample2<uint8_t, 4>(pSrc, pDst, src->Width(), src->Height(), pool_);
+        }
+        else if (src->Depth() == 4)
+        {
+            // 32bit HDR
+            boxDownsample2<float, 1>((const float*)pSrc, (float*)pDst, src->Width(), src->Height(), pool_);
+        }
+        else
+        {
+            boxDownsample2<uint8_t, 1>(pSrc, pDst, src->Width(), src->Height(), pool_);
+        }
+        src = &dst;
+    }
+    return *src;
+}
+
+/**
+* Starts ROI tracking of a live sequence from the full user ROI.
+*/
+void CIDSPeak::beginRoiTracking(const AcqConfig& config)
+{
+    if (!roiTrackActive_) { return; }
+    roiTrackFull_.offset.x = config.roiX;
+    roiTrackFull_.offset.y = config.roiY;
+    roiTrackFull_.size.width = config.width;
+    roiTrackFull_.size.height = config.height;
+    roiTrackImg_.Resize(config.width, config.height, config.bytesPerPixel);
+    roiTrackShrinkFrames_ = 0;
+    roiTrackLostFrames_ = 0;
+    roiTrackLastSearch_ = std::chrono::steady_clock::now();
+    roiTrackReconfigurations_ = 0;
+    roiTrackX_ = config.roiX;
+    roiTrackY_ = config.roiY;
+    roiTrackWidth_ = config.width;
+    roiTrackHeight_ = config.height;
+}
+
+/**
+* Moves the tracked ROI after a frame. The signal is the bounding box of the
+* samples above the threshold, plus the margin:
+* - touching an edge of the ROI (the signal moves), the ROI follows it with
+*   an offset only move if the box still fits, else it grows to the user ROI
+* - a box much smaller than the ROI for ROI_TRACK_SETTLE_FRAMES frames
+*   shrinks it to the union of those boxes (hysteresis)
+* - no signal for ROI_TRACK_SETTLE_FRAMES frames, and every search interval,
+*   the ROI grows to the user ROI to look for signal elsewhere
+*/
+void CIDSPeak::updateRoiTracking(const AcqConfig& config, const ImgBuffer& img, const peak_roi& frameRoi)
+{
+    peak_roi current;
+    current.offset.x = roiTrackX_;
+    current.offset.y = roiTrackY_;
+    current.size.width = roiTrackWidth_;
+    current.size.height = roiTrackHeight_;
+    bool isFull = current.size.width == roiTrackFull_.size.width && current.size.height == roiTrackFull_.size.height;
+
+    if (!isFull && secondsSince(roiTrackLastSearch_) > roiTrackSearchS_)
+    {
+        roiTrackLastSearch_ = std::chrono::steady_clock::now();
+        applyTrackingRoi(config, roiTrackFull_);
+        return;
+    }
+
+    double fullScale = config.bytesPerPixel == 2 ? pow(2.0, (double)config.bitDepth) - 1 : 255.0;
+    double threshold = roiTrackThresholdPct_ / 100 * fullScale;
+    unsigned x0, y0, x1, y1;
+    bool found;
+    if (config.bytesPerPixel == 2)
+    {
+        found = findActiveRegion<uint16_t, 1>((const uint16_t*)img.GetPixels(), img.Width(), img.Height(), (uint16_t)threshold, x0, y0, x1, y1);
+    }
+    else if (config.bytesPerPixel == 4)
+    {
+        found = findActiveRegion<uint8_t, 4>(img.GetPixels(), img.Width(), img.Height(), (uint8_t)threshold, x0, y0, x1, y1);
+    }
+    else
+    {
+        found = findActiveRegion<uint8_t, 1>(img.GetPixels(), img.Width(), img.Height(), (uint8_t)threshold, x0, y0, x1, y1);
+    }
+
+    if (!found)
+    {
+        roiTrackShrinkFrames_ = 0;
+        if (!isFull && ++roiTrackLostFrames_ >= ROI_TRACK_SETTLE_FRAMES)
+        {
+            roiTrackLostFrames_ = 0;
+            applyTrackingRoi(config, roiTrackFull_);
+        }
+        return;
+    }
+    roiTrackLostFrames_ = 0;
+
+    // Box in sensor coordinates, the last sample stands for the pixels up to the next one
+    unsigned margin = (unsigned)roiTrackMarginPx_;
+    unsigned left = frameRoi.offset.x + x0;
+    unsigned top = frameRoi.offset.y + y0;
+    unsigned right = frameRoi.offset.x + x1 + ROI_TRACK_SAMPLE_STEP;
+    unsigned bottom = frameRoi.offset.y + y1 + ROI_TRACK_SAMPLE_STEP;
+    peak_roi target = clampTrackingRoi((left + right) / 2, (top + bottom) / 2,
+        right - left + 2 * margin, bottom - top + 2 * margin);
+
+    unsigned edge = ROI_TRACK_SAMPLE_STEP + margin / 4;
+    bool touching = (x0 < edge && frameRoi.offset.x > roiTrackFull_.offset.x)
+        || (y0 < edge && frameRoi.offset.y > roiTrackFull_.offset.y)
+        || (x1 + edge >= frameRoi.size.width && frameRoi.offset.x + frameRoi.size.width < roiTrackFull_.offset.x + roiTrackFull_.size.width)
+        || (y1 + edge >= frameRoi.size.height && frameRoi.offset.y + frameRoi.size.height < roiTrackFull_.offset.y + roiTrackFull_.size.height);
+    if (touching)
+    {
+        roiTrackShrinkFrames_ = 0;
+        if (target.size.width <= current.size.width && target.size.height <= current.size.height)
+        {
+            applyTrackingRoi(config, clampTrackingRoi((left + right) / 2, (top + bottom) / 2, current.size.width, current.size.height));
+        }
+        else { applyTrackingRoi(config, roiTrackFull_); }
+        return;
+    }
+
+    if ((double)target.size.width * target.size.height >= ROI_TRACK_SHRINK_RATIO * current.size.width * current.size.height)
+    {
+        roiTrackShrinkFrames_ = 0;
+        return;
+    }
+    if (roiTrackShrinkFrames_ == 0) { roiTrackPending_ = target; }
+    else
+    {
+        // Union with the boxes of the previous frames
+        unsigned pendingLeft = std::min(roiTrackPending_.offset.x, target.offset.x);
+        unsigned pendingTop = std::min(roiTrackPending_.offset.y, target.offset.y);
+        unsigned pendingRight = std::max(roiTrackPending_.offset.x + roiTrackPending_.size.width, target.offset.x + target.size.width);
+        unsigned pendingBottom = std::max(roiTrackPending_.offset.y + roiTrackPending_.size.height, target.offset.y + target.size.height);
+        roiTrackPending_ = clampTrackingRoi((pendingLeft + pendingRight) / 2, (pendingTop + pendingBottom) / 2,
+            pendingRight - pendingLeft, pendingBottom - pendingTop);
+    }
+    if (++roiTrackShrinkFrames_ >= ROI_TRACK_SETTLE_FRAMES)
+    {
+        roiTrackShrinkFrames_ = 0;
+        // A fresh shrink, the next search for signal elsewhere is a full interval away
+        roiTrackLastSearch_ = std::chrono::steady_clock::now();
+        applyTrackingRoi(config, roiTrackPending_);
+    }
+}
+
+/**
+* Tracked ROI of (at least) the given size around a center, clamped like
+* SetROI does: minimum size, increments, and pushed inside the user ROI.
+* Sizes are rounded up to ROI_TRACK_SIZE_STEP so that most moves keep the
+* size and only change the offset.
+*/
+peak_roi CIDSPeak::clampTrackingRoi(unsigned centerX, unsigned centerY, unsigned width, unsigned height) const
+{
+    const peak_roi& full = roiTrackFull_;
+    unsigned inc = roiInc_ > 0 ? roiInc_ : 1;
+    width = (width + ROI_TRACK_SIZE_STEP - 1) / ROI_TRACK_SIZE_STEP * ROI_TRACK_SIZE_STEP;
+    height = (height + ROI_TRACK_SIZE_STEP - 1) / ROI_TRACK_SIZE_STEP * ROI_TRACK_SIZE_STEP;
+    if (width < roiMinSizeX_) { width = roiMinSizeX_; }
+    if (height < roiMinSizeY_) { height = roiMinSizeY_; }
+    if (width > full.size.width) { width = full.size.width; }
+    if (height > full.size.height) { height = full.size.height; }
+    width -= width % inc;
+    height -= height % inc;
+
+    peak_roi roi;
+    unsigned x = centerX > width / 2 ? centerX - width / 2 : 0;
+    unsigned y = centerY > height / 2 ? centerY - height / 2 : 0;
+    if (x < full.offset.x) { x = full.offset.x; }
+    if (y < full.offset.y) { y = full.offset.y; }
+    if (x + width > full.offset.x + full.size.width) { x = full.offset.x + full.size.width - width; }
+    if (y + height > full.offset.y + full.size.height) { y = full.offset.y + full.size.height - height; }
+    roi.offset.x = x - x % inc;
+    roi.offset.y = y - y % inc;
+    roi.size.width = width;
+    roi.size.height = height;
+    return roi;
+}
+
+/**
+* Reconfigures the running camera to a tracked ROI. A move of the same size
+* only writes the offset; a new size stops the acquisition, sets the ROI,
+* raises the frame rate to what the ROI allows (up to the requested one),
+* restarts the acquisition and resizes the core circular buffer. When the
+* buffer can't be resized, the ROI returns to the user ROI, and if even that
+* fails tracking ends.
+*/
+int CIDSPeak::applyTrackingRoi(const AcqConfig& config, const peak_roi& roi)
+{
+    if (roi.offset.x == roiTrackX_ && roi.offset.y == roiTrackY_
+        && roi.size.width == roiTrackWidth_ && roi.size.height == roiTrackHeight_)
+    {
+        return DEVICE_OK;
+    }
+    roiTrackReconfigurations_++;
+    if (roi.size.width == roiTrackWidth_ && roi.size.height == roiTrackHeight_
+        && peak_ROI_Offset_Set(hCam, roi.offset) == PEAK_STATUS_SUCCESS)
+    {
+        roiTrackX_ = roi.offset.x;
+        roiTrackY_ = roi.offset.y;
+        return DEVICE_OK;
+    }
+
+    peak_Acquisition_Stop(hCam);
+    acqRestarted_ = true;
+    peak_status acqStatus = peak_ROI_Set(hCam, roi);
+    if (acqStatus == PEAK_STATUS_SUCCESS)
+    {
+        roiTrackX_ = roi.offset.x;
+        roiTrackY_ = roi.offset.y;
+        roiTrackWidth_ = roi.size.width;
+        roiTrackHeight_ = roi.size.height;
+        roiTrackImg_.Resize(roi.size.width, roi.size.height, config.bytesPerPixel);
+        double framerateMin = 0, framerateMax = 0, framerateInc = 0;
+        if (peak_FrameRate_GetRange(hCam, &framerateMin, &framerateMax, &framerateInc) == PEAK_STATUS_SUCCESS)
+        {
+            peak_FrameRate_Set(hCam, roiTrackFramerate_ < framerateMax ? roiTrackFramerate_ : framerateMax);
+        }
+    }
+    else
+    {
+        logAsync(LogRing::LEVEL_WARNING, "Could not set the tracked ROI, keeping the previous one");
+    }
+    if (peak_Acquisition_Start(hCam, PEAK_INFINITE) != PEAK_STATUS_SUCCESS)
+    {
+        // The next frame wait fails and recovers the acquisition
+        logAsync(LogRing::LEVEL_ERROR, "Could not restart the acquisition after an ROI change");
+        return DEVICE_ERR;
+    }
+    if (acqStatus != PEAK_STATUS_SUCCESS) { return DEVICE_ERR; }
+    if (GetCoreCallback()->InitializeImageBuffer(GetNumberOfChannels(), 1, GetImageWidth(), GetImageHeight(), GetImageBytesPerPixel()))
+    {
+        return DEVICE_OK;
+    }
+
+    if (roi.size.width != roiTrackFull_.size.width || roi.size.height != roiTrackFull_.size.height)
+    {
+        logAsync(LogRing::LEVEL_WARNING, "Could not resize the image buffer for the tracked ROI, returning to the user ROI");
+        if (applyTrackingRoi(config, roiTrackFull_) == DEVICE_OK) { return DEVICE_OK; }
+        // Already ended by the nested call
+        if (!roiTrackActive_) { return DEVICE_ERR; }
+    }
+    logAsync(LogRing::LEVEL_ERROR, "Could not resize the image buffer, ROI tracking ended");
+    endRoiTracking(config);
+    acqRestarted_ = true;
+    if (peak_Acquisition_Start(hCam, PEAK_INFINITE) != PEAK_STATUS_SUCCESS)
+    {
+        logAsync(LogRing::LEVEL_ERROR, "Could not restart the acquisition after an ROI change");
+    }
+    return DEVICE_ERR;
+}
+
+/**
+* Restores the user ROI and frame rate at the end of a tracked sequence.
+*/
+void CIDSPeak::endRoiTracking(const AcqConfig& config)
+{
+    if (!roiTrackActive_) { return; }
+    roiTrackActive_ = false;
+    bool changed = roiTrackReconfigurations_ > 0;
+    roiTrackWidth_ = 0;
+    roiTrackHeight_ = 0;
+    if (!changed) { return; }
+    if (peak_Acquisition_IsStarted(hCam)) { peak_Acquisition_Stop(hCam); }
+    peak_ROI_Set(hCam, roiTrackFull_);
+    peak_FrameRate_Set(hCam, config.framerate);
 }
 
 /*
@@ -1051,64 +3001,216 @@ int CIDSPeak::InsertImage()
  */
 int CIDSPeak::RunSequenceOnThread()
 {
+    // Keep the clock model up to date (one latch per second, between frames)
+    if ((GetCurrentMMTime() - lastClockSample_).getMsec() > 1000) { sampleClock(); }
+
     int nRet = DEVICE_ERR;
-    MM::MMTime startTime = GetCurrentMMTime();
+    // The status member is shared with the property thread, use a local one here
+    peak_status acqStatus = PEAK_STATUS_SUCCESS;
+
+    // Only take a new configuration snapshot when a setting actually changed
+    if (!threadConfig_ || threadConfig_->version != configVersion_.load(std::memory_order_acquire))
+    {
+        threadConfig_ = getConfig();
+    }
 
     // Trigger
     if (triggerDevice_.length() > 0) {
         MM::Device* triggerDev = GetDevice(triggerDevice_.c_str());
         if (triggerDev != 0) {
-            LogMessage("trigger requested");
+            logAsync(LogRing::LEVEL_DEBUG, "trigger requested");
             triggerDev->SetProperty("Trigger", "+");
         }
     }
 
-    uint32_t three_frame_times_timeout_ms = (uint32_t)(3000 / framerateCur_ + 10);
+    if (threadConfig_->hdrMode != HDR_MODE_OFF)
+    {
+        // One call handles a whole bracket, which results in one image
+        nRet = acquireHdrBracket(*threadConfig_, img_);
+        if (nRet != DEVICE_OK) { return DEVICE_ERR; }
+        return InsertImage();
+    }
+    if (!threadConfig_->cycle.empty())
+    {
+        // Interleaved channels, ROI cycling and property sequences, tag every
+        // frame with the setting it was taken with
+        size_t cycleIndex;
+        nRet = acquireCycleFrame(*threadConfig_, img_, cycleIndex);
+        if (nRet != DEVICE_OK) { return DEVICE_ERR; }
+        map<string, string> frameTags;
+        if (threadConfig_->roiCycling)
+        {
+            // Position of the region this frame was read from
+            const FrameSetting& setting = threadConfig_->cycle[cycleIndex];
+            frameTags["MultiROIIndex"] = CDeviceUtils::ConvertToString((long)cycleIndex);
+            frameTags[MM::g_Keyword_Metadata_ROI_X] = CDeviceUtils::ConvertToString(setting.roiX);
+            frameTags[MM::g_Keyword_Metadata_ROI_Y] = CDeviceUtils::ConvertToString(setting.roiY);
+        }
+        else if (threadConfig_->propertySequence)
+        {
+            const FrameSetting& setting = threadConfig_->cycle[cycleIndex];
+            frameTags["SequenceIndex"] = CDeviceUtils::ConvertToString((long)cycleIndex);
+            double exposureMs = setting.exposureMs > 0 ? setting.exposureMs : threadConfig_->exposureMs;
+            frameTags[MM::g_Keyword_Exposure] = CDeviceUtils::ConvertToString(exposureMs);
+            frameTags["Gain Master"] = CDeviceUtils::ConvertToString(setting.gain >= 0 ? setting.gain : threadConfig_->gainMaster);
+        }
+        else
+        {
+            frameTags["InterleavedChannel"] = CDeviceUtils::ConvertToString((long)cycleIndex);
+        }
+        if (threadConfig_->separateChannels)
+        {
+            char channelName[MM::MaxStrLength];
+            GetChannelName((unsigned)cycleIndex, channelName);
+            frameTags[MM::g_Keyword_CameraChannelIndex] = CDeviceUtils::ConvertToString((long)cycleIndex);
+            frameTags[MM::g_Keyword_CameraChannelName] = channelName;
+        }
+        return InsertImage(frameTags);
+    }
+
+    uint32_t three_frame_times_timeout_ms = (uint32_t)(3000 / threadConfig_->framerate + 10);
+
+    if (threadConfig_->compositeMode != COMPOSITE_OFF)
+    {
+        // Frames of incomplete sets are dropped, wait for the next master frame
+        map<string, string> frameTags;
+        do
+        {
+            peak_frame_handle hMasterFrame;
+            std::chrono::steady_clock::time_point waitStart = std::chrono::steady_clock::now();
+            acqStatus = peak_Acquisition_WaitForFrame(hCam, three_frame_times_timeout_ms, &hMasterFrame);
+            if (acqStatus != PEAK_STATUS_SUCCESS) { return DEVICE_ERR; }
+            observeLatency(AcqMetrics::STAGE_WAIT, secondsSince(waitStart));
+            metrics_.Increment(AcqMetrics::FRAMES_ACQUIRED);
+            nRet = composeFrame(*threadConfig_, hMasterFrame, frameTags);
+            peak_Frame_Release(hCam, hMasterFrame);
+            if (nRet == ERR_COMPOSITE_INCOMPLETE) { metrics_.Increment(AcqMetrics::INCOMPLETE_SETS); }
+        } while (nRet == ERR_COMPOSITE_INCOMPLETE && !thd_->IsStopped());
+        if (nRet == ERR_COMPOSITE_INCOMPLETE) { return DEVICE_OK; }
+        if (nRet != DEVICE_OK) { return DEVICE_ERR; }
+        return insertComposite(*threadConfig_, frameTags);
+    }
 
     peak_frame_handle hFrame;
-    status = peak_Acquisition_WaitForFrame(hCam, three_frame_times_timeout_ms, &hFrame);
-    if (status != PEAK_STATUS_SUCCESS) { return DEVICE_ERR; }
-    else { nRet = DEVICE_OK; }
+    std::chrono::steady_clock::time_point waitStart = std::chrono::steady_clock::now();
+    nRet = waitForFrameRecovering(*threadConfig_, three_frame_times_timeout_ms, hFrame);
+    if (nRet != DEVICE_OK) { return DEVICE_ERR; }
+    observeLatency(AcqMetrics::STAGE_WAIT, secondsSince(waitStart));
+    metrics_.Increment(AcqMetrics::FRAMES_ACQUIRED);
 
     // At this point we successfully got a frame handle. We can deal with the info now!
-    nRet = transferBuffer(hFrame, img_);
-    if (nRet != DEVICE_OK) { return DEVICE_ERR; }
-    else { nRet = DEVICE_OK; }
+    ImgBuffer& img = roiTrackActive_ ? roiTrackImg_ : img_;
+    std::chrono::steady_clock::time_point transferStart = std::chrono::steady_clock::now();
+    nRet = threadConfig_->transfer(hCam, hFrame, img, pool_);
+    if (nRet != DEVICE_OK)
+    {
+        peak_Frame_Release(hCam, hFrame);
+        return DEVICE_ERR;
+    }
+    double transferS = secondsSince(transferStart);
+    observeLatency(AcqMetrics::STAGE_TRANSFER, transferS);
+    recordDemosaicCost(threadConfig_->demosaic, transferS, img);
+    if (peak_Frame_Timestamp_Get(hFrame, &frameTimestamp_) != PEAK_STATUS_SUCCESS) { frameTimestamp_ = 0; }
 
-    nRet = InsertImage();
-    if (nRet != DEVICE_OK) { return DEVICE_ERR; }
-    else { nRet = DEVICE_OK; }
+    map<string, string> frameTags;
+    if (!threadConfig_->syncSlaves.empty())
+    {
+        uint64_t masterTimestamp = 0;
+        peak_Frame_Timestamp_Get(hFrame, &masterTimestamp);
+        collectSyncFrames(*threadConfig_, masterTimestamp, frameTags);
+    }
+    peak_roi frameRoi;
+    frameRoi.offset.x = roiTrackX_;
+    frameRoi.offset.y = roiTrackY_;
+    frameRoi.size.width = roiTrackWidth_;
+    frameRoi.size.height = roiTrackHeight_;
+    if (roiTrackActive_ && peak_Frame_ROI_Get(hFrame, &frameRoi) == PEAK_STATUS_SUCCESS)
+    {
+        // The region the frame was actually read from, the tracked ROI moves
+        frameTags[MM::g_Keyword_Metadata_ROI_X] = CDeviceUtils::ConvertToString((long)frameRoi.offset.x);
+        frameTags[MM::g_Keyword_Metadata_ROI_Y] = CDeviceUtils::ConvertToString((long)frameRoi.offset.y);
+    }
+    nRet = InsertImage(img, frameTags);
+    if (nRet != DEVICE_OK)
+    {
+        peak_Frame_Release(hCam, hFrame);
+        return DEVICE_ERR;
+    }
 
     // Now we have transfered all information, we can release the frame.
-    status = peak_Frame_Release(hCam, hFrame);
-    if (status != PEAK_STATUS_SUCCESS) { return DEVICE_ERR; }
+    acqStatus = peak_Frame_Release(hCam, hFrame);
+    if (acqStatus != PEAK_STATUS_SUCCESS) { return DEVICE_ERR; }
     else { nRet = DEVICE_OK; }
 
+    // Moving the ROI stops and restarts the acquisition, so only with the frame released
+    if (roiTrackActive_) { updateRoiTracking(*threadConfig_, img, frameRoi); }
+
     return nRet;
 };
 
-bool CIDSPeak::IsCapturing() {
-    return !thd_->IsStopped();
+/**
+* Returns the number of channels, more than one only when interleaved channels
+* are inserted as separate channels or with multi ROI cycling (one per ROI).
+*/
+unsigned CIDSPeak::GetNumberOfChannels() const
+{
+    std::shared_ptr<const AcqConfig> config = getConfig();
+    if (config->compositeMode == COMPOSITE_CHANNELS) { return (unsigned)config->compositeSources.size(); }
+    return config->separateChannels ? (unsigned)config->cycle.size() : 1;
 }
 
-/*
- * called from the thread function before exit
- */
-void CIDSPeak::OnThreadExiting() throw()
+int CIDSPeak::GetChannelName(unsigned channel, char* name)
 {
-    try
+    std::shared_ptr<const AcqConfig> config = getConfig();
+    ostringstream channelName;
+    if (config->compositeMode == COMPOSITE_CHANNELS && channel < config->compositeSources.size())
     {
-        LogMessage(g_Msg_SEQUENCE_ACQUISITION_THREAD_EXITING);
-        GetCoreCallback() ? GetCoreCallback()->AcqFinished(this, 0) : DEVICE_OK;
+        channelName << "Camera " << config->compositeSources[channel].cameraID;
     }
-    catch (...)
+    else
     {
-        LogMessage(g_Msg_EXCEPTION_IN_ON_THREAD_EXITING, false);
+        channelName << (config->roiCycling ? "ROI " : "Channel ") << channel + 1;
     }
+    CDeviceUtils::CopyLimitedString(name, channelName.str().c_str());
+    return DEVICE_OK;
 }
 
-
-MySequenceThread::MySequenceThread(CIDSPeak* pCam)
+/**
+* Returns the pixels of one channel of the last snap.
+*/
+const unsigned char* CIDSPeak::GetImageBuffer(unsigned channelNr)
+{
+    if (channelNr == 0) { return GetImageBuffer(); }
+    if (channelNr >= GetNumberOfChannels()) { return NULL; }
+    MMThreadGuard g(imgPixelsLock_);
+    if (getConfig()->compositeMode == COMPOSITE_CHANNELS) { return compositeImgs_[channelNr].GetPixels(); }
+    if (channelNr >= channelImgs_.size()) { return NULL; }
+    return channelImgs_[channelNr].GetPixels();
+}
+
+bool CIDSPeak::IsCapturing() {
+    return !thd_->IsStopped();
+}
+
+/*
+ * called from the thread function before exit
+ */
+void CIDSPeak::OnThreadExiting() throw()
+{
+    try
+    {
+        LogMessage(g_Msg_SEQUENCE_ACQUISITION_THREAD_EXITING);
+        previewActiveFactor_ = 1;
+        GetCoreCallback() ? GetCoreCallback()->AcqFinished(this, 0) : DEVICE_OK;
+    }
+    catch (...)
+    {
+        LogMessage(g_Msg_EXCEPTION_IN_ON_THREAD_EXITING, false);
+    }
+}
+
+
+MySequenceThread::MySequenceThread(CIDSPeak* pCam)
     :intervalMs_(default_intervalMS)
     , numImages_(default_numImages)
     , imageCounter_(0)
@@ -1173,29 +3275,58 @@ int MySequenceThread::svc(void) throw()
     peak_status status = PEAK_STATUS_SUCCESS;
     try
     {
+        // Pin and prioritize this thread before the first frame arrives
+        camera_->applyAcqThreadScheduling();
+        camera_->threadConfig_ = camera_->getConfig();
+
+        // Slaves have to wait for the trigger before the master starts exposing
+        camera_->startSyncSlaves(*camera_->threadConfig_);
+        camera_->startClockCorrelation();
+        camera_->metrics_.Increment(AcqMetrics::SEQUENCES_STARTED);
+        camera_->beginSequenceBenchmark();
+        camera_->acqRestarted_ = false;
+        camera_->faultCounter_ = 0;
+        camera_->beginRoiTracking(*camera_->threadConfig_);
+
         // peak_Acquisition_Start doesn't take LONG_MAX (2.1B) as near infinite, it crashes.
         // Instead, if numImages is LONG_MAX, PEAK_INFINITE is passed. This means that sometimes
         // the acquisition has to be stopped manually, but since this is properly escaped anyway
         // (in case of manual closing live view), this is all handled.
-        if (numImages_ == LONG_MAX) { status = peak_Acquisition_Start(camera_->hCam, PEAK_INFINITE); }
+        // HDR brackets take several frames per image, so they run until stopped as well
+        if (numImages_ == LONG_MAX || camera_->threadConfig_->hdrMode != HDR_MODE_OFF) { status = peak_Acquisition_Start(camera_->hCam, PEAK_INFINITE); }
         else { status = peak_Acquisition_Start(camera_->hCam, (uint32_t)numImages_); }
 
         // Check if acquisition is started properly
-        if (status != PEAK_STATUS_SUCCESS) { return ERR_ACQ_START; }
+        if (status != PEAK_STATUS_SUCCESS)
+        {
+            camera_->stopSyncSlaves(*camera_->threadConfig_);
+            return ERR_ACQ_START;
+        }
 
         // do-while loop over numImages_
         do
         {
             nRet = camera_->RunSequenceOnThread();
         } while (nRet == DEVICE_OK && !IsStopped() && imageCounter_++ < numImages_ - 1);
+        if (nRet != DEVICE_OK) { camera_->metrics_.Increment(AcqMetrics::ACQUISITION_ERRORS); }
 
         // If the acquisition is stopped manually, the acquisition has to be properly closed to
         // prevent the camera to be locked in acquisition mode.
         if (IsStopped())
         {
             status = peak_Acquisition_Stop(camera_->hCam);
-            camera_->LogMessage("SeqAcquisition interrupted by the user\n");
+            camera_->logAsync(LogRing::LEVEL_INFO, "SeqAcquisition interrupted by the user");
         }
+        else if (camera_->acqRestarted_) { peak_Acquisition_Stop(camera_->hCam); }
+        camera_->endSequenceBenchmark();
+        camera_->endRoiTracking(*camera_->threadConfig_);
+        if (!camera_->threadConfig_->cycle.empty())
+        {
+            // Stop the (infinite) acquisition and restore the settings from before the cycle
+            if (!IsStopped()) { peak_Acquisition_Stop(camera_->hCam); }
+            camera_->endCycle(*camera_->threadConfig_);
+        }
+        camera_->stopSyncSlaves(*camera_->threadConfig_);
     }
     catch (...) {
         camera_->LogMessage(g_Msg_EXCEPTION_IN_THREAD, false);
@@ -1207,6 +3338,469 @@ int MySequenceThread::svc(void) throw()
 }
 
 
+///////////////////////////////////////////////////////////////////////////////
+// WorkerPool implementation
+///////////////////////////////////////////////////////////////////////////////
+
+WorkerPool::WorkerPool() :
+    job_(NULL),
+    jobCount_(0),
+    jobStripes_(1),
+    generation_(0),
+    pending_(0),
+    quit_(false),
+    firstCore_(-1),
+    priority_(THREAD_PRIORITY_LEVEL_NORMAL)
+{}
+
+WorkerPool::~WorkerPool()
+{
+    stopWorkers();
+}
+
+/**
+* (Re)creates the worker threads. nThreads includes the calling thread,
+* so nThreads == 1 means no extra threads are started.
+*/
+void WorkerPool::Resize(unsigned nThreads, int firstCore, int priority)
+{
+    std::lock_guard<std::mutex> callGuard(callMutex_);
+    stopWorkers();
+    firstCore_ = firstCore;
+    priority_ = priority;
+    // Workers start from the current generation, taken here and not in the
+    // thread, so a ParallelFor right after Resize can't be missed
+    unsigned long long generation;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        quit_ = false;
+        generation = generation_;
+    }
+    for (unsigned i = 1; i < nThreads; i++)
+    {
+        workers_.push_back(std::thread(&WorkerPool::workerLoop, this, i, generation));
+    }
+}
+
+/**
+* Splits [0, count) into GetSize() contiguous stripes and runs fn(begin, end)
+* on each of them. Returns when all stripes are done.
+*/
+void WorkerPool::ParallelFor(unsigned count, const std::function<void(unsigned, unsigned)>& fn)
+{
+    std::lock_guard<std::mutex> callGuard(callMutex_);
+    unsigned nStripes = GetSize();
+    if (nStripes == 1 || count < nStripes)
+    {
+        fn(0, count);
+        return;
+    }
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        job_ = &fn;
+        jobCount_ = count;
+        jobStripes_ = nStripes;
+        pending_ = nStripes - 1;
+        generation_++;
+    }
+    wake_.notify_all();
+
+    // The caller takes the first stripe
+    fn(0, count / nStripes);
+
+    std::unique_lock<std::mutex> lock(mutex_);
+    done_.wait(lock, [this] { return pending_ == 0; });
+    job_ = NULL;
+}
+
+void WorkerPool::workerLoop(unsigned index, unsigned long long seenGeneration)
+{
+    if (firstCore_ >= 0 || priority_ != THREAD_PRIORITY_LEVEL_NORMAL)
+    {
+        setCurrentThreadScheduling(firstCore_ < 0 ? -1 : firstCore_ + (int)index, priority_);
+    }
+    while (true)
+    {
+        const std::function<void(unsigned, unsigned)>* job;
+        unsigned count;
+        unsigned nStripes;
+        {
+            std::unique_lock<std::mutex> lock(mutex_);
+            wake_.wait(lock, [this, seenGeneration] { return quit_ || generation_ != seenGeneration; });
+            if (quit_) { return; }
+            seenGeneration = generation_;
+            job = job_;
+            count = jobCount_;
+            nStripes = jobStripes_;
+        }
+        (*job)(count * index / nStripes, count * (index + 1) / nStripes);
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            pending_--;
+        }
+        done_.notify_one();
+    }
+}
+
+void WorkerPool::stopWorkers()
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        quit_ = true;
+    }
+    wake_.notify_all();
+    for (size_t i = 0; i < workers_.size(); i++)
+    {
+        workers_[i].join();
+    }
+    workers_.clear();
+}
+
+/**
+* Pins the calling thread to a core (core < 0 leaves the affinity untouched)
+* and sets its priority. Returns false if the OS refused either request,
+* e.g. real-time scheduling without the required privileges on Linux.
+*/
+bool setCurrentThreadScheduling(int core, int priority)
+{
+    bool success = true;
+#ifdef _WIN32
+    if (core >= 0)
+    {
+        success &= SetThreadAffinityMask(GetCurrentThread(), (DWORD_PTR)1 << core) != 0;
+    }
+    int winPriority = THREAD_PRIORITY_NORMAL;
+    if (priority == THREAD_PRIORITY_LEVEL_ABOVE_NORMAL) { winPriority = THREAD_PRIORITY_ABOVE_NORMAL; }
+    else if (priority == THREAD_PRIORITY_LEVEL_HIGH) { winPriority = THREAD_PRIORITY_HIGHEST; }
+    else if (priority == THREAD_PRIORITY_LEVEL_TIME_CRITICAL) { winPriority = THREAD_PRIORITY_TIME_CRITICAL; }
+    success &= SetThreadPriority(GetCurrentThread(), winPriority) != 0;
+#else
+#ifdef __linux__
+    if (core >= 0)
+    {
+        cpu_set_t cpuSet;
+        CPU_ZERO(&cpuSet);
+        CPU_SET(core, &cpuSet);
+        success &= pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), &cpuSet) == 0;
+    }
+#endif
+    // Anything above normal maps onto the real-time FIFO class
+    sched_param param;
+    int policy = SCHED_OTHER;
+    param.sched_priority = 0;
+    if (priority != THREAD_PRIORITY_LEVEL_NORMAL)
+    {
+        policy = SCHED_FIFO;
+        int minPrio = sched_get_priority_min(SCHED_FIFO);
+        int maxPrio = sched_get_priority_max(SCHED_FIFO);
+        if (priority == THREAD_PRIORITY_LEVEL_ABOVE_NORMAL) { param.sched_priority = minPrio; }
+        else if (priority == THREAD_PRIORITY_LEVEL_HIGH) { param.sched_priority = (minPrio + maxPrio) / 2; }
+        else { param.sched_priority = maxPrio; }
+    }
+    success &= pthread_setschedparam(pthread_self(), policy, &param) == 0;
+#endif
+    return success;
+}
+
+
+///////////////////////////////////////////////////////////////////////////////
+// LogRing implementation
+///////////////////////////////////////////////////////////////////////////////
+
+LogRing::LogRing() :
+    slots_(new Slot[capacity_]),
+    enqueuePos_(0),
+    dequeuePos_(0),
+    dropped_(0),
+    minLevel_(LEVEL_INFO),
+    windowStartMs_(0)
+{
+    for (size_t i = 0; i < capacity_; i++) { slots_[i].sequence.store(i, std::memory_order_relaxed); }
+    for (int l = 0; l < LEVEL_COUNT; l++) { windowCount_[l] = 0; }
+}
+
+/**
+* At most maxPerSecond_ messages per level in every one second window, so a
+* failing camera can't flood the log at frame rate.
+*/
+bool LogRing::allowRate(Level level)
+{
+    int64_t nowMs = std::chrono::duration_cast<std::chrono::milliseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+    int64_t windowStart = windowStartMs_.load(std::memory_order_relaxed);
+    if (nowMs - windowStart >= 1000 && windowStartMs_.compare_exchange_strong(windowStart, nowMs, std::memory_order_relaxed))
+    {
+        for (int l = 0; l < LEVEL_COUNT; l++) { windowCount_[l].store(0, std::memory_order_relaxed); }
+    }
+    return windowCount_[level].fetch_add(1, std::memory_order_relaxed) < maxPerSecond_;
+}
+
+bool LogRing::Push(Level level, const char* message)
+{
+    if (level < MinLevel()) { return false; }
+    if (!allowRate(level))
+    {
+        dropped_.fetch_add(1, std::memory_order_relaxed);
+        return false;
+    }
+    size_t pos = enqueuePos_.load(std::memory_order_relaxed);
+    Slot* slot;
+    for (;;)
+    {
+        slot = &slots_[pos & (capacity_ - 1)];
+        size_t sequence = slot->sequence.load(std::memory_order_acquire);
+        intptr_t diff = (intptr_t)sequence - (intptr_t)pos;
+        if (diff == 0)
+        {
+            if (enqueuePos_.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) { break; }
+        }
+        else if (diff < 0)
+        {
+            // Full, the flusher is behind
+            dropped_.fetch_add(1, std::memory_order_relaxed);
+            return false;
+        }
+        else { pos = enqueuePos_.load(std::memory_order_relaxed); }
+    }
+    slot->level = level;
+    strncpy(slot->message, message, maxLength_ - 1);
+    slot->message[maxLength_ - 1] = '\0';
+    slot->sequence.store(pos + 1, std::memory_order_release);
+    return true;
+}
+
+bool LogRing::Pop(Level& level, std::string& message)
+{
+    size_t pos = dequeuePos_.load(std::memory_order_relaxed);
+    Slot* slot;
+    for (;;)
+    {
+        slot = &slots_[pos & (capacity_ - 1)];
+        size_t sequence = slot->sequence.load(std::memory_order_acquire);
+        intptr_t diff = (intptr_t)sequence - (intptr_t)(pos + 1);
+        if (diff == 0)
+        {
+            if (dequeuePos_.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) { break; }
+        }
+        else if (diff < 0) { return false; } // empty
+        else { pos = dequeuePos_.load(std::memory_order_relaxed); }
+    }
+    level = slot->level;
+    message = slot->message;
+    slot->sequence.store(pos + capacity_, std::memory_order_release);
+    return true;
+}
+
+
+///////////////////////////////////////////////////////////////////////////////
+// AcqMetrics implementation
+///////////////////////////////////////////////////////////////////////////////
+
+// Upper bounds (s) of the latency buckets, 50 us to 1 s
+const double AcqMetrics::bucketBounds_[AcqMetrics::nBuckets_] =
+    { 0.00005, 0.0001, 0.00025, 0.0005, 0.001, 0.0025, 0.005, 0.01, 0.025, 0.1, 0.25, 1.0 };
+
+AcqMetrics::AcqMetrics() :
+    lastInsertUnixMs_(0),
+    lastRecoveryUs_(0)
+{
+    for (int c = 0; c < COUNTER_COUNT; c++) { counters_[c] = 0; }
+    for (int s = 0; s < STAGE_COUNT; s++)
+    {
+        for (size_t b = 0; b <= nBuckets_; b++) { buckets_[s][b] = 0; }
+        sumNs_[s] = 0;
+    }
+}
+
+/**
+* Counts the latency in its (non cumulative) bucket, Render accumulates.
+*/
+void AcqMetrics::ObserveLatency(Stage stage, double seconds)
+{
+    size_t b = 0;
+    while (b < nBuckets_ && seconds > bucketBounds_[b]) { b++; }
+    buckets_[stage][b].fetch_add(1, std::memory_order_relaxed);
+    sumNs_[stage].fetch_add((uint64_t)(seconds * 1e9), std::memory_order_relaxed);
+}
+
+void AcqMetrics::FrameInserted()
+{
+    Increment(FRAMES_INSERTED);
+    int64_t nowMs = std::chrono::duration_cast<std::chrono::milliseconds>(
+        std::chrono::system_clock::now().time_since_epoch()).count();
+    lastInsertUnixMs_.store(nowMs, std::memory_order_relaxed);
+}
+
+/**
+* A recovery of the acquisition ended, lostFrames is the number of frames not
+* already counted as lost.
+*/
+void AcqMetrics::RecoveryFinished(double seconds, uint64_t lostFrames)
+{
+    Increment(RECOVERY_EVENTS);
+    counters_[FRAMES_LOST].fetch_add(lostFrames, std::memory_order_relaxed);
+    lastRecoveryUs_.store((uint64_t)(seconds * 1e6), std::memory_order_relaxed);
+}
+
+void AcqMetrics::Render(std::ostream& out, const std::string& labels) const
+{
+    static const char* counterNames[COUNTER_COUNT][2] = {
+        { "ids_peak_frames_acquired_total", "Frames received from the camera." },
+        { "ids_peak_frames_inserted_total", "Images inserted in the Micro-Manager buffer." },
+        { "ids_peak_frames_lost_total", "Frames lost to incomplete transfers and acquisition recoveries." },
+        { "ids_peak_incomplete_sets_total", "Composite frame sets dropped because a camera missed the frame." },
+        { "ids_peak_buffer_overflows_total", "Micro-Manager circular buffer overflows." },
+        { "ids_peak_acquisition_errors_total", "Sequence acquisitions ended by an error." },
+        { "ids_peak_recovery_events_total", "Acquisition recoveries after a camera error." },
+        { "ids_peak_sequences_started_total", "Sequence acquisitions started." }
+    };
+    static const char* stageNames[STAGE_COUNT] = { "wait", "transfer", "insert" };
+
+    for (int c = 0; c < COUNTER_COUNT; c++)
+    {
+        out << "# HELP " << counterNames[c][0] << " " << counterNames[c][1] << "\n";
+        out << "# TYPE " << counterNames[c][0] << " counter\n";
+        out << counterNames[c][0] << "{" << labels << "} " << counters_[c].load(std::memory_order_relaxed) << "\n";
+    }
+
+    out << "# HELP ids_peak_stage_latency_seconds Time per frame spent waiting for, converting and inserting frames.\n";
+    out << "# TYPE ids_peak_stage_latency_seconds histogram\n";
+    for (int s = 0; s < STAGE_COUNT; s++)
+    {
+        uint64_t cumulative = 0;
+        for (size_t b = 0; b <= nBuckets_; b++)
+        {
+            cumulative += buckets_[s][b].load(std::memory_order_relaxed);
+            out << "ids_peak_stage_latency_seconds_bucket{" << labels << ",stage=\"" << stageNames[s] << "\",le=\"";
+            if (b < nBuckets_) { out << bucketBounds_[b]; }
+            else { out << "+Inf"; }
+            out << "\"} " << cumulative << "\n";
+        }
+        out << "ids_peak_stage_latency_seconds_sum{" << labels << ",stage=\"" << stageNames[s] << "\"} "
+            << sumNs_[s].load(std::memory_order_relaxed) * 1e-9 << "\n";
+        out << "ids_peak_stage_latency_seconds_count{" << labels << ",stage=\"" << stageNames[s] << "\"} " << cumulative << "\n";
+    }
+
+    out << "# HELP ids_peak_last_recovery_seconds Duration of the last acquisition recovery.\n";
+    out << "# TYPE ids_peak_last_recovery_seconds gauge\n";
+    out << "ids_peak_last_recovery_seconds{" << labels << "} " << lastRecoveryUs_.load(std::memory_order_relaxed) * 1e-6 << "\n";
+
+    out << "# HELP ids_peak_last_frame_timestamp_seconds Unix time of the last inserted image.\n";
+    out << "# TYPE ids_peak_last_frame_timestamp_seconds gauge\n";
+    out << "ids_peak_last_frame_timestamp_seconds{" << labels << "} " << lastInsertUnixMs_.load(std::memory_order_relaxed) / 1000 << "\n";
+}
+
+
+///////////////////////////////////////////////////////////////////////////////
+// ClockModel implementation
+///////////////////////////////////////////////////////////////////////////////
+
+ClockModel::ClockModel()
+{
+    Reset();
+}
+
+void ClockModel::Reset()
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    samples_.clear();
+    next_ = 0;
+    originNs_ = 0;
+    originUs_ = 0;
+    offsetUs_ = 0;
+    slope_ = 1e-3;
+    residualUs_ = 0;
+    valid_ = false;
+}
+
+/**
+* Adds a sample to the ring of the most recent samples and refits. The ring
+* keeps the fit responsive to temperature dependent drift.
+*/
+void ClockModel::AddSample(uint64_t deviceNs, double hostUs)
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (samples_.empty())
+    {
+        // Fit relative to the first sample, absolute ns don't fit in a double
+        originNs_ = deviceNs;
+        originUs_ = hostUs;
+    }
+    std::pair<uint64_t, double> sample(deviceNs, hostUs);
+    if (samples_.size() < maxSamples_) { samples_.push_back(sample); }
+    else { samples_[next_] = sample; }
+    next_ = (next_ + 1) % maxSamples_;
+    fit();
+}
+
+/**
+* Least squares fit of host = offset + slope * device. With a single sample,
+* or samples too close together for a meaningful slope, the clocks are
+* assumed to run at the same rate.
+*/
+void ClockModel::fit()
+{
+    size_t n = samples_.size();
+    double meanX = 0;
+    double meanY = 0;
+    for (size_t i = 0; i < n; i++)
+    {
+        meanX += (double)(int64_t)(samples_[i].first - originNs_);
+        meanY += samples_[i].second - originUs_;
+    }
+    meanX /= n;
+    meanY /= n;
+    double sxx = 0;
+    double sxy = 0;
+    for (size_t i = 0; i < n; i++)
+    {
+        double dx = (double)(int64_t)(samples_[i].first - originNs_) - meanX;
+        double dy = samples_[i].second - originUs_ - meanY;
+        sxx += dx * dx;
+        sxy += dx * dy;
+    }
+    // Require at least 100 ms of spread for the slope
+    slope_ = (n > 1 && sxx > n * 1e16) ? sxy / sxx : 1e-3;
+    offsetUs_ = meanY - slope_ * meanX;
+    double sumSquares = 0;
+    for (size_t i = 0; i < n; i++)
+    {
+        double x = (double)(int64_t)(samples_[i].first - originNs_);
+        double r = samples_[i].second - originUs_ - (offsetUs_ + slope_ * x);
+        sumSquares += r * r;
+    }
+    residualUs_ = sqrt(sumSquares / n);
+    valid_ = true;
+}
+
+bool ClockModel::IsValid() const
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    return valid_;
+}
+
+double ClockModel::ToHostUs(uint64_t deviceNs) const
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    return originUs_ + offsetUs_ + slope_ * (double)(int64_t)(deviceNs - originNs_);
+}
+
+/**
+* Rate difference of the clocks, positive when the camera clock is slow.
+*/
+double ClockModel::DriftPpm() const
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    return (slope_ * 1000 - 1) * 1e6;
+}
+
+double ClockModel::ResidualUs() const
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    return residualUs_;
+}
+
+
 ///////////////////////////////////////////////////////////////////////////////
 // CIDSPeak Action handlers
 ///////////////////////////////////////////////////////////////////////////////
@@ -1233,6 +3827,9 @@ int CIDSPeak::OnMaxExposure(MM::PropertyBase* pProp, MM::ActionType eAct)
             status = peak_ExposureTime_Get(hCam, &exposureCur_);
             if (status != PEAK_STATUS_SUCCESS) { return DEVICE_ERR; } // Should not be possible
             exposureCur_ /= 1000;
+            framerateLimitsDirty_ = true;
+            updateSnapConfig();
+            publishConfig();
             int nRet = SetProperty(MM::g_Keyword_Exposure, CDeviceUtils::ConvertToString(exposureCur_));
             GetCoreCallback()->OnExposureChanged(this, exposureCur_);
             return nRet;
@@ -1277,6 +3874,7 @@ int CIDSPeak::OnBinning(MM::PropertyBase* pProp, MM::ActionType eAct)
                 (unsigned int)(img_.Height() / factor)
             );
             binSize_ = binFactor;
+            publishConfig();
             std::ostringstream os;
             os << binSize_;
             OnPropertyChanged("Binning", os.str().c_str());
@@ -1294,700 +3892,4335 @@ int CIDSPeak::OnBinning(MM::PropertyBase* pProp, MM::ActionType eAct)
     return nRet;
 }
 
-int CIDSPeak::OnFrameRate(MM::PropertyBase* pProp, MM::ActionType eAct)
+/**
+* Handles "Decimation" property. Like binning, decimation divides the image size
+* and the ROI coordinates by the factor.
+*/
+int CIDSPeak::OnDecimation(MM::PropertyBase* pProp, MM::ActionType eAct)
 {
-    if (eAct == MM::BeforeGet)
+    int nRet = DEVICE_ERR;
+    switch (eAct)
     {
-        pProp->Set(framerateCur_);
-    }
-    else if (eAct == MM::AfterSet)
+    case MM::AfterSet:
     {
-        double framerateTemp;
-        pProp->Get(framerateTemp);
-        framerateSet(framerateTemp);
+        if (IsCapturing())
+            return DEVICE_CAMERA_BUSY_ACQUIRING;
+
+        long decFactor;
+        pProp->Get(decFactor);
+        if (decFactor > 0 && decFactor < 10)
+        {
+            if (decFactor != decimation_)
+            {
+                status = peak_Decimation_Set(hCam, (uint32_t)decFactor, (uint32_t)decFactor);
+                if (status != PEAK_STATUS_SUCCESS) { return ERR_NO_WRITE_ACCESS; }
+                // Less lines to read out, so a higher maximum frame rate
+                framerateLimitsDirty_ = true;
+            }
+            // calculate ROI using the previous decimation settings
+            double factor = (double)decFactor / (double)decimation_;
+            roiX_ = (unsigned int)(roiX_ / factor);
+            roiY_ = (unsigned int)(roiY_ / factor);
+            for (unsigned int i = 0; i < multiROIXs_.size(); ++i)
+            {
+                multiROIXs_[i] = (unsigned int)(multiROIXs_[i] / factor);
+                multiROIYs_[i] = (unsigned int)(multiROIYs_[i] / factor);
+                multiROIWidths_[i] = (unsigned int)(multiROIWidths_[i] / factor);
+                multiROIHeights_[i] = (unsigned int)(multiROIHeights_[i] / factor);
+            }
+            img_.Resize(
+                (unsigned int)(img_.Width() / factor),
+                (unsigned int)(img_.Height() / factor)
+            );
+            decimation_ = decFactor;
+            publishConfig();
+            updateFramerateLimits();
+            nRet = DEVICE_OK;
+        }
+    }break;
+    case MM::BeforeGet:
+    {
+        nRet = DEVICE_OK;
+        pProp->Set(decimation_);
+    }break;
+    default:
+        break;
     }
-    return DEVICE_OK;
+    return nRet;
 }
 
 /**
-* Handles "Auto whitebalance" property.
+* Handles "Shutter mode" property. The exposure range, the frame rate range and
+* the readout time all depend on it.
 */
-int CIDSPeak::OnAutoWhiteBalance(MM::PropertyBase* pProp, MM::ActionType eAct)
+int CIDSPeak::OnShutterMode(MM::PropertyBase* pProp, MM::ActionType eAct)
 {
-    int nRet = DEVICE_OK;
-
     if (eAct == MM::BeforeGet)
     {
-        if (peak_AutoWhiteBalance_GetAccessStatus(hCam) == PEAK_ACCESS_READWRITE
-            || peak_AutoWhiteBalance_GetAccessStatus(hCam) == PEAK_ACCESS_READONLY)
-        {
-            status = peak_AutoWhiteBalance_Mode_Get(hCam, &peakAutoWhiteBalance_);
-        }
-        const char* autoWB = peakAutoToString[peakAutoWhiteBalance_].c_str();
-        pProp->Set(autoWB);
+        pProp->Set(shutterMode_.c_str());
     }
-
     else if (eAct == MM::AfterSet)
     {
         if (IsCapturing())
             return DEVICE_CAMERA_BUSY_ACQUIRING;
 
-        string autoWB;
-        pProp->Get(autoWB);
-
-        status = peak_AutoWhiteBalance_Mode_Set(hCam, (peak_auto_feature_mode)stringToPeakAuto[autoWB]);
-        if (status != PEAK_STATUS_SUCCESS) { nRet = ERR_NO_WRITE_ACCESS; }
-        else { peakAutoWhiteBalance_ = (peak_auto_feature_mode)stringToPeakAuto[autoWB]; }
+        string mode;
+        pProp->Get(mode);
+        if (mode == shutterMode_ || mode == g_ShutterMode_Default) { return DEVICE_OK; }
+        status = setGFAEnum(hCam, "SensorShutterMode", mode.c_str());
+        if (status != PEAK_STATUS_SUCCESS) { return ERR_NO_WRITE_ACCESS; }
+        shutterMode_ = mode;
+        updateShutterTiming();
+        int nRet = updateExposureRange();
+        if (nRet != DEVICE_OK)
+            return nRet;
+        // The current frame rate may not be possible anymore
+        framerateSet(framerateCur_);
     }
-    return nRet;
+    return DEVICE_OK;
 }
 
-/**
-* Handles "Gain master" property.
-*/
-int CIDSPeak::OnGainMaster(MM::PropertyBase* pProp, MM::ActionType eAct)
+int CIDSPeak::OnSensorReadoutTime(MM::PropertyBase* pProp, MM::ActionType eAct)
 {
-
-    int nRet = DEVICE_OK;
-
     if (eAct == MM::BeforeGet)
     {
-        status = peak_Gain_Get(hCam, PEAK_GAIN_TYPE_DIGITAL, PEAK_GAIN_CHANNEL_MASTER, &gainMaster_);
-        pProp->Set(gainMaster_);
+        // Also depends on the ROI and binning, so read it every time
+        double readoutUs = 0;
+        if (getGFAfloat("SensorReadoutTime", &readoutUs) == PEAK_STATUS_SUCCESS)
+        {
+            sensorReadoutMs_ = readoutUs / 1000;
+            serialReadoutMs_ = shutterMode_ == "GlobalReset" ? sensorReadoutMs_ : 0;
+        }
+        pProp->Set(sensorReadoutMs_);
     }
+    return DEVICE_OK;
+}
 
-    else if (eAct == MM::AfterSet)
+int CIDSPeak::OnClockDrift(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+    if (eAct == MM::BeforeGet)
     {
-        if (IsCapturing())
-            return DEVICE_CAMERA_BUSY_ACQUIRING;
-
-        double gainMaster;
-        pProp->Get(gainMaster);
-
-        status = peak_Gain_Set(hCam, PEAK_GAIN_TYPE_DIGITAL, PEAK_GAIN_CHANNEL_RED, gainMaster);
-        if (status != PEAK_STATUS_SUCCESS) { nRet = ERR_NO_WRITE_ACCESS; }
-        else { gainMaster_ = gainMaster; }
+        pProp->Set(clock_.DriftPpm());
     }
-    return nRet;
+    return DEVICE_OK;
 }
 
 /**
-* Handles "Gain red" property.
+* Demosaic algorithm of sequences (snap = 0) or snaps (snap = 1).
 */
-int CIDSPeak::OnGainRed(MM::PropertyBase* pProp, MM::ActionType eAct)
+int CIDSPeak::OnDemosaic(MM::PropertyBase* pProp, MM::ActionType eAct, long snap)
 {
-
-    int nRet = DEVICE_OK;
-
+    static const char* demosaicNames[DEMOSAIC_COUNT] = { g_Demosaic_IPL, g_Demosaic_Nearest,
+        g_Demosaic_Bilinear, g_Demosaic_Malvar, g_Demosaic_EdgeAware };
+    int& demosaic = snap ? demosaicSnap_ : demosaicLive_;
     if (eAct == MM::BeforeGet)
     {
-        status = peak_Gain_Get(hCam, PEAK_GAIN_TYPE_DIGITAL, PEAK_GAIN_CHANNEL_RED, &gainRed_);
-        pProp->Set(gainRed_);
+        pProp->Set(demosaicNames[demosaic]);
     }
-
     else if (eAct == MM::AfterSet)
     {
-        if (IsCapturing())
-            return DEVICE_CAMERA_BUSY_ACQUIRING;
-
-        double gainRed;
-        pProp->Get(gainRed);
-
-        status = peak_Gain_Set(hCam, PEAK_GAIN_TYPE_DIGITAL, PEAK_GAIN_CHANNEL_RED, gainRed);
-        if (status != PEAK_STATUS_SUCCESS) { nRet = ERR_NO_WRITE_ACCESS; }
-        else { gainRed_ = gainRed; }
-
+        string name;
+        pProp->Get(name);
+        for (int d = 0; d < DEMOSAIC_COUNT; d++)
+        {
+            if (name == demosaicNames[d]) { demosaic = d; }
+        }
+        // Running sequences pick the new kernel up with the next frame
+        int nRet = selectTransferKernel();
+        publishConfig();
+        return nRet;
     }
-    return nRet;
+    return DEVICE_OK;
 }
 
 /**
-* Handles "Gain green" property.
+* Measured cost of the selected algorithms on the last frame they converted.
 */
-int CIDSPeak::OnGainGreen(MM::PropertyBase* pProp, MM::ActionType eAct)
+int CIDSPeak::OnDemosaicCost(MM::PropertyBase* pProp, MM::ActionType eAct)
 {
-
-    int nRet = DEVICE_OK;
-
     if (eAct == MM::BeforeGet)
     {
-        status = peak_Gain_Get(hCam, PEAK_GAIN_TYPE_DIGITAL, PEAK_GAIN_CHANNEL_GREEN, &gainGreen_);
-        pProp->Set(gainGreen_);
+        ostringstream cost;
+        cost.precision(3);
+        cost << "live " << demosaicMsPerMP_[demosaicLive_].load(std::memory_order_relaxed) << " ms/MP, snap "
+            << demosaicMsPerMP_[demosaicSnap_].load(std::memory_order_relaxed) << " ms/MP";
+        pProp->Set(cost.str().c_str());
     }
+    return DEVICE_OK;
+}
 
+/**
+* Downsampling of the live view, applied from the next live start on.
+*/
+int CIDSPeak::OnPreviewDownsampling(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+    if (eAct == MM::BeforeGet)
+    {
+        pProp->Set(previewDownsampling_ == 1 ? "Off" : (CDeviceUtils::ConvertToString((long)previewDownsampling_) + string("x")).c_str());
+    }
     else if (eAct == MM::AfterSet)
     {
-        if (IsCapturing())
-            return DEVICE_CAMERA_BUSY_ACQUIRING;
-
-        double gainGreen;
-        pProp->Get(gainGreen);
-
-        status = peak_Gain_Set(hCam, PEAK_GAIN_TYPE_DIGITAL, PEAK_GAIN_CHANNEL_GREEN, gainGreen);
-        if (status != PEAK_STATUS_SUCCESS) { nRet = ERR_NO_WRITE_ACCESS; }
-        else { gainGreen_ = gainGreen; }
-
+        string value;
+        pProp->Get(value);
+        previewDownsampling_ = value == "Off" ? 1 : (unsigned)atoi(value.c_str());
     }
-    return nRet;
+    return DEVICE_OK;
 }
 
 /**
-* Handles "Gain blue" property.
+* Shrinks the live view ROI to the region of activity, from the next live start on.
 */
-int CIDSPeak::OnGainBlue(MM::PropertyBase* pProp, MM::ActionType eAct)
+int CIDSPeak::OnRoiTracking(MM::PropertyBase* pProp, MM::ActionType eAct)
 {
-
-    int nRet = DEVICE_OK;
-
     if (eAct == MM::BeforeGet)
     {
-        status = peak_Gain_Get(hCam, PEAK_GAIN_TYPE_DIGITAL, PEAK_GAIN_CHANNEL_BLUE, &gainBlue_);
-        pProp->Set(gainRed_);
+        pProp->Set(roiTracking_ ? "On" : "Off");
     }
-
     else if (eAct == MM::AfterSet)
     {
-        if (IsCapturing())
-            return DEVICE_CAMERA_BUSY_ACQUIRING;
-
-        double gainBlue;
-        pProp->Get(gainBlue);
-
-        status = peak_Gain_Set(hCam, PEAK_GAIN_TYPE_DIGITAL, PEAK_GAIN_CHANNEL_BLUE, gainBlue);
-        if (status != PEAK_STATUS_SUCCESS) { nRet = ERR_NO_WRITE_ACCESS; }
-        else { gainBlue_ = gainBlue; }
-
+        string value;
+        pProp->Get(value);
+        roiTracking_ = value == "On";
     }
-    return nRet;
+    return DEVICE_OK;
 }
 
 /**
-* Handles "PixelType" property.
+* Pixels above this percentage of full scale count as signal.
 */
-int CIDSPeak::OnPixelType(MM::PropertyBase* pProp, MM::ActionType eAct)
+int CIDSPeak::OnRoiTrackingThreshold(MM::PropertyBase* pProp, MM::ActionType eAct)
 {
-    int nRet = DEVICE_OK;
-    switch (eAct)
-    {
-    case MM::AfterSet:
+    if (eAct == MM::BeforeGet)
     {
-        if (IsCapturing())
-            return DEVICE_CAMERA_BUSY_ACQUIRING;
-
-        string pixelType;
-        pProp->Get(pixelType);
-
-        if (peak_PixelFormat_GetAccessStatus(hCam) == PEAK_ACCESS_READWRITE)
-        {
-            if (pixelType == g_PixelType_8bit)
-            {
-                status = peak_PixelFormat_Set(hCam, PEAK_PIXEL_FORMAT_MONO8);
-                nComponents_ = 1;
-            }
-            else
-            {
-                status = peak_PixelFormat_Set(hCam, PEAK_PIXEL_FORMAT_BAYER_RG8);
-                nComponents_ = 4;
-            }
-        }
-        else
-        {
-            return ERR_NO_WRITE_ACCESS;
-        }
-
-        // Only 8bit formats are supported for now
-        bitDepth_ = 8;
-
-        // Resize buffer to accomodate the new image
-        img_.Resize(img_.Width(), img_.Height(), nComponents_ * (bitDepth_ / 8));
-        nRet = DEVICE_OK;        
+        pProp->Set(roiTrackThresholdPct_);
     }
-    break;
-    case MM::BeforeGet:
+    else if (eAct == MM::AfterSet)
     {
-        if (nComponents_ == 1)
-        {
-            pProp->Set(g_PixelType_8bit);
-        }
-        else
-        {
-            pProp->Set(g_PixelType_32bitRGBA);
-        }
-       
-    } break;
-    default:
-        break;
+        pProp->Get(roiTrackThresholdPct_);
     }
-    return nRet;
+    return DEVICE_OK;
 }
 
 /**
-* Handles "ReadoutTime" property.
-* Not sure this does anything...
+* Border kept around the signal, in pixels.
 */
-int CIDSPeak::OnReadoutTime(MM::PropertyBase* pProp, MM::ActionType eAct)
+int CIDSPeak::OnRoiTrackingMargin(MM::PropertyBase* pProp, MM::ActionType eAct)
 {
-    if (eAct == MM::AfterSet)
+    if (eAct == MM::BeforeGet)
     {
-        double readoutMs;
-        pProp->Get(readoutMs);
-
-        readoutUs_ = readoutMs * 1000.0;
+        pProp->Set(roiTrackMarginPx_);
     }
-    else if (eAct == MM::BeforeGet)
+    else if (eAct == MM::AfterSet)
     {
-        pProp->Set(readoutUs_ / 1000.0);
+        pProp->Get(roiTrackMarginPx_);
     }
-
     return DEVICE_OK;
 }
 
-int CIDSPeak::OnSupportsMultiROI(MM::PropertyBase* pProp, MM::ActionType eAct)
+/**
+* Interval between re-expansions to the full ROI, to find signal elsewhere.
+*/
+int CIDSPeak::OnRoiTrackingSearchInterval(MM::PropertyBase* pProp, MM::ActionType eAct)
 {
-    if (eAct == MM::AfterSet)
+    if (eAct == MM::BeforeGet)
     {
-        long tvalue = 0;
-        pProp->Get(tvalue);
-        supportsMultiROI_ = (tvalue != 0);
+        pProp->Set(roiTrackSearchS_);
     }
-    else if (eAct == MM::BeforeGet)
+    else if (eAct == MM::AfterSet)
     {
-        pProp->Set((long)supportsMultiROI_);
+        pProp->Get(roiTrackSearchS_);
     }
-
     return DEVICE_OK;
 }
 
-int CIDSPeak::OnMultiROIFillValue(MM::PropertyBase* pProp, MM::ActionType eAct)
+/**
+* Tracked ROI of the running live view and the number of reconfigurations.
+*/
+int CIDSPeak::OnRoiTrackingRegion(MM::PropertyBase* pProp, MM::ActionType eAct)
 {
-    if (eAct == MM::AfterSet)
-    {
-        long tvalue = 0;
-        pProp->Get(tvalue);
-        multiROIFillValue_ = (int)tvalue;
-    }
-    else if (eAct == MM::BeforeGet)
+    if (eAct == MM::BeforeGet)
     {
-        pProp->Set((long)multiROIFillValue_);
+        if (roiTrackWidth_ == 0) { pProp->Set("Not tracking"); }
+        else
+        {
+            ostringstream region;
+            region << roiTrackX_ << "," << roiTrackY_ << " " << roiTrackWidth_ << "x" << roiTrackHeight_
+                << ", " << roiTrackReconfigurations_ << " reconfigurations";
+            pProp->Set(region.str().c_str());
+        }
     }
-
     return DEVICE_OK;
 }
 
-int CIDSPeak::OnCameraCCDXSize(MM::PropertyBase* pProp, MM::ActionType eAct)
+int CIDSPeak::OnKernelBenchmark(MM::PropertyBase* pProp, MM::ActionType eAct)
 {
     if (eAct == MM::BeforeGet)
     {
-        pProp->Set(cameraCCDXSize_);
+        pProp->Set(benchmarkRunning_ ? "Running" : "Idle");
     }
     else if (eAct == MM::AfterSet)
     {
-        long value;
-        pProp->Get(value);
-        if ((value < 16) || (33000 < value))
-            return DEVICE_ERR;  // invalid image size
-        if (value != cameraCCDXSize_)
-        {
-            cameraCCDXSize_ = value;
-            img_.Resize(cameraCCDXSize_ / binSize_, cameraCCDYSize_ / binSize_);
-        }
+        string action;
+        pProp->Get(action);
+        if (action == "Run") { return startKernelBenchmark(); }
+        if (action == "Stop") { stopKernelBenchmark(); }
     }
     return DEVICE_OK;
-
 }
 
-int CIDSPeak::OnCameraCCDYSize(MM::PropertyBase* pProp, MM::ActionType eAct)
+/**
+* Results file (baseline = 0) or baseline file (baseline = 1), empty = off.
+*/
+int CIDSPeak::OnBenchmarkFile(MM::PropertyBase* pProp, MM::ActionType eAct, long baseline)
 {
+    std::lock_guard<std::mutex> lock(benchmarkMutex_);
+    string& file = baseline ? baselineFile_ : benchmarkFile_;
     if (eAct == MM::BeforeGet)
     {
-        pProp->Set(cameraCCDYSize_);
+        pProp->Set(file.c_str());
     }
     else if (eAct == MM::AfterSet)
     {
-        long value;
-        pProp->Get(value);
-        if ((value < 16) || (33000 < value))
-            return DEVICE_ERR;  // invalid image size
-        if (value != cameraCCDYSize_)
+        pProp->Get(file);
+        if (baseline)
         {
-            cameraCCDYSize_ = value;
-            img_.Resize(cameraCCDXSize_ / binSize_, cameraCCDYSize_ / binSize_);
+            benchmarkComparison_ = "Not compared";
+            benchmarkRegressions_ = -1;
         }
     }
     return DEVICE_OK;
-
 }
 
-int CIDSPeak::OnTriggerDevice(MM::PropertyBase* pProp, MM::ActionType eAct)
+int CIDSPeak::OnBenchmarkTolerance(MM::PropertyBase* pProp, MM::ActionType eAct)
 {
+    std::lock_guard<std::mutex> lock(benchmarkMutex_);
     if (eAct == MM::BeforeGet)
     {
-        pProp->Set(triggerDevice_.c_str());
+        pProp->Set(benchmarkTolerancePct_);
     }
     else if (eAct == MM::AfterSet)
     {
-        pProp->Get(triggerDevice_);
+        pProp->Get(benchmarkTolerancePct_);
     }
     return DEVICE_OK;
 }
 
-
-int CIDSPeak::OnCCDTemp(MM::PropertyBase* pProp, MM::ActionType eAct)
+int CIDSPeak::OnBenchmarkComparison(MM::PropertyBase* pProp, MM::ActionType eAct)
 {
-    // This is a readonly function
     if (eAct == MM::BeforeGet)
     {
-        status = getTemperature(&ccdT_);
-        pProp->Set(ccdT_);
+        std::lock_guard<std::mutex> lock(benchmarkMutex_);
+        pProp->Set(benchmarkComparison_.c_str());
     }
     return DEVICE_OK;
 }
 
-int CIDSPeak::OnModelName(MM::PropertyBase* pProp, MM::ActionType eAct)
+int CIDSPeak::OnBenchmarkRegressions(MM::PropertyBase* pProp, MM::ActionType eAct)
 {
-    int nRet = DEVICE_OK;
-    // This is a readonly function
     if (eAct == MM::BeforeGet)
     {
-        pProp->Set(modelName_.c_str());
+        std::lock_guard<std::mutex> lock(benchmarkMutex_);
+        pProp->Set(benchmarkRegressions_);
     }
-    return nRet;
+    return DEVICE_OK;
 }
 
-int CIDSPeak::OnSerialNumber(MM::PropertyBase* pProp, MM::ActionType eAct)
+int CIDSPeak::OnKernelBenchmarkResult(MM::PropertyBase* pProp, MM::ActionType eAct)
 {
-    int nRet = DEVICE_OK;
-    // This is a readonly function
     if (eAct == MM::BeforeGet)
     {
-        pProp->Set(serialNum_.c_str());
+        std::lock_guard<std::mutex> lock(benchmarkMutex_);
+        if (benchmarkRunning_)
+        {
+            ostringstream progress;
+            progress << "Running, " << benchmarkDone_ << " of " << benchmarkTotal_ << " measurements";
+            pProp->Set(progress.str().c_str());
+        }
+        else if (benchmarkResults_.empty()) { pProp->Set("Not run"); }
+        else
+        {
+            size_t failed = 0;
+            for (size_t i = 0; i < benchmarkResults_.size(); i++)
+            {
+                if (!benchmarkResults_[i].conformant) { failed++; }
+            }
+            ostringstream result;
+            result << benchmarkResults_.size() << " measurements, ";
+            if (failed == 0) { result << "all outputs identical to the reference (see log)"; }
+            else { result << failed << " outputs DIFFER from the reference (see log)"; }
+            pProp->Set(result.str().c_str());
+        }
     }
-    return nRet;
+    return DEVICE_OK;
 }
 
-int CIDSPeak::OnIsSequenceable(MM::PropertyBase* pProp, MM::ActionType eAct)
+int CIDSPeak::OnRecoveryTimeout(MM::PropertyBase* pProp, MM::ActionType eAct)
 {
-    std::string val = "Yes";
     if (eAct == MM::BeforeGet)
     {
-        if (!isSequenceable_)
-        {
-            val = "No";
-        }
-        pProp->Set(val.c_str());
+        pProp->Set(recoveryTimeoutMs_);
     }
     else if (eAct == MM::AfterSet)
     {
-        isSequenceable_ = false;
-        pProp->Get(val);
-        if (val == "Yes")
+        pProp->Get(recoveryTimeoutMs_);
+    }
+    return DEVICE_OK;
+}
+
+int CIDSPeak::OnLastRecovery(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+    if (eAct == MM::BeforeGet)
+    {
+        if (lastRecoveryMs_ <= 0) { pProp->Set("None"); }
+        else
         {
-            isSequenceable_ = true;
+            ostringstream recovery;
+            recovery << lastRecoveryMs_ << " ms, " << lastRecoveryLostFrames_ << " frames lost";
+            pProp->Set(recovery.str().c_str());
         }
     }
+    return DEVICE_OK;
+}
 
+#ifdef IDS_PEAK_FAULT_INJECTION
+int CIDSPeak::OnFaultInjection(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+    static const char* faultNames[] = { g_Fault_None, g_Fault_Timeout, g_Fault_Aborted,
+        g_Fault_Incomplete, g_Fault_DeviceLost, g_Fault_SlowControl };
+    if (eAct == MM::BeforeGet)
+    {
+        pProp->Set(faultNames[faultInjection_]);
+    }
+    else if (eAct == MM::AfterSet)
+    {
+        string fault;
+        pProp->Get(fault);
+        for (int f = FAULT_NONE; f <= FAULT_SLOW_CONTROL; f++)
+        {
+            if (fault == faultNames[f]) { faultInjection_ = f; }
+        }
+        faultCounter_ = 0;
+    }
     return DEVICE_OK;
 }
 
-int CIDSPeak::OnChangeCamera(MM::PropertyBase* pProp, MM::ActionType eAct)
+int CIDSPeak::OnFaultInterval(MM::PropertyBase* pProp, MM::ActionType eAct)
 {
-    int nRet = DEVICE_OK;
     if (eAct == MM::BeforeGet)
     {
-        pProp->Set(CDeviceUtils::ConvertToString(CamID_));
+        pProp->Set(faultInterval_);
     }
     else if (eAct == MM::AfterSet)
     {
-        string CamID_temp;
-        pProp->Get(CamID_temp);
-        CamID_ = stoi(CamID_temp);
-        hCam = hCams[CamID_];
-        cameraChanged();
+        pProp->Get(faultInterval_);
     }
-    return nRet;
+    return DEVICE_OK;
 }
 
-///////////////////////////////////////////////////////////////////////////////
-// Private CIDSPeak methods
-///////////////////////////////////////////////////////////////////////////////
+int CIDSPeak::OnFaultTest(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+    if (eAct == MM::BeforeGet)
+    {
+        pProp->Set(selfTestRunning_ ? "Running" : "Idle");
+    }
+    else if (eAct == MM::AfterSet)
+    {
+        string action;
+        pProp->Get(action);
+        if (action == "Run") { return startSelfTest(&CIDSPeak::faultTestThread); }
+        if (action == "Stop") { stopSelfTest(); }
+    }
+    return DEVICE_OK;
+}
+
+int CIDSPeak::OnSoakTest(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+    if (eAct == MM::BeforeGet)
+    {
+        pProp->Set(selfTestRunning_ ? "Running" : "Idle");
+    }
+    else if (eAct == MM::AfterSet)
+    {
+        string action;
+        pProp->Get(action);
+        if (action == "Run") { return startSelfTest(&CIDSPeak::soakTestThread); }
+        if (action == "Stop") { stopSelfTest(); }
+    }
+    return DEVICE_OK;
+}
+
+int CIDSPeak::OnRoiTrackTest(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+    if (eAct == MM::BeforeGet)
+    {
+        pProp->Set(selfTestRunning_ ? "Running" : "Idle");
+    }
+    else if (eAct == MM::AfterSet)
+    {
+        string action;
+        pProp->Get(action);
+        if (action == "Run") { return startSelfTest(&CIDSPeak::roiTrackTestThread); }
+    }
+    return DEVICE_OK;
+}
+
+int CIDSPeak::OnSoakTestDuration(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+    if (eAct == MM::BeforeGet)
+    {
+        pProp->Set(soakTestMinutes_);
+    }
+    else if (eAct == MM::AfterSet)
+    {
+        pProp->Get(soakTestMinutes_);
+    }
+    return DEVICE_OK;
+}
+
+int CIDSPeak::OnSelfTestResult(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+    if (eAct == MM::BeforeGet)
+    {
+        std::lock_guard<std::mutex> lock(benchmarkMutex_);
+        pProp->Set(selfTestResult_.c_str());
+    }
+    return DEVICE_OK;
+}
+
+int CIDSPeak::OnSelfTestFailures(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+    if (eAct == MM::BeforeGet)
+    {
+        std::lock_guard<std::mutex> lock(benchmarkMutex_);
+        pProp->Set(selfTestFailures_);
+    }
+    return DEVICE_OK;
+}
+#endif
+
+int CIDSPeak::OnLogLevel(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+    static const char* levelNames[LogRing::LEVEL_COUNT] = { g_LogLevel_Debug, g_LogLevel_Info, g_LogLevel_Warning, g_LogLevel_Error };
+    if (eAct == MM::BeforeGet)
+    {
+        pProp->Set(levelNames[logRing_.MinLevel()]);
+    }
+    else if (eAct == MM::AfterSet)
+    {
+        string level;
+        pProp->Get(level);
+        for (int l = 0; l < LogRing::LEVEL_COUNT; l++)
+        {
+            if (level == levelNames[l]) { logRing_.SetMinLevel((LogRing::Level)l); }
+        }
+    }
+    return DEVICE_OK;
+}
+
+int CIDSPeak::OnMetricsFile(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+    if (eAct == MM::BeforeGet)
+    {
+        pProp->Set(metricsFile_.c_str());
+    }
+    else if (eAct == MM::AfterSet)
+    {
+        string file;
+        pProp->Get(file);
+        stopMetricsWriter();
+        metricsFile_ = file;
+        if (metricsFile_.empty()) { return DEVICE_OK; }
+        // Fail here on a bad path, instead of silently in the writer
+        int nRet = writeMetrics();
+        if (nRet != DEVICE_OK)
+        {
+            metricsFile_.clear();
+            pProp->Set("");
+            return nRet;
+        }
+        startMetricsWriter();
+    }
+    return DEVICE_OK;
+}
+
+int CIDSPeak::OnMetricsInterval(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+    if (eAct == MM::BeforeGet)
+    {
+        pProp->Set(metricsIntervalS_);
+    }
+    else if (eAct == MM::AfterSet)
+    {
+        std::lock_guard<std::mutex> lock(metricsMutex_);
+        pProp->Get(metricsIntervalS_);
+        // Wake the writer so it picks up the new interval
+        metricsCv_.notify_all();
+    }
+    return DEVICE_OK;
+}
+
+int CIDSPeak::OnFrameRate(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+    if (eAct == MM::BeforeGet)
+    {
+        updateFramerateLimits();
+        pProp->Set(framerateCur_);
+    }
+    else if (eAct == MM::AfterSet)
+    {
+        double framerateTemp;
+        pProp->Get(framerateTemp);
+        framerateSet(framerateTemp);
+    }
+    return DEVICE_OK;
+}
+
+int CIDSPeak::OnExposureChangeLatency(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+    // This is a readonly function
+    if (eAct == MM::BeforeGet)
+    {
+        pProp->Set(exposureChangeLatencyUs_.load());
+    }
+    return DEVICE_OK;
+}
 
 /**
-* Sync internal image buffer size to the chosen property values.
+* Handles "HDR mode" property.
 */
-int CIDSPeak::ResizeImageBuffer()
+int CIDSPeak::OnHdrMode(MM::PropertyBase* pProp, MM::ActionType eAct)
 {
-    char buf[MM::MaxStrLength];
-    int nRet = GetProperty(MM::g_Keyword_Binning, buf);
-    if (nRet != DEVICE_OK)
-        return nRet;
-    binSize_ = atol(buf);
+    if (eAct == MM::BeforeGet)
+    {
+        if (hdrMode_ == HDR_MODE_16BIT) { pProp->Set(g_HdrMode_16bit); }
+        else if (hdrMode_ == HDR_MODE_32BIT) { pProp->Set(g_HdrMode_32bit); }
+        else { pProp->Set(g_HdrMode_Off); }
+    }
+    else if (eAct == MM::AfterSet)
+    {
+        if (IsCapturing())
+            return DEVICE_CAMERA_BUSY_ACQUIRING;
 
-    img_.Resize(cameraCCDXSize_ / binSize_, cameraCCDYSize_ / binSize_, nComponents_ * (bitDepth_/8));
+        string hdrMode;
+        pProp->Get(hdrMode);
+        int newMode = HDR_MODE_OFF;
+        if (hdrMode == g_HdrMode_16bit) { newMode = HDR_MODE_16BIT; }
+        else if (hdrMode == g_HdrMode_32bit) { newMode = HDR_MODE_32BIT; }
+        if (newMode != HDR_MODE_OFF && nComponents_ != 1) { return ERR_HDR_NEEDS_MONO; }
+        if (newMode != HDR_MODE_OFF && (interleavedChannels_ > 0 || roiCycling_)) { return ERR_CYCLE_CONFLICT; }
+
+        hdrMode_ = newMode;
+        img_.Resize(img_.Width(), img_.Height(), outputBytesPerPixel());
+        publishConfig();
+    }
     return DEVICE_OK;
 }
 
-void CIDSPeak::GenerateEmptyImage(ImgBuffer& img)
+/**
+* Handles "HDR exposures (ms)" property, a comma separated list of 2 to 4 exposures.
+*/
+int CIDSPeak::OnHdrExposures(MM::PropertyBase* pProp, MM::ActionType eAct)
 {
-    MMThreadGuard g(imgPixelsLock_);
-    if (img.Height() == 0 || img.Width() == 0 || img.Depth() == 0)
-        return;
-    unsigned char* pBuf = const_cast<unsigned char*>(img.GetPixels());
-    memset(pBuf, 0, img.Height() * img.Width() * img.Depth());
+    if (eAct == MM::BeforeGet)
+    {
+        ostringstream exposures;
+        for (size_t k = 0; k < hdrExposures_.size(); k++)
+        {
+            exposures << (k > 0 ? "," : "") << hdrExposures_[k];
+        }
+        pProp->Set(exposures.str().c_str());
+    }
+    else if (eAct == MM::AfterSet)
+    {
+        if (IsCapturing())
+            return DEVICE_CAMERA_BUSY_ACQUIRING;
+
+        string value;
+        pProp->Get(value);
+        vector<double> exposures;
+        istringstream stream(value);
+        string item;
+        while (getline(stream, item, ','))
+        {
+            double exposure = atof(item.c_str());
+            if (exposure < exposureMin_ || exposure > exposureMax_) { return ERR_HDR_EXPOSURES; }
+            exposures.push_back(exposure);
+        }
+        if (exposures.size() < 2 || exposures.size() > 4) { return ERR_HDR_EXPOSURES; }
+
+        hdrExposures_ = exposures;
+        publishConfig();
+    }
+    return DEVICE_OK;
 }
 
-peak_status CIDSPeak::getTemperature(double* sensorTemp)
+/**
+* Handles "Interleaved channels" property, 0 switches interleaving off.
+*/
+int CIDSPeak::OnInterleavedChannels(MM::PropertyBase* pProp, MM::ActionType eAct)
 {
-    size_t enumerationEntryCount = 0;
+    if (eAct == MM::BeforeGet)
+    {
+        pProp->Set(interleavedChannels_);
+    }
+    else if (eAct == MM::AfterSet)
+    {
+        if (IsCapturing())
+            return DEVICE_CAMERA_BUSY_ACQUIRING;
+
+        long channels;
+        pProp->Get(channels);
+        if (channels > 0 && (hdrMode_ != HDR_MODE_OFF || roiCycling_)) { return ERR_CYCLE_CONFLICT; }
+        interleavedChannels_ = channels;
+        publishConfig();
+    }
+    return DEVICE_OK;
+}
+
+int CIDSPeak::OnInterleavedOutput(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+    if (eAct == MM::BeforeGet)
+    {
+        pProp->Set(separateChannels_ ? g_InterleavedOutput_Separate : g_InterleavedOutput_Tagged);
+    }
+    else if (eAct == MM::AfterSet)
+    {
+        if (IsCapturing())
+            return DEVICE_CAMERA_BUSY_ACQUIRING;
+
+        string output;
+        pProp->Get(output);
+        separateChannels_ = (output == g_InterleavedOutput_Separate);
+        publishConfig();
+    }
+    return DEVICE_OK;
+}
+
+int CIDSPeak::OnChannelExposure(MM::PropertyBase* pProp, MM::ActionType eAct, long channel)
+{
+    if (eAct == MM::BeforeGet)
+    {
+        pProp->Set(channelSettings_[channel].exposureMs);
+    }
+    else if (eAct == MM::AfterSet)
+    {
+        if (IsCapturing())
+            return DEVICE_CAMERA_BUSY_ACQUIRING;
+
+        double exposure;
+        pProp->Get(exposure);
+        if (exposure < exposureMin_ || exposure > exposureMax_) { return DEVICE_INVALID_PROPERTY_VALUE; }
+        channelSettings_[channel].exposureMs = exposure;
+        publishConfig();
+    }
+    return DEVICE_OK;
+}
+
+int CIDSPeak::OnChannelGain(MM::PropertyBase* pProp, MM::ActionType eAct, long channel)
+{
+    if (eAct == MM::BeforeGet)
+    {
+        pProp->Set(channelSettings_[channel].gain);
+    }
+    else if (eAct == MM::AfterSet)
+    {
+        if (IsCapturing())
+            return DEVICE_CAMERA_BUSY_ACQUIRING;
+
+        double gain;
+        pProp->Get(gain);
+        if (gain < gainMin_ || gain > gainMax_) { return DEVICE_INVALID_PROPERTY_VALUE; }
+        channelSettings_[channel].gain = gain;
+        publishConfig();
+    }
+    return DEVICE_OK;
+}
+
+/**
+* Handles the "Channel N output line" properties. The selected line carries the
+* exposure active signal during the frames of that channel, e.g. to switch the
+* illumination of the channel.
+*/
+int CIDSPeak::OnChannelOutputLine(MM::PropertyBase* pProp, MM::ActionType eAct, long channel)
+{
+    if (eAct == MM::BeforeGet)
+    {
+        const string& line = channelSettings_[channel].outputLine;
+        pProp->Set(line.empty() ? g_OutputLine_None : line.c_str());
+    }
+    else if (eAct == MM::AfterSet)
+    {
+        if (IsCapturing())
+            return DEVICE_CAMERA_BUSY_ACQUIRING;
+
+        string line;
+        pProp->Get(line);
+        channelSettings_[channel].outputLine = (line == g_OutputLine_None) ? "" : line;
+        publishConfig();
+    }
+    return DEVICE_OK;
+}
+
+/**
+* Handles "Auto whitebalance" property.
+*/
+int CIDSPeak::OnAutoWhiteBalance(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+    int nRet = DEVICE_OK;
+
+    if (eAct == MM::BeforeGet)
+    {
+        if (peak_AutoWhiteBalance_GetAccessStatus(hCam) == PEAK_ACCESS_READWRITE
+            || peak_AutoWhiteBalance_GetAccessStatus(hCam) == PEAK_ACCESS_READONLY)
+        {
+            status = peak_AutoWhiteBalance_Mode_Get(hCam, &peakAutoWhiteBalance_);
+        }
+        const char* autoWB = peakAutoToString[peakAutoWhiteBalance_].c_str();
+        pProp->Set(autoWB);
+    }
+
+    else if (eAct == MM::AfterSet)
+    {
+        if (IsCapturing())
+            return DEVICE_CAMERA_BUSY_ACQUIRING;
+
+        string autoWB;
+        pProp->Get(autoWB);
+
+        status = peak_AutoWhiteBalance_Mode_Set(hCam, (peak_auto_feature_mode)stringToPeakAuto[autoWB]);
+        if (status != PEAK_STATUS_SUCCESS) { nRet = ERR_NO_WRITE_ACCESS; }
+        else { peakAutoWhiteBalance_ = (peak_auto_feature_mode)stringToPeakAuto[autoWB]; }
+    }
+    return nRet;
+}
+
+/**
+* Handles "Gain master" property.
+*/
+int CIDSPeak::OnGainMaster(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+
+    int nRet = DEVICE_OK;
+
+    if (eAct == MM::BeforeGet)
+    {
+        status = peak_Gain_Get(hCam, PEAK_GAIN_TYPE_DIGITAL, PEAK_GAIN_CHANNEL_MASTER, &gainMaster_);
+        pProp->Set(gainMaster_);
+    }
+
+    else if (eAct == MM::IsSequenceable)
+    {
+        pProp->SetSequenceable(gainSequenceable_ ? sequenceMaxLength_ : 0);
+    }
+
+    else if (eAct == MM::AfterLoadSequence)
+    {
+        vector<string> sequence = pProp->GetSequence();
+        vector<double> gains;
+        for (size_t i = 0; i < sequence.size(); i++)
+        {
+            double gain = atof(sequence[i].c_str());
+            if (gain < gainMin_ || gain > gainMax_) { return DEVICE_INVALID_PROPERTY_VALUE; }
+            gains.push_back(gain);
+        }
+        gainSequence_ = gains;
+    }
+
+    else if (eAct == MM::StartSequence)
+    {
+        gainSequenceRunning_ = true;
+    }
+
+    else if (eAct == MM::StopSequence)
+    {
+        gainSequenceRunning_ = false;
+    }
+
+    else if (eAct == MM::AfterSet)
+    {
+        // The gain can be changed while running free, but not while the
+        // acquisition cycles it frame by frame
+        if (IsCapturing() && !getConfig()->cycle.empty())
+            return DEVICE_CAMERA_BUSY_ACQUIRING;
+
+        double gainMaster;
+        pProp->Get(gainMaster);
+
+        status = peak_Gain_Set(hCam, PEAK_GAIN_TYPE_DIGITAL, PEAK_GAIN_CHANNEL_MASTER, gainMaster);
+        if (status != PEAK_STATUS_SUCCESS) { nRet = ERR_NO_WRITE_ACCESS; }
+        else
+        {
+            gainMaster_ = gainMaster;
+            publishConfig();
+        }
+    }
+    return nRet;
+}
+
+/**
+* Handles "Gain red" property.
+*/
+int CIDSPeak::OnGainRed(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+
+    int nRet = DEVICE_OK;
+
+    if (eAct == MM::BeforeGet)
+    {
+        status = peak_Gain_Get(hCam, PEAK_GAIN_TYPE_DIGITAL, PEAK_GAIN_CHANNEL_RED, &gainRed_);
+        pProp->Set(gainRed_);
+    }
+
+    else if (eAct == MM::AfterSet)
+    {
+        if (IsCapturing())
+            return DEVICE_CAMERA_BUSY_ACQUIRING;
+
+        double gainRed;
+        pProp->Get(gainRed);
+
+        status = peak_Gain_Set(hCam, PEAK_GAIN_TYPE_DIGITAL, PEAK_GAIN_CHANNEL_RED, gainRed);
+        if (status != PEAK_STATUS_SUCCESS) { nRet = ERR_NO_WRITE_ACCESS; }
+        else { gainRed_ = gainRed; }
+
+    }
+    return nRet;
+}
+
+/**
+* Handles "Gain green" property.
+*/
+int CIDSPeak::OnGainGreen(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+
+    int nRet = DEVICE_OK;
+
+    if (eAct == MM::BeforeGet)
+    {
+        status = peak_Gain_Get(hCam, PEAK_GAIN_TYPE_DIGITAL, PEAK_GAIN_CHANNEL_GREEN, &gainGreen_);
+        pProp->Set(gainGreen_);
+    }
+
+    else if (eAct == MM::AfterSet)
+    {
+        if (IsCapturing())
+            return DEVICE_CAMERA_BUSY_ACQUIRING;
+
+        double gainGreen;
+        pProp->Get(gainGreen);
+
+        status = peak_Gain_Set(hCam, PEAK_GAIN_TYPE_DIGITAL, PEAK_GAIN_CHANNEL_GREEN, gainGreen);
+        if (status != PEAK_STATUS_SUCCESS) { nRet = ERR_NO_WRITE_ACCESS; }
+        else { gainGreen_ = gainGreen; }
+
+    }
+    return nRet;
+}
+
+/**
+* Handles "Gain blue" property.
+*/
+int CIDSPeak::OnGainBlue(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+
+    int nRet = DEVICE_OK;
+
+    if (eAct == MM::BeforeGet)
+    {
+        status = peak_Gain_Get(hCam, PEAK_GAIN_TYPE_DIGITAL, PEAK_GAIN_CHANNEL_BLUE, &gainBlue_);
+        pProp->Set(gainRed_);
+    }
+
+    else if (eAct == MM::AfterSet)
+    {
+        if (IsCapturing())
+            return DEVICE_CAMERA_BUSY_ACQUIRING;
+
+        double gainBlue;
+        pProp->Get(gainBlue);
+
+        status = peak_Gain_Set(hCam, PEAK_GAIN_TYPE_DIGITAL, PEAK_GAIN_CHANNEL_BLUE, gainBlue);
+        if (status != PEAK_STATUS_SUCCESS) { nRet = ERR_NO_WRITE_ACCESS; }
+        else { gainBlue_ = gainBlue; }
+
+    }
+    return nRet;
+}
+
+/**
+* Handles "PixelType" property.
+*/
+int CIDSPeak::OnPixelType(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+    int nRet = DEVICE_OK;
+    switch (eAct)
+    {
+    case MM::AfterSet:
+    {
+        if (IsCapturing())
+            return DEVICE_CAMERA_BUSY_ACQUIRING;
+        // The slave transfer kernels of the composite depend on the pixel type
+        if (compositeMode_ != COMPOSITE_OFF)
+            return DEVICE_CAN_NOT_SET_PROPERTY;
+
+        string pixelType;
+        pProp->Get(pixelType);
+
+        if (peak_PixelFormat_GetAccessStatus(hCam) == PEAK_ACCESS_READWRITE)
+        {
+            if (pixelType == g_PixelType_8bit)
+            {
+                status = peak_PixelFormat_Set(hCam, PEAK_PIXEL_FORMAT_MONO8);
+                nComponents_ = 1;
+            }
+            else
+            {
+                status = peak_PixelFormat_Set(hCam, PEAK_PIXEL_FORMAT_BAYER_RG8);
+                nComponents_ = 4;
+                // HDR fusion is monochrome only
+                hdrMode_ = HDR_MODE_OFF;
+            }
+        }
+        else
+        {
+            return ERR_NO_WRITE_ACCESS;
+        }
+
+        // Only 8bit formats are supported for now
+        bitDepth_ = 8;
+        nRet = selectTransferKernel();
+
+        // Resize buffer to accomodate the new image
+        img_.Resize(img_.Width(), img_.Height(), outputBytesPerPixel());
+        publishConfig();        
+    }
+    break;
+    case MM::BeforeGet:
+    {
+        if (nComponents_ == 1)
+        {
+            pProp->Set(g_PixelType_8bit);
+        }
+        else
+        {
+            pProp->Set(g_PixelType_32bitRGBA);
+        }
+       
+    } break;
+    default:
+        break;
+    }
+    return nRet;
+}
+
+/**
+* Handles "ReadoutTime" property.
+* Not sure this does anything...
+*/
+int CIDSPeak::OnReadoutTime(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+    if (eAct == MM::AfterSet)
+    {
+        double readoutMs;
+        pProp->Get(readoutMs);
+
+        readoutUs_ = readoutMs * 1000.0;
+    }
+    else if (eAct == MM::BeforeGet)
+    {
+        pProp->Set(readoutUs_ / 1000.0);
+    }
+
+    return DEVICE_OK;
+}
+
+int CIDSPeak::OnSupportsMultiROI(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+    if (eAct == MM::AfterSet)
+    {
+        long tvalue = 0;
+        pProp->Get(tvalue);
+        supportsMultiROI_ = (tvalue != 0);
+    }
+    else if (eAct == MM::BeforeGet)
+    {
+        pProp->Set((long)supportsMultiROI_);
+    }
+
+    return DEVICE_OK;
+}
+
+/**
+* Handles "MultiROICycling" property.
+*/
+int CIDSPeak::OnMultiROICycling(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+    if (eAct == MM::AfterSet)
+    {
+        if (IsCapturing())
+            return DEVICE_CAMERA_BUSY_ACQUIRING;
+
+        long tvalue = 0;
+        pProp->Get(tvalue);
+        if (tvalue != 0 && (hdrMode_ != HDR_MODE_OFF || interleavedChannels_ > 0)) { return ERR_CYCLE_CONFLICT; }
+        roiCycling_ = (tvalue != 0);
+        if (IsMultiROISet()) { return applyMultiROI(); }
+    }
+    else if (eAct == MM::BeforeGet)
+    {
+        pProp->Set((long)roiCycling_);
+    }
+
+    return DEVICE_OK;
+}
+
+int CIDSPeak::OnMultiROIFillValue(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+    if (eAct == MM::AfterSet)
+    {
+        long tvalue = 0;
+        pProp->Get(tvalue);
+        multiROIFillValue_ = (int)tvalue;
+    }
+    else if (eAct == MM::BeforeGet)
+    {
+        pProp->Set((long)multiROIFillValue_);
+    }
+
+    return DEVICE_OK;
+}
+
+int CIDSPeak::OnCameraCCDXSize(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+    if (eAct == MM::BeforeGet)
+    {
+        pProp->Set(cameraCCDXSize_);
+    }
+    else if (eAct == MM::AfterSet)
+    {
+        long value;
+        pProp->Get(value);
+        if ((value < 16) || (33000 < value))
+            return DEVICE_ERR;  // invalid image size
+        if (value != cameraCCDXSize_)
+        {
+            cameraCCDXSize_ = value;
+            img_.Resize(cameraCCDXSize_ / binSize_, cameraCCDYSize_ / binSize_);
+            publishConfig();
+        }
+    }
+    return DEVICE_OK;
+
+}
+
+int CIDSPeak::OnCameraCCDYSize(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+    if (eAct == MM::BeforeGet)
+    {
+        pProp->Set(cameraCCDYSize_);
+    }
+    else if (eAct == MM::AfterSet)
+    {
+        long value;
+        pProp->Get(value);
+        if ((value < 16) || (33000 < value))
+            return DEVICE_ERR;  // invalid image size
+        if (value != cameraCCDYSize_)
+        {
+            cameraCCDYSize_ = value;
+            img_.Resize(cameraCCDXSize_ / binSize_, cameraCCDYSize_ / binSize_);
+            publishConfig();
+        }
+    }
+    return DEVICE_OK;
+
+}
+
+int CIDSPeak::OnTriggerDevice(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+    if (eAct == MM::BeforeGet)
+    {
+        pProp->Set(triggerDevice_.c_str());
+    }
+    else if (eAct == MM::AfterSet)
+    {
+        pProp->Get(triggerDevice_);
+    }
+    return DEVICE_OK;
+}
+
+
+int CIDSPeak::OnCCDTemp(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+    // This is a readonly function
+    if (eAct == MM::BeforeGet)
+    {
+        status = getTemperature(&ccdT_);
+        pProp->Set(ccdT_);
+    }
+    return DEVICE_OK;
+}
+
+int CIDSPeak::OnModelName(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+    int nRet = DEVICE_OK;
+    // This is a readonly function
+    if (eAct == MM::BeforeGet)
+    {
+        pProp->Set(modelName_.c_str());
+    }
+    return nRet;
+}
+
+int CIDSPeak::OnSerialNumber(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+    int nRet = DEVICE_OK;
+    // This is a readonly function
+    if (eAct == MM::BeforeGet)
+    {
+        pProp->Set(serialNum_.c_str());
+    }
+    return nRet;
+}
+
+int CIDSPeak::OnIsSequenceable(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+    std::string val = "Yes";
+    if (eAct == MM::BeforeGet)
+    {
+        if (!isSequenceable_)
+        {
+            val = "No";
+        }
+        pProp->Set(val.c_str());
+    }
+    else if (eAct == MM::AfterSet)
+    {
+        isSequenceable_ = false;
+        pProp->Get(val);
+        if (val == "Yes")
+        {
+            isSequenceable_ = true;
+        }
+    }
+
+    return DEVICE_OK;
+}
+
+int CIDSPeak::OnIsGainSequenceable(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+    if (eAct == MM::BeforeGet)
+    {
+        pProp->Set(gainSequenceable_ ? "Yes" : "No");
+    }
+    else if (eAct == MM::AfterSet)
+    {
+        string val;
+        pProp->Get(val);
+        gainSequenceable_ = (val == "Yes");
+    }
+
+    return DEVICE_OK;
+}
+
+/**
+* Handles "Exposure control" property. With "Trigger width" every frame is
+* exposed for as long as the trigger line is at the active level, the exposure
+* time setting is not used.
+*/
+int CIDSPeak::OnExposureControl(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+    if (eAct == MM::BeforeGet)
+    {
+        pProp->Set(triggerWidthExposure_ ? g_ExposureControl_TriggerWidth : g_ExposureControl_Timed);
+    }
+    else if (eAct == MM::AfterSet)
+    {
+        if (IsCapturing())
+            return DEVICE_CAMERA_BUSY_ACQUIRING;
+
+        string control;
+        pProp->Get(control);
+        triggerWidthExposure_ = (control == g_ExposureControl_TriggerWidth);
+        publishConfig();
+    }
+    return DEVICE_OK;
+}
+
+int CIDSPeak::OnTriggerLine(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+    if (eAct == MM::BeforeGet)
+    {
+        pProp->Set(triggerLine_.c_str());
+    }
+    else if (eAct == MM::AfterSet)
+    {
+        if (IsCapturing())
+            return DEVICE_CAMERA_BUSY_ACQUIRING;
+
+        pProp->Get(triggerLine_);
+        // Rewrite the trigger configuration on next use
+        triggerConfig_ = TRIGGER_CONFIG_UNKNOWN;
+    }
+    return DEVICE_OK;
+}
+
+int CIDSPeak::OnTriggerLevel(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+    if (eAct == MM::BeforeGet)
+    {
+        pProp->Set(triggerLevelHigh_ ? "High" : "Low");
+    }
+    else if (eAct == MM::AfterSet)
+    {
+        if (IsCapturing())
+            return DEVICE_CAMERA_BUSY_ACQUIRING;
+
+        string level;
+        pProp->Get(level);
+        triggerLevelHigh_ = (level == "High");
+        triggerConfig_ = TRIGGER_CONFIG_UNKNOWN;
+    }
+    return DEVICE_OK;
+}
+
+int CIDSPeak::OnExternalTriggerTimeout(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+    if (eAct == MM::BeforeGet)
+    {
+        pProp->Set(externalTriggerTimeoutMs_);
+    }
+    else if (eAct == MM::AfterSet)
+    {
+        pProp->Get(externalTriggerTimeoutMs_);
+    }
+    return DEVICE_OK;
+}
+
+/**
+* Handles "Camera sync" property. Switching on configures and checks the
+* hardware chain, the other opened cameras then expose together with this one
+* during sequence acquisitions.
+*/
+int CIDSPeak::OnCameraSync(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+    if (eAct == MM::BeforeGet)
+    {
+        pProp->Set(syncEnabled_ ? g_CameraSync_HardwareChain : g_CameraSync_Off);
+    }
+    else if (eAct == MM::AfterSet)
+    {
+        if (IsCapturing())
+            return DEVICE_CAMERA_BUSY_ACQUIRING;
+
+        string mode;
+        pProp->Get(mode);
+        bool enable = (mode == g_CameraSync_HardwareChain);
+        if (syncEnabled_) { teardownSync(); }
+        syncEnabled_ = false;
+        syncCheck_ = "Not checked";
+        if (enable)
+        {
+            int nRet = setupSync();
+            if (nRet == DEVICE_OK) { nRet = validateSync(); }
+            if (nRet != DEVICE_OK)
+            {
+                teardownSync();
+                return nRet;
+            }
+            syncEnabled_ = true;
+        }
+    }
+    return DEVICE_OK;
+}
+
+int CIDSPeak::OnSyncMasterLine(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+    if (eAct == MM::BeforeGet)
+    {
+        pProp->Set(syncMasterLine_.c_str());
+    }
+    else if (eAct == MM::AfterSet)
+    {
+        if (syncEnabled_)
+            return DEVICE_CAN_NOT_SET_PROPERTY;
+        pProp->Get(syncMasterLine_);
+    }
+    return DEVICE_OK;
+}
+
+int CIDSPeak::OnSyncSlaveLine(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+    if (eAct == MM::BeforeGet)
+    {
+        pProp->Set(syncSlaveLine_.c_str());
+    }
+    else if (eAct == MM::AfterSet)
+    {
+        if (syncEnabled_)
+            return DEVICE_CAN_NOT_SET_PROPERTY;
+        pProp->Get(syncSlaveLine_);
+    }
+    return DEVICE_OK;
+}
+
+int CIDSPeak::OnSyncSlaveCameras(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+    if (eAct == MM::BeforeGet)
+    {
+        pProp->Set(syncSlaveCameras_.c_str());
+    }
+    else if (eAct == MM::AfterSet)
+    {
+        if (syncEnabled_)
+            return DEVICE_CAN_NOT_SET_PROPERTY;
+        pProp->Get(syncSlaveCameras_);
+    }
+    return DEVICE_OK;
+}
+
+int CIDSPeak::OnSyncTolerance(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+    if (eAct == MM::BeforeGet)
+    {
+        pProp->Set(syncToleranceUs_);
+    }
+    else if (eAct == MM::AfterSet)
+    {
+        pProp->Get(syncToleranceUs_);
+    }
+    return DEVICE_OK;
+}
+
+int CIDSPeak::OnSyncCheck(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+    if (eAct == MM::BeforeGet)
+    {
+        pProp->Set(syncCheck_.c_str());
+    }
+    return DEVICE_OK;
+}
+
+/**
+* Handles "Composite output" property.
+*/
+int CIDSPeak::OnCompositeOutput(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+    if (eAct == MM::BeforeGet)
+    {
+        const char* mode = g_Composite_Off;
+        if (compositeMode_ == COMPOSITE_SIDE_BY_SIDE) { mode = g_Composite_SideBySide; }
+        else if (compositeMode_ == COMPOSITE_CHANNELS) { mode = g_Composite_Channels; }
+        else if (compositeMode_ == COMPOSITE_STAGGERED) { mode = g_Composite_Staggered; }
+        pProp->Set(mode);
+    }
+    else if (eAct == MM::AfterSet)
+    {
+        if (IsCapturing())
+            return DEVICE_CAMERA_BUSY_ACQUIRING;
+
+        string mode;
+        pProp->Get(mode);
+        int newMode = COMPOSITE_OFF;
+        if (mode == g_Composite_SideBySide) { newMode = COMPOSITE_SIDE_BY_SIDE; }
+        else if (mode == g_Composite_Channels) { newMode = COMPOSITE_CHANNELS; }
+        else if (mode == g_Composite_Staggered) { newMode = COMPOSITE_STAGGERED; }
+        return setupComposite(newMode);
+    }
+    return DEVICE_OK;
+}
+
+int CIDSPeak::OnChangeCamera(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+    int nRet = DEVICE_OK;
+    if (eAct == MM::BeforeGet)
+    {
+        pProp->Set(CDeviceUtils::ConvertToString(CamID_));
+    }
+    else if (eAct == MM::AfterSet)
+    {
+        string CamID_temp;
+        pProp->Get(CamID_temp);
+        if (syncEnabled_)
+        {
+            // The new camera may be one of the slaves
+            teardownSync();
+            syncEnabled_ = false;
+        }
+        CamID_ = stoi(CamID_temp);
+        hCam = hCams[CamID_];
+        cameraChanged();
+    }
+    return nRet;
+}
+
+int CIDSPeak::OnAcqThreadPriority(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+    if (eAct == MM::BeforeGet)
+    {
+        pProp->Set(threadPriorityToString[acqThreadPriority_].c_str());
+    }
+    else if (eAct == MM::AfterSet)
+    {
+        // Takes effect when the next acquisition thread is started
+        string priority;
+        pProp->Get(priority);
+        acqThreadPriority_ = stringToThreadPriority[priority];
+    }
+    return DEVICE_OK;
+}
+
+int CIDSPeak::OnAcqThreadCore(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+    if (eAct == MM::BeforeGet)
+    {
+        pProp->Set((long)acqThreadCore_);
+    }
+    else if (eAct == MM::AfterSet)
+    {
+        // Takes effect when the next acquisition thread is started
+        long core;
+        pProp->Get(core);
+        acqThreadCore_ = (int)core;
+    }
+    return DEVICE_OK;
+}
+
+int CIDSPeak::OnWorkerThreads(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+    if (eAct == MM::BeforeGet)
+    {
+        pProp->Set(workerThreads_);
+    }
+    else if (eAct == MM::AfterSet)
+    {
+        if (IsCapturing())
+            return DEVICE_CAMERA_BUSY_ACQUIRING;
+
+        pProp->Get(workerThreads_);
+        pool_->Resize((unsigned)workerThreads_, workerThreadCore_, workerThreadPriority_);
+    }
+    return DEVICE_OK;
+}
+
+int CIDSPeak::OnWorkerThreadPriority(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+    if (eAct == MM::BeforeGet)
+    {
+        pProp->Set(threadPriorityToString[workerThreadPriority_].c_str());
+    }
+    else if (eAct == MM::AfterSet)
+    {
+        if (IsCapturing())
+            return DEVICE_CAMERA_BUSY_ACQUIRING;
+
+        string priority;
+        pProp->Get(priority);
+        workerThreadPriority_ = stringToThreadPriority[priority];
+        pool_->Resize((unsigned)workerThreads_, workerThreadCore_, workerThreadPriority_);
+    }
+    return DEVICE_OK;
+}
+
+int CIDSPeak::OnWorkerThreadCore(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+    if (eAct == MM::BeforeGet)
+    {
+        pProp->Set((long)workerThreadCore_);
+    }
+    else if (eAct == MM::AfterSet)
+    {
+        if (IsCapturing())
+            return DEVICE_CAMERA_BUSY_ACQUIRING;
+
+        long core;
+        pProp->Get(core);
+        workerThreadCore_ = (int)core;
+        pool_->Resize((unsigned)workerThreads_, workerThreadCore_, workerThreadPriority_);
+    }
+    return DEVICE_OK;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Private CIDSPeak methods
+///////////////////////////////////////////////////////////////////////////////
+
+/**
+* Sync internal image buffer size to the chosen property values.
+*/
+int CIDSPeak::ResizeImageBuffer()
+{
+    char buf[MM::MaxStrLength];
+    int nRet = GetProperty(MM::g_Keyword_Binning, buf);
+    if (nRet != DEVICE_OK)
+        return nRet;
+    binSize_ = atol(buf);
+
+    img_.Resize(cameraCCDXSize_ / binSize_, cameraCCDYSize_ / binSize_, outputBytesPerPixel());
+    publishConfig();
+    return DEVICE_OK;
+}
+
+void CIDSPeak::GenerateEmptyImage(ImgBuffer& img)
+{
+    MMThreadGuard g(imgPixelsLock_);
+    if (img.Height() == 0 || img.Width() == 0 || img.Depth() == 0)
+        return;
+    unsigned char* pBuf = const_cast<unsigned char*>(img.GetPixels());
+    memset(pBuf, 0, img.Height() * img.Width() * img.Depth());
+}
+
+peak_status CIDSPeak::getTemperature(double* sensorTemp)
+{
+    size_t enumerationEntryCount = 0;
+
+    if (PEAK_IS_READABLE(
+        peak_GFA_Feature_GetAccessStatus(hCam, PEAK_GFA_MODULE_REMOTE_DEVICE, "DeviceFirmwareVersion")))
+    {
+        // get the length of the feature string
+        status = peak_GFA_Enumeration_GetList(hCam, PEAK_GFA_MODULE_REMOTE_DEVICE, "DeviceTemperatureSelector", NULL, &enumerationEntryCount);
+        status = getGFAfloat("DeviceTemperature", sensorTemp);
+    }
+    else
+    {
+        logAsync(LogRing::LEVEL_WARNING, "No read access to device temperature");
+    }
+    return status;
+}
+
+int CIDSPeak::cleanExit()
+{
+
+    // Clean up before exit
+    // Stop acquisition, if running
+    if (peak_Acquisition_IsStarted(hCam))
+    {
+        // Stop acquisition
+        status = peak_Acquisition_Stop(hCam);
+        checkForSuccess(status, PEAK_TRUE);
+    }
+
+    // Close camera, if open
+    if (hCam != PEAK_INVALID_HANDLE)
+    {
+        // Close Camera
+        status = peak_Camera_Close(hCam);
+        checkForSuccess(status, PEAK_TRUE);
+    }
+
+    // Exit library
+    status = peak_Library_Exit();
+    checkForSuccess(status, PEAK_TRUE);
+
+    return status;
+}
+
+//Returns PEAK_TRUE, if function was successful.
+//Returns PEAK_FALSE, if function returned with an error. If continueExecution == PEAK_FALSE,
+//the backend is exited.
+peak_bool CIDSPeak::checkForSuccess(peak_status checkStatus, peak_bool continueExecution)
+{
+    if (PEAK_ERROR(checkStatus))
+    {
+        peak_status lastErrorCode = PEAK_STATUS_SUCCESS;
+        size_t lastErrorMessageSize = 0;
+
+        // Get size of error message
+        status = peak_Library_GetLastError(&lastErrorCode, NULL, &lastErrorMessageSize);
+        if (PEAK_ERROR(status))
+        {
+            // Something went wrong getting the last error!
+            char message[128];
+            snprintf(message, sizeof(message), "Last-Error: Getting last error code failed! Status: %#06x", status);
+            logAsync(LogRing::LEVEL_ERROR, message);
+            return PEAK_FALSE;
+        }
+
+        if (checkStatus != lastErrorCode)
+        {
+            // Another error occured in the meantime. Proceed with the last error.
+            logAsync(LogRing::LEVEL_WARNING, "Last-Error: Another error occured in the meantime!");
+        }
+
+        // Zero-initialized buffer for the error message
+        vector<char> lastErrorMessage(lastErrorMessageSize + 1, '\0');
+
+        // Get the error message
+        status = peak_Library_GetLastError(&lastErrorCode, lastErrorMessage.data(), &lastErrorMessageSize);
+        if (PEAK_ERROR(status))
+        {
+            // Unable to get error message. This shouldn't ever happen.
+            char message[128];
+            snprintf(message, sizeof(message), "Last-Error: Getting last error message failed! Status: %#06x; Last error code: %#06x",
+                status, lastErrorCode);
+            logAsync(LogRing::LEVEL_ERROR, message);
+            return PEAK_FALSE;
+        }
+
+        ostringstream message;
+        message << "Last-Error: " << lastErrorMessage.data() << " | Code: 0x" << std::hex << lastErrorCode;
+        logAsync(LogRing::LEVEL_ERROR, message.str().c_str());
+
+        if (!continueExecution)
+        {
+            cleanExit();
+        }
+
+        return PEAK_FALSE;
+    }
+    return PEAK_TRUE;
+}
+
+int CIDSPeak::getSensorInfo()
+{
+    // check if the feature is readable
+    if (PEAK_IS_READABLE(
+        peak_GFA_Feature_GetAccessStatus(hCam, PEAK_GFA_MODULE_REMOTE_DEVICE, "DeviceFirmwareVersion")))
+    {
+        int64_t temp_x;
+        int64_t temp_y;
+        status = getGFAInt("WidthMax", &temp_x);
+        status = getGFAInt("HeightMax", &temp_y);
+        cameraCCDXSize_ = (long)temp_x;
+        cameraCCDYSize_ = (long)temp_y;
+    }
+    else
+    {
+        return ERR_NO_READ_ACCESS;
+    }
+    if (status == PEAK_STATUS_SUCCESS) { return DEVICE_OK; }
+    else { return DEVICE_ERR; }
+}
+
+peak_status CIDSPeak::getGFAString(const char* featureName, char* stringValue)
+{
+    size_t stringLength = 0;
+
+    // get the length of the feature string
+    status = peak_GFA_String_Get(hCam, PEAK_GFA_MODULE_REMOTE_DEVICE, featureName, NULL, &stringLength);
+
+    // if successful, read the firmware version
+    if (checkForSuccess(status, PEAK_TRUE))
+    {
+        // read the string value of featureName
+        status = peak_GFA_String_Get(
+            hCam, PEAK_GFA_MODULE_REMOTE_DEVICE, featureName, stringValue, &stringLength);
+    }
+    return status;
+}
+
+peak_status CIDSPeak::getGFAInt(const char* featureName, int64_t* intValue)
+{
+    // read the integer value of featureName
+    status = peak_GFA_Integer_Get(
+        hCam, PEAK_GFA_MODULE_REMOTE_DEVICE, featureName, intValue);
+    return status;
+}
+
+peak_status CIDSPeak::getGFAfloat(const char* featureName, double* floatValue)
+{
+    // read the float value of featureName
+    status = peak_GFA_Float_Get(
+        hCam, PEAK_GFA_MODULE_REMOTE_DEVICE, featureName, floatValue);
+    return status;
+}
+
+peak_status CIDSPeak::setGFAEnum(peak_camera_handle hDev, const char* featureName, const char* value)
+{
+    // write the symbolic value of featureName
+    return peak_GFA_Enumeration_SetBySymbolicValue(
+        hDev, PEAK_GFA_MODULE_REMOTE_DEVICE, featureName, value);
+}
+
+peak_status CIDSPeak::setGFAInt(peak_camera_handle hDev, const char* featureName, int64_t value)
+{
+    // write the integer value of featureName
+    return peak_GFA_Integer_Set(
+        hDev, PEAK_GFA_MODULE_REMOTE_DEVICE, featureName, value);
+}
+
+peak_status CIDSPeak::setGFAfloat(peak_camera_handle hDev, const char* featureName, double value)
+{
+    // write the float value of featureName
+    return peak_GFA_Float_Set(
+        hDev, PEAK_GFA_MODULE_REMOTE_DEVICE, featureName, value);
+}
+
+peak_status CIDSPeak::executeGFACommand(peak_camera_handle hDev, const char* featureName)
+{
+    // execute the command featureName
+    return peak_GFA_Command_Execute(
+        hDev, PEAK_GFA_MODULE_REMOTE_DEVICE, featureName);
+}
+
+/**
+* Appends the symbolic values of the enumeration featureName to values.
+*/
+peak_status CIDSPeak::getGFAEnumList(peak_camera_handle hDev, const char* featureName, vector<string>& values)
+{
+    // Get the entries, uses two staged data query (first get length of list, then get list)
+    size_t entryCount = 0;
+    peak_status enumStatus = peak_GFA_Enumeration_GetList(
+        hDev, PEAK_GFA_MODULE_REMOTE_DEVICE, featureName, NULL, &entryCount);
+    if (enumStatus != PEAK_STATUS_SUCCESS || entryCount == 0) { return enumStatus; }
+    vector<peak_gfa_enumeration_entry> entries(entryCount);
+    enumStatus = peak_GFA_Enumeration_GetList(
+        hDev, PEAK_GFA_MODULE_REMOTE_DEVICE, featureName, entries.data(), &entryCount);
+    if (enumStatus != PEAK_STATUS_SUCCESS) { return enumStatus; }
+    for (size_t i = 0; i < entryCount; i++)
+    {
+        values.push_back(entries[i].symbolicValue);
+    }
+    return enumStatus;
+}
+
+/**
+* Returns the symbolic value of the enumeration featureName.
+*/
+peak_status CIDSPeak::getGFAEnum(peak_camera_handle hDev, const char* featureName, string& value)
+{
+    peak_gfa_enumeration_entry entry;
+    peak_status enumStatus = peak_GFA_Enumeration_Get(hDev, PEAK_GFA_MODULE_REMOTE_DEVICE, featureName, &entry);
+    if (enumStatus == PEAK_STATUS_SUCCESS) { value = entry.symbolicValue; }
+    return enumStatus;
+}
+
+bool CIDSPeak::isGFAWritable(peak_camera_handle hDev, const char* featureName)
+{
+    return PEAK_IS_WRITEABLE(
+        peak_GFA_Feature_GetAccessStatus(hDev, PEAK_GFA_MODULE_REMOTE_DEVICE, featureName));
+}
+
+void CIDSPeak::initializeAutoWBConversion()
+{
+    peakAutoToString.insert(pair<int, string>(PEAK_AUTO_FEATURE_MODE_OFF, "Off"));
+    peakAutoToString.insert(pair<int, string>(PEAK_AUTO_FEATURE_MODE_ONCE, "Once"));
+    peakAutoToString.insert(pair<int, string>(PEAK_AUTO_FEATURE_MODE_CONTINUOUS, "Continuous"));
+
+    stringToPeakAuto.insert(pair<string, int>("Off", PEAK_AUTO_FEATURE_MODE_OFF));
+    stringToPeakAuto.insert(pair<string, int>("Once", PEAK_AUTO_FEATURE_MODE_ONCE));
+    stringToPeakAuto.insert(pair<string, int>("Continuous", PEAK_AUTO_FEATURE_MODE_CONTINUOUS));
+}
+
+void CIDSPeak::initializeThreadPriorityConversion()
+{
+    threadPriorityToString.insert(pair<int, string>(THREAD_PRIORITY_LEVEL_NORMAL, "Normal"));
+    threadPriorityToString.insert(pair<int, string>(THREAD_PRIORITY_LEVEL_ABOVE_NORMAL, "Above normal"));
+    threadPriorityToString.insert(pair<int, string>(THREAD_PRIORITY_LEVEL_HIGH, "High"));
+    threadPriorityToString.insert(pair<int, string>(THREAD_PRIORITY_LEVEL_TIME_CRITICAL, "Time critical"));
+
+    stringToThreadPriority.insert(pair<string, int>("Normal", THREAD_PRIORITY_LEVEL_NORMAL));
+    stringToThreadPriority.insert(pair<string, int>("Above normal", THREAD_PRIORITY_LEVEL_ABOVE_NORMAL));
+    stringToThreadPriority.insert(pair<string, int>("High", THREAD_PRIORITY_LEVEL_HIGH));
+    stringToThreadPriority.insert(pair<string, int>("Time critical", THREAD_PRIORITY_LEVEL_TIME_CRITICAL));
+}
+
+// Called from inside the acquisition thread, before the first frame is requested.
+void CIDSPeak::applyAcqThreadScheduling()
+{
+    if (acqThreadCore_ < 0 && acqThreadPriority_ == THREAD_PRIORITY_LEVEL_NORMAL) { return; }
+    if (!setCurrentThreadScheduling(acqThreadCore_, acqThreadPriority_))
+    {
+        logAsync(LogRing::LEVEL_WARNING, "Could not apply acquisition thread priority/core, continuing with OS defaults");
+    }
+}
+
+int CIDSPeak::transferBuffer(peak_frame_handle hFrame, ImgBuffer& img)
+{
+    std::shared_ptr<const AcqConfig> config = getConfig();
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    int nRet = config->snapTransfer(hCam, hFrame, img, pool_);
+    if (nRet == DEVICE_OK) { recordDemosaicCost(config->snapDemosaic, secondsSince(start), img); }
+    return nRet;
+}
+
+/**
+* Records the cost of a frame converted by a demosaic algorithm (for Bayer
+* formats only), in ms per megapixel, for the DemosaicCost property.
+*/
+void CIDSPeak::recordDemosaicCost(int demosaic, double seconds, const ImgBuffer& img)
+{
+    if (demosaic < 0 || demosaic >= DEMOSAIC_COUNT || img.Width() == 0 || img.Height() == 0) { return; }
+    demosaicMsPerMP_[demosaic].store(seconds * 1e9 / ((double)img.Width() * img.Height()), std::memory_order_relaxed);
+}
+
+/**
+* Looks up the transfer kernel for the current camera pixel format and bit depth.
+* Called whenever the pixel format changes, never per frame.
+*/
+int CIDSPeak::selectTransferKernel()
+{
+    transferKernel_ = NULL;
+    snapTransferKernel_ = NULL;
+    peak_pixel_format format;
+    status = peak_PixelFormat_Get(hCam, &format);
+    if (status != PEAK_STATUS_SUCCESS) { return ERR_NO_READ_ACCESS; }
+
+    transferKernel_ = findTransferKernel(format, bitDepth_, demosaicLive_, NULL);
+    snapTransferKernel_ = findTransferKernel(format, bitDepth_, demosaicSnap_, NULL);
+    if (transferKernel_ == NULL || snapTransferKernel_ == NULL)
+    {
+        transferKernel_ = NULL;
+        snapTransferKernel_ = NULL;
+        return DEVICE_UNSUPPORTED_DATA_FORMAT;
+    }
+    if (transferKernel_->configure != NULL) { status = transferKernel_->configure(hCam); }
+    if (status == PEAK_STATUS_SUCCESS && snapTransferKernel_->configure != NULL) { status = snapTransferKernel_->configure(hCam); }
+    if (status != PEAK_STATUS_SUCCESS) { return DEVICE_UNSUPPORTED_DATA_FORMAT; }
+    return DEVICE_OK;
+}
+
+int CIDSPeak::updateAutoWhiteBalance()
+{
+    if (peak_AutoWhiteBalance_GetAccessStatus(hCam) == PEAK_ACCESS_READONLY
+        || peak_AutoWhiteBalance_GetAccessStatus(hCam) == PEAK_ACCESS_READWRITE)
+    {
+        // Update the gain channels
+        status = peak_Gain_Get(hCam, PEAK_GAIN_TYPE_DIGITAL, PEAK_GAIN_CHANNEL_MASTER, &gainMaster_);
+        status = peak_Gain_Get(hCam, PEAK_GAIN_TYPE_DIGITAL, PEAK_GAIN_CHANNEL_RED, &gainRed_);
+        status = peak_Gain_Get(hCam, PEAK_GAIN_TYPE_DIGITAL, PEAK_GAIN_CHANNEL_GREEN, &gainGreen_);
+        status = peak_Gain_Get(hCam, PEAK_GAIN_TYPE_DIGITAL, PEAK_GAIN_CHANNEL_BLUE, &gainBlue_);
+        // Update the auto white balance mode
+        status = peak_AutoWhiteBalance_Mode_Get(hCam, &peakAutoWhiteBalance_);
+    }
+    else { return ERR_NO_READ_ACCESS; }
+
+    if (status == PEAK_STATUS_SUCCESS) { return DEVICE_OK; }
+    else { return DEVICE_ERR; }
+}
+
+int CIDSPeak::framerateSet(double framerate)
+{
+    updateFramerateLimits();
+
+    // Check if interval doesn't exceed framerate limitations of camera
+    // Else set interval to match max framerate
+    if (framerate > framerateMax_)
+    {
+        framerate = framerateMax_;
+    }
+    else if (framerate < framerateMin_)
+    {
+        framerate = framerateMin_;
+    }
+
+    if (peak_FrameRate_GetAccessStatus(hCam) == PEAK_ACCESS_READWRITE)
+    {
+        status = peak_FrameRate_Set(hCam, framerate);
+        framerateCur_ = framerate;
+        // The longest exposure follows the frame period
+        readExposureRange();
+        publishConfig();
+    }
+    else
+    {
+        return ERR_NO_WRITE_ACCESS;
+    }
+    return DEVICE_OK;
+}
+
+/**
+* Publishes a new configuration snapshot from the current member values.
+* Must be called after every change of a setting mirrored in AcqConfig.
+*/
+void CIDSPeak::publishConfig()
+{
+    MMThreadGuard g(configWriteLock_);
+    std::shared_ptr<AcqConfig> config = std::make_shared<AcqConfig>();
+    config->version = configVersion_.load(std::memory_order_relaxed) + 1;
+    config->width = img_.Width();
+    config->height = img_.Height();
+    config->bytesPerPixel = img_.Depth();
+    config->bitDepth = hdrMode_ == HDR_MODE_16BIT ? 16 : (hdrMode_ == HDR_MODE_32BIT ? 32 : bitDepth_);
+    config->nComponents = nComponents_;
+    config->binning = binSize_;
+    config->decimation = decimation_;
+    config->shutterMode = shutterMode_;
+    config->roiX = roiX_;
+    config->roiY = roiY_;
+    config->exposureMs = exposureCur_;
+    config->framerate = framerateCur_;
+    config->transfer = transferKernel_ != NULL ? transferKernel_->transfer : &transferUnsupported;
+    config->snapTransfer = snapTransferKernel_ != NULL ? snapTransferKernel_->transfer : &transferUnsupported;
+    config->demosaic = transferKernel_ != NULL ? transferKernel_->demosaic : DEMOSAIC_ANY;
+    config->snapDemosaic = snapTransferKernel_ != NULL ? snapTransferKernel_->demosaic : DEMOSAIC_ANY;
+    config->hdrMode = hdrMode_;
+    config->hdrExposures = hdrExposures_;
+    buildHdrLuts(*config);
+    config->gainMaster = gainMaster_;
+    config->cycleOnSequencer = cycleOnSequencer_;
+    config->interleavedChannels = (int)interleavedChannels_;
+    config->separateChannels = separateChannels_ && interleavedChannels_ > 0;
+    config->roiCycling = false;
+    config->propertySequence = false;
+    config->triggerWidthExposure = triggerWidthExposure_;
+    config->syncSlaves = syncSlaves_;
+    config->syncToleranceUs = syncToleranceUs_;
+    config->compositeMode = compositeMode_;
+    config->staggerDelayUs = staggerDelayUs_;
+    if (compositeMode_ != COMPOSITE_OFF && !compositeSources_.empty())
+    {
+        // The master part follows the current ROI, binning and pixel type
+        config->compositeSources = compositeSources_;
+        CompositeSource& master = config->compositeSources[0];
+        master.hDev = hCam;
+        master.transfer = config->transfer;
+        master.width = config->width;
+        master.height = config->height;
+        if (compositeMode_ == COMPOSITE_SIDE_BY_SIDE)
+        {
+            unsigned width = 0;
+            unsigned height = 0;
+            for (size_t c = 0; c < config->compositeSources.size(); c++)
+            {
+                CompositeSource& source = config->compositeSources[c];
+                source.xOffset = width;
+                width += source.width;
+                if (source.height > height) { height = source.height; }
+            }
+            config->width = width;
+            config->height = height;
+        }
+    }
+    if (hdrMode_ != HDR_MODE_OFF)
+    {
+        for (size_t k = 0; k < hdrExposures_.size(); k++)
+        {
+            FrameSetting setting = { hdrExposures_[k], -1.0, "" };
+            config->cycle.push_back(setting);
+        }
+    }
+    else if (interleavedChannels_ > 0)
+    {
+        config->cycle.assign(channelSettings_.begin(), channelSettings_.begin() + interleavedChannels_);
+    }
+    else if (!roiCycleSettings_.empty())
+    {
+        // Every ROI is its own stream
+        config->cycle = roiCycleSettings_;
+        config->roiCycling = true;
+        config->separateChannels = true;
+    }
+    else if (!sequenceCycle_.empty())
+    {
+        config->cycle = sequenceCycle_;
+        config->propertySequence = true;
+    }
+    config->cycleMaxExposureMs = exposureCur_;
+    for (size_t k = 0; k < config->cycle.size(); k++)
+    {
+        const FrameSetting& setting = config->cycle[k];
+        if (setting.exposureMs > config->cycleMaxExposureMs) { config->cycleMaxExposureMs = setting.exposureMs; }
+        if (!setting.outputLine.empty()
+            && find(config->cycleLines.begin(), config->cycleLines.end(), setting.outputLine) == config->cycleLines.end())
+        {
+            config->cycleLines.push_back(setting.outputLine);
+        }
+    }
+
+    // Fill a free slot, then make it the current one. Only a reader preempted
+    // in the middle of getConfig can keep a slot busy, so this hardly waits.
+    unsigned current = configCurrent_.load();
+    unsigned next = current;
+    do
+    {
+        next = (next + 1) % CONFIG_SLOTS;
+        if (next == current) { std::this_thread::yield(); }
+    } while (next == current || configSlots_[next].readers.load() != 0);
+    configSlots_[next].config = config;
+    configCurrent_.store(next);
+    configVersion_.store(config->version, std::memory_order_release);
+}
+
+/**
+* Returns the latest configuration snapshot. Lock-free: no mutex, and a
+* reader only retries if a new snapshot got published while it was reading.
+* The reader count announced before re-checking the current slot keeps the
+* writer from reusing the slot while the shared_ptr is copied.
+*/
+std::shared_ptr<const AcqConfig> CIDSPeak::getConfig() const
+{
+    while (true)
+    {
+        unsigned index = configCurrent_.load();
+        ConfigSlot& slot = configSlots_[index];
+        slot.readers.fetch_add(1);
+        if (configCurrent_.load() == index)
+        {
+            std::shared_ptr<const AcqConfig> config = slot.config;
+            slot.readers.fetch_sub(1);
+            return config;
+        }
+        slot.readers.fetch_sub(1);
+    }
+}
+
+/**
+* Recomputes the frame rate range if an exposure change may have altered it.
+*/
+void CIDSPeak::updateFramerateLimits()
+{
+    if (!framerateLimitsDirty_) { return; }
+    status = peak_FrameRate_GetRange(hCam, &framerateMin_, &framerateMax_, &framerateInc_);
+    SetPropertyLimits("MDA framerate", framerateMin_, framerateMax_);
+    framerateLimitsDirty_ = false;
+}
+
+/**
+* Reads the exposure range of the camera (in ms), which depends on the shutter
+* mode and the frame rate, and sets the limits of the exposure property.
+*/
+int CIDSPeak::readExposureRange()
+{
+    double exposureMin = 0, exposureMax = 0, exposureInc = 0;
+    status = peak_ExposureTime_GetRange(hCam, &exposureMin, &exposureMax, &exposureInc);
+    if (status != PEAK_STATUS_SUCCESS) { return ERR_DEVICE_NOT_AVAILABLE; }
+    exposureMin_ = exposureMin / 1000;
+    exposureMax_ = exposureMax / 1000;
+    exposureInc_ = exposureInc / 1000;
+    return SetPropertyLimits(MM::g_Keyword_Exposure, exposureMin_, exposureMax_);
+}
+
+/**
+* Reads the exposure range of the camera, which depends on the shutter mode.
+* The exposure time is clamped into the new range.
+*/
+int CIDSPeak::updateExposureRange()
+{
+    int nRet = readExposureRange();
+    if (nRet != DEVICE_OK)
+        return nRet;
+    status = peak_ExposureTime_Get(hCam, &exposureCur_);
+    exposureCur_ /= 1000;
+    updateSnapConfig();
+    publishConfig();
+    return DEVICE_OK;
+}
+
+/**
+* Updates the timing model after a shutter mode change. Rolling and global
+* shutters read out while the next frame is exposed, a global reset shutter
+* reads out after the exposure, so there the readout adds to the frame period.
+*/
+void CIDSPeak::updateShutterTiming()
+{
+    double readoutUs = 0;
+    sensorReadoutMs_ = getGFAfloat("SensorReadoutTime", &readoutUs) == PEAK_STATUS_SUCCESS ? readoutUs / 1000 : 0;
+    serialReadoutMs_ = shutterMode_ == "GlobalReset" ? sensorReadoutMs_ : 0;
+    framerateLimitsDirty_ = true;
+    updateFramerateLimits();
+}
+
+/**
+* Starts a new clock model with a few samples in quick succession, so the
+* first frames already get host exposure times.
+*/
+void CIDSPeak::startClockCorrelation()
+{
+    clock_.Reset();
+    frameTimestamp_ = 0;
+    for (int i = 0; i < 4 && clockLatchSupported_; i++) { sampleClock(); }
+}
+
+/**
+* Latches the camera timestamp and pairs it with the host time halfway the
+* latch command (the command round trip is the uncertainty of a sample).
+*/
+void CIDSPeak::sampleClock()
+{
+    lastClockSample_ = GetCurrentMMTime();
+    if (!clockLatchSupported_) { return; }
+    MM::MMTime before = GetCurrentMMTime();
+    peak_status latchStatus = executeGFACommand(hCam, "TimestampLatch");
+    MM::MMTime after = GetCurrentMMTime();
+    int64_t latched = 0;
+    if (latchStatus == PEAK_STATUS_SUCCESS)
+    {
+        latchStatus = peak_GFA_Integer_Get(hCam, PEAK_GFA_MODULE_REMOTE_DEVICE, "TimestampLatchValue", &latched);
+    }
+    if (latchStatus != PEAK_STATUS_SUCCESS)
+    {
+        logAsync(LogRing::LEVEL_INFO, "Camera has no timestamp latch, no host exposure times in the metadata");
+        clockLatchSupported_ = false;
+        return;
+    }
+    clock_.AddSample((uint64_t)latched, (before.getUsec() + after.getUsec()) / 2);
+}
+
+/**
+* Waits for the next complete frame of a plain acquisition. Incomplete frames
+* are dropped and timeouts are waited out, any other error restarts the
+* acquisition. Gives up after recoveryTimeoutMs_ without a good frame, which
+* ends the sequence as before. The duration of every recovery and the number
+* of frames lost during it are recorded.
+*/
+int CIDSPeak::waitForFrameRecovering(const AcqConfig& config, uint32_t timeoutMs, peak_frame_handle& hFrame)
+{
+    std::chrono::steady_clock::time_point failureStart;
+    bool failing = false;
+    bool restarted = false;
+    uint64_t lostIncomplete = 0;
+    while (!thd_->IsStopped())
+    {
+        bool incomplete = false;
+        peak_status acqStatus = peak_Acquisition_WaitForFrame(hCam, timeoutMs, &hFrame);
+#ifdef IDS_PEAK_FAULT_INJECTION
+        if (acqStatus == PEAK_STATUS_SUCCESS) { acqStatus = injectFault(hFrame, incomplete); }
+#endif
+        if (acqStatus == PEAK_STATUS_SUCCESS)
+        {
+            uint64_t frameId = 0;
+            peak_Frame_ID_Get(hFrame, &frameId);
+            if (incomplete || peak_Frame_IsComplete(hFrame) == PEAK_FALSE)
+            {
+                peak_Frame_Release(hCam, hFrame);
+                lastFrameId_ = frameId;
+                lostIncomplete++;
+                metrics_.Increment(AcqMetrics::FRAMES_LOST);
+                incomplete = true;
+            }
+            else
+            {
+                if (failing)
+                {
+                    // Lost frames from the gap in frame IDs, the IDs restart with the acquisition
+                    double recoverySeconds = secondsSince(failureStart);
+                    uint64_t lost = lostIncomplete;
+                    if (restarted) { lost += (uint64_t)(recoverySeconds * config.framerate); }
+                    else if (frameId > lastFrameId_ + 1) { lost += frameId - lastFrameId_ - 1; }
+                    lastRecoveryMs_ = recoverySeconds * 1000;
+                    lastRecoveryLostFrames_ = (long)lost;
+                    metrics_.RecoveryFinished(recoverySeconds, lost - lostIncomplete);
+                    ostringstream message;
+                    message << "Acquisition recovered after " << lastRecoveryMs_ << " ms, " << lost << " frames lost";
+                    logAsync(LogRing::LEVEL_WARNING, message.str().c_str());
+                }
+                lastFrameId_ = frameId;
+                return DEVICE_OK;
+            }
+        }
+        // Incomplete frames are counted and dropped, they are no failure
+        if (incomplete) { continue; }
+        // Externally triggered frames come whenever the trigger source sends them
+        if (acqStatus == PEAK_STATUS_TIMEOUT && config.triggerWidthExposure) { continue; }
+
+        if (!failing)
+        {
+            if (recoveryTimeoutMs_ <= 0) { return DEVICE_ERR; }
+            failing = true;
+            failureStart = std::chrono::steady_clock::now();
+            ostringstream message;
+            message << "Frame wait failed (status " << acqStatus << "), recovering";
+            logAsync(LogRing::LEVEL_WARNING, message.str().c_str());
+        }
+        if (secondsSince(failureStart) * 1000 > recoveryTimeoutMs_)
+        {
+            logAsync(LogRing::LEVEL_ERROR, "Acquisition did not recover, stopping the sequence");
+            return DEVICE_ERR;
+        }
+        if (acqStatus != PEAK_STATUS_TIMEOUT)
+        {
+            // Aborted data stream: restart the stream. A camera that dropped
+            // off the bus doesn't start any more, it is reopened (retrying
+            // until it is back or time is up) and then restarted.
+            if (hCam != PEAK_INVALID_HANDLE) { peak_Acquisition_Stop(hCam); }
+            bool started = hCam != PEAK_INVALID_HANDLE && peak_Acquisition_Start(hCam, PEAK_INFINITE) == PEAK_STATUS_SUCCESS;
+            if (!started && reopenCamera(config))
+            {
+                started = peak_Acquisition_Start(hCam, PEAK_INFINITE) == PEAK_STATUS_SUCCESS;
+            }
+            if (started)
+            {
+                restarted = true;
+                acqRestarted_ = true;
+            }
+            else { std::this_thread::sleep_for(std::chrono::milliseconds(100)); }
+        }
+    }
+    return DEVICE_ERR;
+}
+
+/**
+* Opens the camera again after it dropped off the bus, found by its serial
+* number in a fresh camera list, and restores the settings of the running
+* plain acquisition, as the camera comes back with its power on defaults.
+* Returns false while the camera is not back. Acquisition thread only.
+*/
+bool CIDSPeak::reopenCamera(const AcqConfig& config)
+{
+#ifdef IDS_PEAK_FAULT_INJECTION
+    // An injected device loss keeps the camera off the bus for a while
+    if (std::chrono::steady_clock::now() < faultDeviceBack_) { return false; }
+#endif
+    if (hCam != PEAK_INVALID_HANDLE)
+    {
+        peak_Camera_Close(hCam);
+        hCam = PEAK_INVALID_HANDLE;
+        hCams[CamID_] = PEAK_INVALID_HANDLE;
+    }
+    size_t cameraListLength = 0;
+    if (peak_CameraList_Update(NULL) != PEAK_STATUS_SUCCESS
+        || peak_CameraList_Get(NULL, &cameraListLength) != PEAK_STATUS_SUCCESS) { return false; }
+    vector<peak_camera_descriptor> cameraList(cameraListLength);
+    if (peak_CameraList_Get(cameraList.data(), &cameraListLength) != PEAK_STATUS_SUCCESS) { return false; }
+    peak_camera_handle hReopened = PEAK_INVALID_HANDLE;
+    for (size_t i = 0; i < cameraListLength && hReopened == PEAK_INVALID_HANDLE; i++)
+    {
+        if (serialNum_ != cameraList[i].serialNumber) { continue; }
+        if (peak_Camera_Open(cameraList[i].cameraID, &hReopened) != PEAK_STATUS_SUCCESS) { hReopened = PEAK_INVALID_HANDLE; }
+    }
+    if (hReopened == PEAK_INVALID_HANDLE) { return false; }
+    hCam = hReopened;
+    hCams[CamID_] = hReopened;
+
+    // Same order as the property changes: format and sensor readout first,
+    // then the ROI they limit, then exposure and frame rate
+    int failed = 0;
+    if (transferKernel_ != NULL)
+    {
+        if (peak_PixelFormat_Set(hCam, transferKernel_->sourceFormat) != PEAK_STATUS_SUCCESS) { failed++; }
+        if (transferKernel_->configure != NULL && transferKernel_->configure(hCam) != PEAK_STATUS_SUCCESS) { failed++; }
+        if (snapTransferKernel_->configure != NULL && snapTransferKernel_->configure(hCam) != PEAK_STATUS_SUCCESS) { failed++; }
+    }
+    if (config.binning > 1 && peak_Binning_Set(hCam, (uint32_t)config.binning, (uint32_t)config.binning) != PEAK_STATUS_SUCCESS) { failed++; }
+    if (config.decimation > 1
+        && peak_Decimation_Set(hCam, (uint32_t)config.decimation, (uint32_t)config.decimation) != PEAK_STATUS_SUCCESS) { failed++; }
+    if (config.shutterMode != g_ShutterMode_Default
+        && setGFAEnum(hCam, "SensorShutterMode", config.shutterMode.c_str()) != PEAK_STATUS_SUCCESS) { failed++; }
+    peak_roi roi;
+    roi.offset.x = roiTrackActive_ ? roiTrackX_.load() : config.roiX;
+    roi.offset.y = roiTrackActive_ ? roiTrackY_.load() : config.roiY;
+    roi.size.width = roiTrackActive_ ? roiTrackWidth_.load() : config.width;
+    roi.size.height = roiTrackActive_ ? roiTrackHeight_.load() : config.height;
+    if (peak_ROI_Set(hCam, roi) != PEAK_STATUS_SUCCESS) { failed++; }
+    if (peak_ExposureTime_Set(hCam, config.exposureMs * 1000) != PEAK_STATUS_SUCCESS) { failed++; }
+    if (peak_Gain_Set(hCam, PEAK_GAIN_TYPE_DIGITAL, PEAK_GAIN_CHANNEL_MASTER, config.gainMaster) != PEAK_STATUS_SUCCESS) { failed++; }
+    if (config.nComponents > 1)
+    {
+        peak_Gain_Set(hCam, PEAK_GAIN_TYPE_DIGITAL, PEAK_GAIN_CHANNEL_RED, gainRed_);
+        peak_Gain_Set(hCam, PEAK_GAIN_TYPE_DIGITAL, PEAK_GAIN_CHANNEL_GREEN, gainGreen_);
+        peak_Gain_Set(hCam, PEAK_GAIN_TYPE_DIGITAL, PEAK_GAIN_CHANNEL_BLUE, gainBlue_);
+    }
+    triggerConfig_ = TRIGGER_CONFIG_UNKNOWN;
+    if (applyTriggerConfig(config.triggerWidthExposure ? TRIGGER_CONFIG_WIDTH : TRIGGER_CONFIG_FREERUN) != DEVICE_OK) { failed++; }
+    if (!config.triggerWidthExposure && peak_FrameRate_Set(hCam, config.framerate) != PEAK_STATUS_SUCCESS) { failed++; }
+    // The timestamps restart with the camera
+    clock_.Reset();
+
+    ostringstream message;
+    message << "Camera " << serialNum_ << " reopened after it was lost";
+    if (failed > 0) { message << ", " << failed << " settings could not be restored"; }
+    logAsync(failed > 0 ? LogRing::LEVEL_WARNING : LogRing::LEVEL_INFO, message.str().c_str());
+    return true;
+}
+
+#ifdef IDS_PEAK_FAULT_INJECTION
+/**
+* Replaces every faultInterval_-th frame with the selected fault, as the
+* camera or driver would report it.
+*/
+peak_status CIDSPeak::injectFault(peak_frame_handle hFrame, bool& incomplete)
+{
+    if (faultInjection_ == FAULT_NONE || ++faultCounter_ % faultInterval_ != 0) { return PEAK_STATUS_SUCCESS; }
+    switch (faultInjection_)
+    {
+    case FAULT_TIMEOUT:
+        peak_Frame_Release(hCam, hFrame);
+        return PEAK_STATUS_TIMEOUT;
+    case FAULT_ABORTED:
+        peak_Frame_Release(hCam, hFrame);
+        return PEAK_STATUS_ABORTED;
+    case FAULT_INCOMPLETE:
+        incomplete = true;
+        return PEAK_STATUS_SUCCESS;
+    case FAULT_DEVICE_LOST:
+        // The camera drops off the bus: its handle is gone, and it is only
+        // found again after FAULT_DEVICE_LOST_MS (see reopenCamera)
+        peak_Frame_Release(hCam, hFrame);
+        peak_Acquisition_Stop(hCam);
+        peak_Camera_Close(hCam);
+        hCam = PEAK_INVALID_HANDLE;
+        hCams[CamID_] = PEAK_INVALID_HANDLE;
+        faultDeviceBack_ = std::chrono::steady_clock::now() + std::chrono::milliseconds(FAULT_DEVICE_LOST_MS);
+        return PEAK_STATUS_ERROR;
+    case FAULT_SLOW_CONTROL:
+        // A control transfer blocking the acquisition thread, frames queue up in the driver
+        std::this_thread::sleep_for(std::chrono::milliseconds(250));
+        return PEAK_STATUS_SUCCESS;
+    }
+    return PEAK_STATUS_SUCCESS;
+}
+
+/**
+* Runs a live acquisition (live = true) until frames more images were
+* inserted, or a sequence of frames images until it ends, the same way the
+* core runs them. Returns DEVICE_ERR if the acquisition ended early or did
+* not get there within timeoutS, and when a self test is stopped.
+*/
+int CIDSPeak::runTestSequence(uint64_t frames, double intervalMs, double timeoutS, bool live)
+{
+    std::shared_ptr<const AcqConfig> config = getConfig();
+    if (!GetCoreCallback()->InitializeImageBuffer(GetNumberOfChannels(), 1,
+        config->width, config->height, config->bytesPerPixel))
+    {
+        return DEVICE_ERR;
+    }
+    uint64_t insertedStart = metrics_.Count(AcqMetrics::FRAMES_INSERTED);
+    int nRet = StartSequenceAcquisition(live ? LONG_MAX : (long)frames, intervalMs, false);
+    if (nRet != DEVICE_OK) { return nRet; }
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    while (IsCapturing() && !selfTestStop_ && secondsSince(start) < timeoutS
+        && metrics_.Count(AcqMetrics::FRAMES_INSERTED) - insertedStart < frames)
+    {
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+    bool complete = metrics_.Count(AcqMetrics::FRAMES_INSERTED) - insertedStart >= frames;
+    StopSequenceAcquisition();
+    return complete && !selfTestStop_ ? DEVICE_OK : DEVICE_ERR;
+}
+
+/**
+* Fault recovery test: a live acquisition per fault mode, with the fault
+* injected every FAULT_TEST_INTERVAL frames. Checks that the acquisition
+* rides out every fault, and the recovery time and the frames lost that
+* the last recovery reported against what the fault costs.
+*/
+void CIDSPeak::faultTestThread()
+{
+    static const int faults[] = { FAULT_TIMEOUT, FAULT_ABORTED, FAULT_INCOMPLETE, FAULT_DEVICE_LOST, FAULT_SLOW_CONTROL };
+    static const char* faultNames[] = { g_Fault_None, g_Fault_Timeout, g_Fault_Aborted,
+        g_Fault_Incomplete, g_Fault_DeviceLost, g_Fault_SlowControl };
+    int savedFault = faultInjection_;
+    long savedInterval = faultInterval_;
+    double savedRecoveryTimeoutMs = recoveryTimeoutMs_;
+    recoveryTimeoutMs_ = FAULT_DEVICE_LOST_MS + FAULT_TEST_MAX_RECOVERY_MS;
+    faultInterval_ = FAULT_TEST_INTERVAL;
+
+    long failures = 0;
+    ostringstream failed;
+    for (size_t f = 0; f < sizeof(faults) / sizeof(faults[0]) && !selfTestStop_; f++)
+    {
+        faultInjection_ = faults[f];
+        lastRecoveryMs_ = 0;
+        lastRecoveryLostFrames_ = 0;
+        uint64_t lostStart = metrics_.Count(AcqMetrics::FRAMES_LOST);
+        int nRet = runTestSequence(FAULT_TEST_FRAMES, 1000.0 / FAULT_TEST_FRAMERATE,
+            FAULT_TEST_FRAMES / 5.0 + FAULT_DEVICE_LOST_MS / 1000.0 + 10, true);
+        if (selfTestStop_) { break; }
+        double framerate = getConfig()->framerate;
+        uint64_t lost = metrics_.Count(AcqMetrics::FRAMES_LOST) - lostStart;
+
+        // Timeouts and aborts are recovered within a few frame times, a lost
+        // device once it is back (the recovery is timed from the first failed
+        // wait, slightly after the loss). The frames lost during a recovery are the
+        // frame ID gap (the one dropped frame of a timeout) or, after a
+        // restart, the frames the camera would have sent meanwhile.
+        ostringstream problem;
+        double expectedMs = faults[f] == FAULT_DEVICE_LOST ? FAULT_DEVICE_LOST_MS : 0;
+        bool recovers = faults[f] == FAULT_TIMEOUT || faults[f] == FAULT_ABORTED || faults[f] == FAULT_DEVICE_LOST;
+        if (nRet != DEVICE_OK) { problem << "the acquisition did not get " << FAULT_TEST_FRAMES << " frames"; }
+        else if (!recovers && lastRecoveryMs_ > 0) { problem << "a recovery ran although no frame wait failed"; }
+        else if (recovers && lastRecoveryMs_ <= 0) { problem << "no recovery was reported"; }
+        else if (recovers && (lastRecoveryMs_ < 0.9 * expectedMs || lastRecoveryMs_ > expectedMs + FAULT_TEST_MAX_RECOVERY_MS))
+        {
+            problem << "recovery took " << lastRecoveryMs_ << " ms";
+        }
+        else if (faults[f] == FAULT_TIMEOUT && lastRecoveryLostFrames_ != 1)
+        {
+            problem << lastRecoveryLostFrames_ << " frames lost instead of 1";
+        }
+        else if (recovers && faults[f] != FAULT_TIMEOUT
+            && lastRecoveryLostFrames_ > (long)(lastRecoveryMs_ * framerate / 1000) + 1)
+        {
+            problem << lastRecoveryLostFrames_ << " frames lost in " << lastRecoveryMs_ << " ms";
+        }
+        else if (faults[f] == FAULT_INCOMPLETE && lost < FAULT_TEST_FRAMES / FAULT_TEST_INTERVAL)
+        {
+            problem << "only " << lost << " incomplete frames counted";
+        }
+        else if (faults[f] == FAULT_SLOW_CONTROL && lost > 0) { problem << lost << " frames lost"; }
+
+        ostringstream message;
+        message << "Fault recovery test, " << faultNames[faults[f]] << ": ";
+        if (recovers) { message << lastRecoveryMs_ << " ms, " << lastRecoveryLostFrames_ << " frames lost, "; }
+        if (problem.str().empty()) { message << "passed"; }
+        else
+        {
+            message << "FAILED, " << problem.str();
+            failed << (failures == 0 ? "" : ", ") << faultNames[faults[f]];
+            failures++;
+        }
+        logAsync(problem.str().empty() ? LogRing::LEVEL_INFO : LogRing::LEVEL_ERROR, message.str().c_str());
+    }
+
+    faultInjection_ = savedFault;
+    faultInterval_ = savedInterval;
+    recoveryTimeoutMs_ = savedRecoveryTimeoutMs;
+    std::lock_guard<std::mutex> lock(benchmarkMutex_);
+    if (selfTestStop_) { selfTestResult_ = "Stopped"; }
+    else
+    {
+        selfTestFailures_ = failures;
+        selfTestResult_ = failures == 0 ? "Passed" : "Failed: " + failed.str() + " (see log)";
+    }
+    selfTestRunning_ = false;
+}
+
+/**
+* One round of the soak test: live view, an MDA like sequence, snaps and
+* property changes (exposure, binning, ROI), each returned to where it was.
+* Returns the number of workloads that failed.
+*/
+int CIDSPeak::runSoakRound()
+{
+    int failed = 0;
+    double intervalMs = 1000.0 / FAULT_TEST_FRAMERATE;
+    double timeoutS = SOAK_TEST_FRAMES / 5.0 + 10;
+    if (runTestSequence(SOAK_TEST_FRAMES, intervalMs, timeoutS, true) != DEVICE_OK) { failed++; }
+    if (selfTestStop_) { return failed; }
+    if (runTestSequence(SOAK_TEST_FRAMES, intervalMs, timeoutS, false) != DEVICE_OK) { failed++; }
+    for (int i = 0; i < SOAK_TEST_SNAPS && !selfTestStop_; i++)
+    {
+        if (SnapImage() != DEVICE_OK || GetImageBuffer() == NULL) { failed++; }
+    }
+
+    double exposure = GetExposure();
+    SetExposure(exposure / 2);
+    SetExposure(exposure);
+    if (GetNumberOfPropertyValues(MM::g_Keyword_Binning) > 1)
+    {
+        char binning[MM::MaxStrLength];
+        char otherBinning[MM::MaxStrLength];
+        GetProperty(MM::g_Keyword_Binning, binning);
+        GetPropertyValueAt(MM::g_Keyword_Binning, 1, otherBinning);
+        if (SetProperty(MM::g_Keyword_Binning, otherBinning) != DEVICE_OK) { failed++; }
+        if (SetProperty(MM::g_Keyword_Binning, binning) != DEVICE_OK) { failed++; }
+    }
+    unsigned x, y, width, height;
+    if (GetROI(x, y, width, height) == DEVICE_OK)
+    {
+        if (SetROI(x + width / 4, y + height / 4, width / 2, height / 2) != DEVICE_OK) { failed++; }
+        if (ClearROI() != DEVICE_OK || SetROI(x, y, width, height) != DEVICE_OK) { failed++; }
+    }
+    else { failed++; }
+    return failed;
+}
+
+/**
+* Soak test: repeats soak rounds for soakTestMinutes_ and samples the
+* resident memory, open handles, p99 latency of the frame processing
+* (transfer and insert) and lost frames after every round. The first
+* SOAK_TEST_WARMUP_ROUNDS rounds fill the caches and pools, the sample after
+* them is the baseline. Fails on the first workload error or sample beyond
+* the SOAK_TEST_MAX_* bounds of the baseline. Runs without injected faults.
+*/
+void CIDSPeak::soakTestThread()
+{
+    int savedFault = faultInjection_;
+    faultInjection_ = FAULT_NONE;
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    double baselineResident = 0;
+    long baselineHandles = 0;
+    double baselineLatencyMs = 0;
+    long failures = 0;
+    string problem;
+    for (int round = 1; !selfTestStop_ && problem.empty(); round++)
+    {
+        uint64_t lostStart = metrics_.Count(AcqMetrics::FRAMES_LOST);
+        int failedWorkloads = runSoakRound();
+        if (selfTestStop_) { break; }
+        uint64_t lost = metrics_.Count(AcqMetrics::FRAMES_LOST) - lostStart;
+        double resident = 0;
+        long handles = 0;
+        getProcessResources(resident, handles);
+        double latencyMs = 0;
+        {
+            std::lock_guard<std::mutex> lock(benchmarkMutex_);
+            if (sequenceBenchmarkValid_) { latencyMs = sequenceBenchmark_.p99TransferMs + sequenceBenchmark_.p99InsertMs; }
+        }
+        if (round == SOAK_TEST_WARMUP_ROUNDS)
+        {
+            baselineResident = resident;
+            baselineHandles = handles;
+            baselineLatencyMs = latencyMs;
+        }
+
+        ostringstream check;
+        if (failedWorkloads > 0) { check << failedWorkloads << " workloads failed"; }
+        else if (lost > 0) { check << lost << " frames lost"; }
+        else if (round > SOAK_TEST_WARMUP_ROUNDS)
+        {
+            if (resident - baselineResident > SOAK_TEST_MAX_RSS_GROWTH_MB * 1048576.0)
+            {
+                check << "resident memory grew by " << (resident - baselineResident) / 1048576 << " MB";
+            }
+            else if (handles - baselineHandles > SOAK_TEST_MAX_HANDLE_GROWTH)
+            {
+                check << "open handles grew by " << handles - baselineHandles;
+            }
+            else if (latencyMs > baselineLatencyMs * (1 + SOAK_TEST_MAX_LATENCY_DRIFT) + 1)
+            {
+                check << "p99 latency drifted from " << baselineLatencyMs << " to " << latencyMs << " ms";
+            }
+        }
+        problem = check.str();
+
+        ostringstream message;
+        message << "Soak test, round " << round << " after " << secondsSince(start) / 60 << " min: "
+            << resident / 1048576 << " MB resident, " << handles << " handles, p99 latency "
+            << latencyMs << " ms, " << lost << " frames lost";
+        if (!problem.empty()) { message << ", FAILED, " << problem; }
+        logAsync(problem.empty() ? LogRing::LEVEL_INFO : LogRing::LEVEL_ERROR, message.str().c_str());
+        if (!problem.empty()) { failures++; }
+        if (secondsSince(start) > soakTestMinutes_ * 60 && round > SOAK_TEST_WARMUP_ROUNDS) { break; }
+    }
+
+    faultInjection_ = savedFault;
+    std::lock_guard<std::mutex> lock(benchmarkMutex_);
+    if (selfTestStop_) { selfTestResult_ = "Stopped"; }
+    else
+    {
+        selfTestFailures_ = failures;
+        selfTestResult_ = failures == 0 ? "Passed" : "Failed: " + problem + " (see log)";
+    }
+    selfTestRunning_ = false;
+}
+
+/**
+* Synthetic frame of the tracked ROI, dark except for a full scale square
+* of the given size centered at a sensor position (size 0 = no signal).
+*/
+void CIDSPeak::drawTrackingTestFrame(const AcqConfig& config, ImgBuffer& img, unsigned centerX, unsigned centerY, unsigned size)
+{
+    img.Resize(roiTrackWidth_, roiTrackHeight_, config.bytesPerPixel);
+    memset(img.GetPixelsRW(), 0, (size_t)img.Width() * img.Height() * config.bytesPerPixel);
+    for (unsigned y = 0; y < img.Height() && size > 0; y++)
+    {
+        unsigned sensorY = roiTrackY_ + y;
+        if (sensorY + size / 2 < centerY || sensorY >= centerY + size / 2) { continue; }
+        for (unsigned x = 0; x < img.Width(); x++)
+        {
+            unsigned sensorX = roiTrackX_ + x;
+            if (sensorX + size / 2 < centerX || sensorX >= centerX + size / 2) { continue; }
+            unsigned char* pixel = img.GetPixelsRW() + ((size_t)y * img.Width() + x) * config.bytesPerPixel;
+            if (config.bytesPerPixel == 2) { *(uint16_t*)pixel = (uint16_t)((1 << config.bitDepth) - 1); }
+            else { memset(pixel, 255, config.bytesPerPixel); }
+        }
+    }
+}
+
+/**
+* ROI tracking test: drives one shrink and grow cycle on the running camera
+* with synthetic frames. A small spot for ROI_TRACK_SETTLE_FRAMES frames
+* must shrink the ROI around it, with tracking still active (the camera
+* restarted and the image buffer resized) and GetROI reporting it, and no
+* signal for as many frames must grow it back to the user ROI.
+*/
+void CIDSPeak::roiTrackTestThread()
+{
+    std::shared_ptr<const AcqConfig> config = getConfig();
+    long failures = 0;
+    ostringstream failed;
+    unsigned minFull = 4 * ROI_TRACK_SIZE_STEP + 2 * (unsigned)roiTrackMarginPx_;
+    if (config->width < minFull || config->height < minFull)
+    {
+        failed << "the ROI is too small to shrink";
+        failures++;
+    }
+    else if (GetCoreCallback()->InitializeImageBuffer(GetNumberOfChannels(), 1, config->width, config->height, config->bytesPerPixel)
+        && peak_Acquisition_Start(hCam, PEAK_INFINITE) == PEAK_STATUS_SUCCESS)
+    {
+        roiTrackActive_ = true;
+        roiTrackFramerate_ = config->framerate;
+        beginRoiTracking(*config);
+        ImgBuffer frame;
+        unsigned centerX = config->roiX + config->width / 2;
+        unsigned centerY = config->roiY + config->height / 2;
+        for (int i = 0; i < ROI_TRACK_SETTLE_FRAMES && roiTrackActive_; i++)
+        {
+            peak_roi frameRoi = { { roiTrackX_, roiTrackY_ }, { roiTrackWidth_, roiTrackHeight_ } };
+            drawTrackingTestFrame(*config, frame, centerX, centerY, ROI_TRACK_SIZE_STEP / 2);
+            updateRoiTracking(*config, frame, frameRoi);
+        }
+        unsigned x = 0, y = 0, width = 0, height = 0;
+        GetROI(x, y, width, height);
+        if (!roiTrackActive_) { failed << "tracking ended on the shrink"; failures++; }
+        else if (roiTrackWidth_ >= config->width || roiTrackHeight_ >= config->height)
+        {
+            failed << "the ROI did not shrink";
+            failures++;
+        }
+        else if (centerX < roiTrackX_ || centerX >= roiTrackX_ + roiTrackWidth_
+            || centerY < roiTrackY_ || centerY >= roiTrackY_ + roiTrackHeight_)
+        {
+            failed << "the shrunk ROI misses the spot";
+            failures++;
+        }
+        else if (x != roiTrackX_ || y != roiTrackY_ || width != roiTrackWidth_ || height != roiTrackHeight_)
+        {
+            failed << "GetROI does not report the tracked ROI";
+            failures++;
+        }
+        else
+        {
+            for (int i = 0; i < ROI_TRACK_SETTLE_FRAMES && roiTrackActive_; i++)
+            {
+                peak_roi frameRoi = { { roiTrackX_, roiTrackY_ }, { roiTrackWidth_, roiTrackHeight_ } };
+                drawTrackingTestFrame(*config, frame, centerX, centerY, 0);
+                updateRoiTracking(*config, frame, frameRoi);
+            }
+            if (!roiTrackActive_) { failed << "tracking ended on the grow"; failures++; }
+            else if (roiTrackX_ != config->roiX || roiTrackY_ != config->roiY
+                || roiTrackWidth_ != config->width || roiTrackHeight_ != config->height)
+            {
+                failed << "the ROI did not grow back to the user ROI";
+                failures++;
+            }
+        }
+        endRoiTracking(*config);
+        if (peak_Acquisition_IsStarted(hCam)) { peak_Acquisition_Stop(hCam); }
+    }
+    else
+    {
+        failed << "the acquisition did not start";
+        failures++;
+    }
+
+    ostringstream message;
+    message << "ROI tracking test: " << (failures == 0 ? "passed" : "FAILED, " + failed.str());
+    logAsync(failures == 0 ? LogRing::LEVEL_INFO : LogRing::LEVEL_ERROR, message.str().c_str());
+    std::lock_guard<std::mutex> lock(benchmarkMutex_);
+    selfTestFailures_ = failures;
+    selfTestResult_ = failures == 0 ? "Passed" : "Failed: " + failed.str();
+    selfTestRunning_ = false;
+}
+
+/**
+* Starts a self test in the background, the acquisitions it runs need the
+* camera for themselves.
+*/
+int CIDSPeak::startSelfTest(void (CIDSPeak::*test)())
+{
+    if (IsCapturing() || benchmarkRunning_) { return DEVICE_CAMERA_BUSY_ACQUIRING; }
+    if (selfTestRunning_) { return DEVICE_OK; }
+    if (selfTestThread_.joinable()) { selfTestThread_.join(); }
+    selfTestStop_ = false;
+    selfTestRunning_ = true;
+    {
+        std::lock_guard<std::mutex> lock(benchmarkMutex_);
+        selfTestResult_ = "Running";
+        selfTestFailures_ = -1;
+    }
+    selfTestThread_ = std::thread(test, this);
+    return DEVICE_OK;
+}
+
+void CIDSPeak::stopSelfTest()
+{
+    if (!selfTestThread_.joinable()) { return; }
+    selfTestStop_ = true;
+    selfTestThread_.join();
+}
+#endif
+
+/**
+* Queues a message for the log flusher. Safe to call from the acquisition and
+* worker threads, it never blocks on the log file.
+*/
+void CIDSPeak::logAsync(LogRing::Level level, const char* message)
+{
+    logRing_.Push(level, message);
+}
+
+void CIDSPeak::startLogFlusher()
+{
+    if (logThread_.joinable()) { return; }
+    logStop_ = false;
+    logThread_ = std::thread([this]() {
+        std::unique_lock<std::mutex> lock(logMutex_);
+        while (!logStop_)
+        {
+            // Producers don't signal, poll at a rate that keeps the log readable live
+            logCv_.wait_for(lock, std::chrono::milliseconds(100));
+            lock.unlock();
+            flushLog();
+            lock.lock();
+        }
+    });
+}
+
+/**
+* Stops the flusher after handing it the remaining messages.
+*/
+void CIDSPeak::stopLogFlusher()
+{
+    if (logThread_.joinable())
+    {
+        {
+            std::lock_guard<std::mutex> lock(logMutex_);
+            logStop_ = true;
+        }
+        logCv_.notify_all();
+        logThread_.join();
+    }
+    flushLog();
+}
+
+void CIDSPeak::flushLog()
+{
+    LogRing::Level level;
+    string message;
+    while (logRing_.Pop(level, message))
+    {
+        LogMessage(message, level == LogRing::LEVEL_DEBUG);
+    }
+    uint64_t dropped = logRing_.TakeDropped();
+    if (dropped > 0)
+    {
+        LogMessage(CDeviceUtils::ConvertToString((long)dropped) + string(" log messages dropped (rate limit or full queue)"));
+    }
+}
+
+void CIDSPeak::startMetricsWriter()
+{
+    metricsStop_ = false;
+    metricsThread_ = std::thread(&CIDSPeak::metricsWriterLoop, this);
+}
+
+void CIDSPeak::stopMetricsWriter()
+{
+    if (!metricsThread_.joinable()) { return; }
+    {
+        std::lock_guard<std::mutex> lock(metricsMutex_);
+        metricsStop_ = true;
+    }
+    metricsCv_.notify_all();
+    metricsThread_.join();
+}
+
+/**
+* Rewrites the metrics file every interval. Runs independently of the
+* acquisition, so a stalled acquisition still shows up as stale counters.
+*/
+void CIDSPeak::metricsWriterLoop()
+{
+    std::unique_lock<std::mutex> lock(metricsMutex_);
+    while (!metricsStop_)
+    {
+        std::chrono::duration<double> interval(metricsIntervalS_);
+        metricsCv_.wait_for(lock, interval);
+        if (metricsStop_) { break; }
+        lock.unlock();
+        if (writeMetrics() != DEVICE_OK) { LogMessage("Failed to write the metrics file " + metricsFile_); }
+        lock.lock();
+    }
+}
+
+/**
+* Writes the metrics in the Prometheus text format. The file is written next
+* to its destination and renamed, so the textfile collector never reads a
+* partial file.
+*/
+int CIDSPeak::writeMetrics()
+{
+    ostringstream labels;
+    labels << "camera=\"" << serialNum_ << "\",model=\"" << modelName_ << "\"";
+    ostringstream out;
+    metrics_.Render(out, labels.str());
+
+    out << "# HELP ids_peak_acquisition_running Whether a sequence acquisition is running.\n";
+    out << "# TYPE ids_peak_acquisition_running gauge\n";
+    out << "ids_peak_acquisition_running{" << labels.str() << "} " << (IsCapturing() ? 1 : 0) << "\n";
+
+    // Temperature and driver counters straight from the camera, the device
+    // state members belong to the property thread
+    double temperature = 0;
+    if (peak_GFA_Float_Get(hCam, PEAK_GFA_MODULE_REMOTE_DEVICE, "DeviceTemperature", &temperature) == PEAK_STATUS_SUCCESS)
+    {
+        out << "# HELP ids_peak_sensor_temperature_celsius Device temperature.\n";
+        out << "# TYPE ids_peak_sensor_temperature_celsius gauge\n";
+        out << "ids_peak_sensor_temperature_celsius{" << labels.str() << "} " << temperature << "\n";
+    }
+    double residentBytes = 0;
+    long handles = 0;
+    if (getProcessResources(residentBytes, handles))
+    {
+        out << "# HELP ids_peak_process_resident_memory_bytes Resident memory of the Micro-Manager process.\n";
+        out << "# TYPE ids_peak_process_resident_memory_bytes gauge\n";
+        out << "ids_peak_process_resident_memory_bytes{" << labels.str() << "} " << residentBytes << "\n";
+        out << "# HELP ids_peak_process_handles Open handles (file descriptors) of the Micro-Manager process.\n";
+        out << "# TYPE ids_peak_process_handles gauge\n";
+        out << "ids_peak_process_handles{" << labels.str() << "} " << handles << "\n";
+    }
+    peak_acquisition_info info;
+    if (IsCapturing() && peak_Acquisition_GetInfo(hCam, &info) == PEAK_STATUS_SUCCESS)
+    {
+        // Reset at every acquisition start, which rate() handles as a counter reset
+        out << "# HELP ids_peak_camera_frames_lost_total Frames lost in the camera and driver, by reason.\n";
+        out << "# TYPE ids_peak_camera_frames_lost_total counter\n";
+        out << "ids_peak_camera_frames_lost_total{" << labels.str() << ",reason=\"dropped\"} " << info.numDropped << "\n";
+        out << "ids_peak_camera_frames_lost_total{" << labels.str() << ",reason=\"incomplete\"} " << info.numIncomplete << "\n";
+        out << "ids_peak_camera_frames_lost_total{" << labels.str() << ",reason=\"underrun\"} " << info.numUnderrun << "\n";
+        out << "# HELP ids_peak_camera_frames_total Frames delivered by the driver in this acquisition.\n";
+        out << "# TYPE ids_peak_camera_frames_total counter\n";
+        out << "ids_peak_camera_frames_total{" << labels.str() << "} " << info.numFramesAcquired << "\n";
+    }
+
+    string tmpFile = metricsFile_ + ".tmp";
+    {
+        std::ofstream file(tmpFile.c_str(), std::ios::out | std::ios::trunc);
+        if (!file) { return ERR_METRICS_FILE; }
+        file << out.str();
+        if (!file) { return ERR_METRICS_FILE; }
+    }
+#ifdef _WIN32
+    if (!MoveFileExA(tmpFile.c_str(), metricsFile_.c_str(), MOVEFILE_REPLACE_EXISTING)) { return ERR_METRICS_FILE; }
+#else
+    if (rename(tmpFile.c_str(), metricsFile_.c_str()) != 0) { return ERR_METRICS_FILE; }
+#endif
+    return DEVICE_OK;
+}
+
+/**
+* Bytes per pixel of the images handed to Micro-Manager, which differs from the
+* sensor format when HDR fusion is on.
+*/
+unsigned CIDSPeak::outputBytesPerPixel() const
+{
+    if (hdrMode_ == HDR_MODE_16BIT) { return 2; }
+    if (hdrMode_ == HDR_MODE_32BIT) { return 4; }
+    return nComponents_ * (bitDepth_ / 8);
+}
+
+/**
+* Acquires one exposure bracket and fuses it into img. The bracket is the
+* setting cycle of the acquisition (see beginCycle), so the frames either come
+* from the camera sequencer or are software triggered one by one.
+*/
+int CIDSPeak::acquireHdrBracket(const AcqConfig& config, ImgBuffer& img)
+{
+    size_t nPixels = (size_t)config.width * config.height;
+    unsigned width = config.width;
+    hdrRaw_.Resize(config.width, config.height, 1);
+    hdrNum_.assign(nPixels, 0.0f);
+    hdrDen_.assign(nPixels, 0.0f);
+    float* num = hdrNum_.data();
+    float* den = hdrDen_.data();
+
+    size_t expected = 0;
+    while (expected < config.hdrExposures.size())
+    {
+        size_t k;
+        int nRet = acquireCycleFrame(config, hdrRaw_, k);
+        if (nRet != DEVICE_OK) { return nRet; }
+        if (k != expected)
+        {
+            // Out of step with the bracket (a frame got lost), start over
+            // with the first exposure of the next bracket
+            expected = 0;
+            std::fill(hdrNum_.begin(), hdrNum_.end(), 0.0f);
+            std::fill(hdrDen_.begin(), hdrDen_.end(), 0.0f);
+            if (k != 0) { continue; }
+        }
+
+        const uint8_t* raw = hdrRaw_.GetPixels();
+        const float* lutW = &config.hdrLutW[k * 256];
+        const float* lutWR = &config.hdrLutWR[k * 256];
+        pool_->ParallelFor(config.height, [&](unsigned begin, unsigned end) {
+            size_t offset = (size_t)begin * width;
+            hdrAccumulate(raw + offset, num + offset, den + offset, lutW, lutWR, (size_t)(end - begin) * width);
+        });
+        expected++;
+    }
+
+    MMThreadGuard g(imgPixelsLock_);
+    unsigned char* pBuf = const_cast<unsigned char*>(img.GetPixels());
+    pool_->ParallelFor(config.height, [&](unsigned begin, unsigned end) {
+        size_t offset = (size_t)begin * width;
+        size_t count = (size_t)(end - begin) * width;
+        if (config.hdrMode == HDR_MODE_32BIT)
+        {
+            hdrFuse32(num + offset, den + offset, (float*)pBuf + offset, count);
+        }
+        else
+        {
+            hdrFuse16(num + offset, den + offset, (uint16_t*)pBuf + offset, config.hdrScale16, count);
+        }
+    });
+    return DEVICE_OK;
+}
+
+/**
+* Benchmarks every per frame pixel kernel on synthetic frames of typical sensor
+* sizes, with the striping over the worker pool used during acquisition and a
+* range of thread counts. Every output is compared bit for bit against a plain
+* single threaded reference implementation. Results go to the log and to
+* benchmarkResults_. Runs on the benchmark thread, benchmarkDone_ and
+* benchmarkTotal_ report the progress.
+*/
+int CIDSPeak::runKernelBenchmark()
+{
+    typedef std::function<void(const uint8_t*, uint8_t*, unsigned, unsigned, WorkerPool*)> KernelRun;
+    typedef std::function<void(const uint8_t*, uint8_t*, unsigned, unsigned)> KernelReference;
+    struct BenchKernel
+    {
+        const char* name;
+        unsigned srcBytesPerPixel;
+        unsigned dstBytesPerPixel;
+        bool parallel;
+        KernelRun run;
+        KernelReference reference;
+    };
+
+    // HDR kernels fuse a two exposure bracket, stored as two planes in src
+    AcqConfig hdrConfig;
+    hdrConfig.hdrExposures.push_back(1.0);
+    hdrConfig.hdrExposures.push_back(10.0);
+    buildHdrLuts(hdrConfig);
+    const float* lutW = hdrConfig.hdrLutW.data();
+    const float* lutWR = hdrConfig.hdrLutWR.data();
+    float scale16 = hdrConfig.hdrScale16;
+    vector<float> num;
+    vector<float> den;
+    KernelRun hdrAccumulateBracket = [&](const uint8_t* src, uint8_t*, unsigned width, unsigned height, WorkerPool* pool) {
+        size_t nPixels = (size_t)width * height;
+        num.assign(nPixels, 0.0f);
+        den.assign(nPixels, 0.0f);
+        for (size_t k = 0; k < 2; k++)
+        {
+            pool->ParallelFor(height, [&](unsigned begin, unsigned end) {
+                size_t offset = (size_t)begin * width;
+                hdrAccumulate(src + k * nPixels + offset, num.data() + offset, den.data() + offset,
+                    lutW + k * 256, lutWR + k * 256, (size_t)(end - begin) * width);
+            });
+        }
+    };
+    // Same sums in the same order, one pixel at a time
+    auto hdrReferenceSums = [&](const uint8_t* src, size_t nPixels, size_t i, float& n, float& d) {
+        n = 0.0f;
+        d = 0.0f;
+        for (size_t k = 0; k < 2; k++)
+        {
+            uint8_t z = src[k * nPixels + i];
+            n += lutWR[k * 256 + z];
+            d += lutW[k * 256 + z];
+        }
+    };
+
+    vector<BenchKernel> kernels;
+    kernels.push_back({ "Mono copy", 1, 1, true,
+        [](const uint8_t* src, uint8_t* dst, unsigned width, unsigned height, WorkerPool* pool) {
+            copyStriped(dst, src, (size_t)width * height, pool);
+        },
+        [](const uint8_t* src, uint8_t* dst, unsigned width, unsigned height) {
+            for (size_t i = 0; i < (size_t)width * height; i++) { dst[i] = src[i]; }
+        } });
+    kernels.push_back({ "HDR fusion 16bit", 2, 2, true,
+        [&](const uint8_t* src, uint8_t* dst, unsigned width, unsigned height, WorkerPool* pool) {
+            hdrAccumulateBracket(src, dst, width, height, pool);
+            pool->ParallelFor(height, [&](unsigned begin, unsigned end) {
+                size_t offset = (size_t)begin * width;
+                hdrFuse16(num.data() + offset, den.data() + offset, (uint16_t*)dst + offset, scale16, (size_t)(end - begin) * width);
+            });
+        },
+        [&](const uint8_t* src, uint8_t* dst, unsigned width, unsigned height) {
+            size_t nPixels = (size_t)width * height;
+            for (size_t i = 0; i < nPixels; i++)
+            {
+                float n, d;
+                hdrReferenceSums(src, nPixels, i, n, d);
+                float value = d > 0.0f ? n / d * scale16 + 0.5f : 0.0f;
+                ((uint16_t*)dst)[i] = (uint16_t)(value > 65535.0f ? 65535.0f : value);
+            }
+        } });
+    kernels.push_back({ "HDR fusion 32bit", 2, 4, true,
+        [&](const uint8_t* src, uint8_t* dst, unsigned width, unsigned height, WorkerPool* pool) {
+            hdrAccumulateBracket(src, dst, width, height, pool);
+            pool->ParallelFor(height, [&](unsigned begin, unsigned end) {
+                size_t offset = (size_t)begin * width;
+                hdrFuse32(num.data() + offset, den.data() + offset, (float*)dst + offset, (size_t)(end - begin) * width);
+            });
+        },
+        [&](const uint8_t* src, uint8_t* dst, unsigned width, unsigned height) {
+            size_t nPixels = (size_t)width * height;
+            for (size_t i = 0; i < nPixels; i++)
+            {
+                float n, d;
+                hdrReferenceSums(src, nPixels, i, n, d);
+                ((float*)dst)[i] = d > 0.0f ? n / d : 0.0f;
+            }
+        } });
+    // Demosaicing of a BayerRG8 frame into BGRA8
+    kernels.push_back({ "Demosaic nearest", 1, 4, true, &demosaicBayerRG8<DEMOSAIC_NEAREST>, &demosaicBayerRG8Reference<DEMOSAIC_NEAREST> });
+    kernels.push_back({ "Demosaic bilinear", 1, 4, true, &demosaicBayerRG8<DEMOSAIC_BILINEAR>, &demosaicBayerRG8Reference<DEMOSAIC_BILINEAR> });
+    kernels.push_back({ "Demosaic Malvar-He-Cutler", 1, 4, true, &demosaicBayerRG8<DEMOSAIC_MALVAR>, &demosaicBayerRG8Reference<DEMOSAIC_MALVAR> });
+    kernels.push_back({ "Demosaic edge-aware", 1, 4, true, &demosaicBayerRG8<DEMOSAIC_EDGE_AWARE>, &demosaicBayerRG8Reference<DEMOSAIC_EDGE_AWARE> });
+    // One preview pyramid level, writes only the first quarter of dst
+    kernels.push_back({ "Box downsample 2x", 1, 1, true,
+        [](const uint8_t* src, uint8_t* dst, unsigned width, unsigned height, WorkerPool* pool) {
+            boxDownsample2<uint8_t, 1>(src, dst, width, height, pool);
+        },
+        &boxDownsample2Reference<uint8_t, 1> });
+    kernels.push_back({ "Box downsample 2x BGRA", 4, 4, true,
+        [](const uint8_t* src, uint8_t* dst, unsigned width, unsigned height, WorkerPool* pool) {
+            boxDownsample2<uint8_t, 4>(src, dst, width, height, pool);
+        },
+        &boxDownsample2Reference<uint8_t, 4> });
+    kernels.push_back({ "Box downsample 2x 16bit", 2, 2, true,
+        [](const uint8_t* src, uint8_t* dst, unsigned width, unsigned height, WorkerPool* pool) {
+            boxDownsample2<uint16_t, 1>((const uint16_t*)src, (uint16_t*)dst, width, height, pool);
+        },
+        &boxDownsample2Reference<uint16_t, 1> });
+    // The per exposure lookup of HDR fusion alone, into the num and den planes
+    kernels.push_back({ "HDR LUT lookup", 1, 8, true,
+        [&](const uint8_t* src, uint8_t* dst, unsigned width, unsigned height, WorkerPool* pool) {
+            size_t nPixels = (size_t)width * height;
+            float* lutNum = (float*)dst;
+            float* lutDen = lutNum + nPixels;
+            pool->ParallelFor(height, [&](unsigned begin, unsigned end) {
+                size_t offset = (size_t)begin * width;
+                size_t count = (size_t)(end - begin) * width;
+                std::fill(lutNum + offset, lutNum + offset + count, 0.0f);
+                std::fill(lutDen + offset, lutDen + offset + count, 0.0f);
+                hdrAccumulate(src + offset, lutNum + offset, lutDen + offset, lutW, lutWR, count);
+            });
+        },
+        [&](const uint8_t* src, uint8_t* dst, unsigned width, unsigned height) {
+            size_t nPixels = (size_t)width * height;
+            for (size_t i = 0; i < nPixels; i++)
+            {
+                ((float*)dst)[i] = lutWR[src[i]];
+                ((float*)dst)[nPixels + i] = lutW[src[i]];
+            }
+        } });
+    // Frame statistics of ROI tracking, the bounding box goes to the first 16 bytes
+    kernels.push_back({ "ROI tracking scan", 1, 0, false,
+        [](const uint8_t* src, uint8_t* dst, unsigned width, unsigned height, WorkerPool*) {
+            unsigned* box = (unsigned*)dst;
+            findActiveRegion<uint8_t, 1>(src, width, height, (uint8_t)240, box[0], box[1], box[2], box[3]);
+        },
+        [](const uint8_t* src, uint8_t* dst, unsigned width, unsigned height) {
+            unsigned box[4] = { width, height, 0, 0 };
+            for (unsigned y = 0; y < height; y += ROI_TRACK_SAMPLE_STEP)
+            {
+                for (unsigned x = 0; x < width; x += ROI_TRACK_SAMPLE_STEP)
+                {
+                    if (src[(size_t)y * width + x] <= 240) { continue; }
+                    box[0] = std::min(box[0], x);
+                    box[1] = std::min(box[1], y);
+                    box[2] = std::max(box[2], x);
+                    box[3] = std::max(box[3], y);
+                }
+            }
+            memcpy(dst, box, sizeof(box));
+        } });
+    // Two cameras of half the width placed side by side, with the copy of composeFrame
+    kernels.push_back({ "Composite side by side", 1, 1, false,
+        [](const uint8_t* src, uint8_t* dst, unsigned width, unsigned height, WorkerPool*) {
+            unsigned half = width / 2;
+            for (unsigned c = 0; c < 2; c++)
+            {
+                copySideBySide(dst, width, 1, src + (size_t)c * half * height, half, height, c * half);
+            }
+        },
+        [](const uint8_t* src, uint8_t* dst, unsigned width, unsigned height) {
+            unsigned half = width / 2;
+            for (unsigned y = 0; y < height; y++)
+            {
+                for (unsigned x = 0; x < width; x++)
+                {
+                    unsigned c = x < half ? 0 : 1;
+                    dst[(size_t)y * width + x] = src[(size_t)c * half * height + (size_t)y * half + (x - c * half)];
+                }
+            }
+        } });
+
+    // 1.3, 5 and 12 MP sensors
+    const unsigned sizes[][2] = { { 1280, 1024 }, { 2448, 2048 }, { 4000, 3000 } };
+    vector<unsigned> threadCounts;
+    unsigned nCores = std::thread::hardware_concurrency();
+    if (nCores == 0) { nCores = 1; }
+    for (unsigned n = 1; n < nCores; n *= 2) { threadCounts.push_back(n); }
+    threadCounts.push_back(nCores);
+
+    size_t nSizes = sizeof(sizes) / sizeof(sizes[0]);
+    unsigned total = 0;
+    for (size_t k = 0; k < kernels.size(); k++) { total += kernels[k].parallel ? (unsigned)threadCounts.size() : 1; }
+    benchmarkTotal_ = total * (unsigned)nSizes;
+    benchmarkDone_ = 0;
+
+    vector<KernelBenchmarkResult> results;
+    WorkerPool pool;
+    for (size_t s = 0; s < nSizes && !benchmarkStop_; s++)
+    {
+        unsigned width = sizes[s][0];
+        unsigned height = sizes[s][1];
+        size_t nPixels = (size_t)width * height;
+        for (size_t k = 0; k < kernels.size() && !benchmarkStop_; k++)
+        {
+            const BenchKernel& kernel = kernels[k];
+            // Deterministic noise over a gradient, covering all 8bit values
+            vector<uint8_t> src(nPixels * kernel.srcBytesPerPixel);
+            uint32_t noise = 2463534242u;
+            for (size_t i = 0; i < src.size(); i++)
+            {
+                noise ^= noise << 13;
+                noise ^= noise >> 17;
+                noise ^= noise << 5;
+                src[i] = (uint8_t)((i % width) * 256 / width + (noise & 0x3F));
+            }
+            // Kernels without an image output (dstBytesPerPixel 0) write a few values
+            vector<uint8_t> reference(std::max<size_t>(nPixels * kernel.dstBytesPerPixel, 64));
+            vector<uint8_t> dst(reference.size());
+            kernel.reference(src.data(), reference.data(), width, height);
+
+            for (size_t t = 0; t < threadCounts.size(); t++)
+            {
+                if ((!kernel.parallel && t > 0) || benchmarkStop_) { break; }
+                pool.Resize(threadCounts[t], -1, THREAD_PRIORITY_LEVEL_NORMAL);
+                std::fill(dst.begin(), dst.end(), (uint8_t)0);
+                kernel.run(src.data(), dst.data(), width, height, &pool); // warm up
+                bool conformant = memcmp(dst.data(), reference.data(), dst.size()) == 0;
+
+                // Best of at least 3 runs and 0.2 s
+                double best = 1e9;
+                double total = 0;
+                int runs = 0;
+                int64_t allocationsStart = allocationCount();
+                for (; runs < 3 || total < 0.2; runs++)
+                {
+                    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+                    kernel.run(src.data(), dst.data(), width, height, &pool);
+                    double seconds = secondsSince(start);
+                    best = seconds < best ? seconds : best;
+                    total += seconds;
+                }
+
+                KernelBenchmarkResult result;
+                result.kernel = kernel.name;
+                result.width = width;
+                result.height = height;
+                result.threads = pool.GetSize();
+                result.gbPerS = (double)(src.size() + dst.size()) / best / 1e9;
+                result.nsPerPixel = best * 1e9 / nPixels;
+                result.conformant = conformant;
+                result.allocsPerFrame = allocationsStart < 0 ? -1 : (double)(allocationCount() - allocationsStart) / runs;
+                results.push_back(result);
+                benchmarkDone_++;
+
+                ostringstream line;
+                line << "Kernel benchmark: " << result.kernel << " " << width << "x" << height
+                    << ", " << result.threads << " threads: " << result.gbPerS << " GB/s, "
+                    << result.nsPerPixel << " ns/pixel";
+                if (result.allocsPerFrame >= 0) { line << ", " << result.allocsPerFrame << " allocations/frame"; }
+                if (!conformant) { line << ", OUTPUT DIFFERS FROM REFERENCE"; }
+                LogMessage(line.str());
+            }
+        }
+    }
+    if (benchmarkStop_) { return DEVICE_ERR; }
+    std::lock_guard<std::mutex> lock(benchmarkMutex_);
+    benchmarkResults_.swap(results);
+    return DEVICE_OK;
+}
+
+/**
+* Benchmark thread: runs the kernel benchmark, then writes the results and
+* compares them against the baseline.
+*/
+void CIDSPeak::kernelBenchmarkThread()
+{
+    if (runKernelBenchmark() == DEVICE_OK)
+    {
+        if (writeBenchmarkResults() != DEVICE_OK)
+        {
+            logAsync(LogRing::LEVEL_WARNING, "Could not write the benchmark results file");
+        }
+        compareBenchmarkBaseline();
+    }
+    benchmarkRunning_ = false;
+}
+
+/**
+* Starts the kernel benchmark in the background, so the GUI and the core stay
+* responsive during the tens of seconds it takes.
+*/
+int CIDSPeak::startKernelBenchmark()
+{
+    if (IsCapturing()) { return DEVICE_CAMERA_BUSY_ACQUIRING; }
+    if (benchmarkRunning_) { return DEVICE_OK; }
+    if (benchmarkThread_.joinable()) { benchmarkThread_.join(); }
+    benchmarkStop_ = false;
+    benchmarkRunning_ = true;
+    benchmarkThread_ = std::thread(&CIDSPeak::kernelBenchmarkThread, this);
+    return DEVICE_OK;
+}
+
+void CIDSPeak::stopKernelBenchmark()
+{
+    if (!benchmarkThread_.joinable()) { return; }
+    benchmarkStop_ = true;
+    benchmarkThread_.join();
+}
+
+/**
+* Snapshot of the counters at the start of a sequence, the sequence benchmark
+* is the difference at its end.
+*/
+void CIDSPeak::beginSequenceBenchmark()
+{
+    sequenceBenchStart_ = std::chrono::steady_clock::now();
+    sequenceBenchCpuStart_ = getProcessCpuSeconds();
+    sequenceBenchFramesStart_ = metrics_.Count(AcqMetrics::FRAMES_INSERTED);
+    for (int s = 0; s < AcqMetrics::STAGE_COUNT; s++)
+    {
+        // Reserved up front, growing them would show up as allocations per frame
+        sequenceBenchLatencies_[s].clear();
+        sequenceBenchLatencies_[s].reserve(SEQUENCE_BENCH_MAX_SAMPLES);
+        sequenceBenchSamples_[s] = 0;
+    }
+    sequenceBenchAllocationsStart_ = allocationCount();
+}
+
+/**
+* Records the latency of a stage in the metrics histogram, and exactly for
+* the sequence benchmark (the last SEQUENCE_BENCH_MAX_SAMPLES per stage).
+* Acquisition thread only.
+*/
+void CIDSPeak::observeLatency(AcqMetrics::Stage stage, double seconds)
+{
+    metrics_.ObserveLatency(stage, seconds);
+    vector<float>& latencies = sequenceBenchLatencies_[stage];
+    if (latencies.size() < SEQUENCE_BENCH_MAX_SAMPLES) { latencies.push_back((float)seconds); }
+    else { latencies[sequenceBenchSamples_[stage] % SEQUENCE_BENCH_MAX_SAMPLES] = (float)seconds; }
+    sequenceBenchSamples_[stage]++;
+}
+
+/**
+* Exact percentile (nearest rank) of the recorded latencies of a stage, in ms.
+*/
+double CIDSPeak::latencyPercentileMs(AcqMetrics::Stage stage, double fraction) const
+{
+    vector<float> latencies(sequenceBenchLatencies_[stage]);
+    if (latencies.empty()) { return 0; }
+    size_t rank = (size_t)ceil(fraction * latencies.size());
+    size_t index = rank > 0 ? rank - 1 : 0;
+    std::nth_element(latencies.begin(), latencies.begin() + index, latencies.end());
+    return latencies[index] * 1000.0;
+}
+
+void CIDSPeak::endSequenceBenchmark()
+{
+    double seconds = secondsSince(sequenceBenchStart_);
+    uint64_t frames = metrics_.Count(AcqMetrics::FRAMES_INSERTED) - sequenceBenchFramesStart_;
+    if (frames == 0 || seconds <= 0) { return; }
+    SequenceBenchmarkResult result;
+    result.frames = frames;
+    result.fps = frames / seconds;
+    result.p99WaitMs = latencyPercentileMs(AcqMetrics::STAGE_WAIT, 0.99);
+    result.p99TransferMs = latencyPercentileMs(AcqMetrics::STAGE_TRANSFER, 0.99);
+    result.p99InsertMs = latencyPercentileMs(AcqMetrics::STAGE_INSERT, 0.99);
+    result.cpuMsPerFrame = (getProcessCpuSeconds() - sequenceBenchCpuStart_) * 1000 / frames;
+    result.allocsPerFrame = sequenceBenchAllocationsStart_ < 0 ? -1 : (double)(allocationCount() - sequenceBenchAllocationsStart_) / frames;
+    {
+        std::lock_guard<std::mutex> lock(benchmarkMutex_);
+        sequenceBenchmark_ = result;
+        sequenceBenchmarkValid_ = true;
+    }
+
+    if (writeBenchmarkResults() != DEVICE_OK)
+    {
+        logAsync(LogRing::LEVEL_WARNING, "Could not write the benchmark results file");
+    }
+    compareBenchmarkBaseline();
+}
+
+/**
+* Writes the last kernel benchmark and sequence results. The schema is stable:
+* fields are only ever added, and every result object is on a line of its own.
+*/
+int CIDSPeak::writeBenchmarkResults()
+{
+    // Copies, the property thread may change the settings meanwhile
+    std::unique_lock<std::mutex> lock(benchmarkMutex_);
+    string fileName = benchmarkFile_;
+    double tolerancePct = benchmarkTolerancePct_;
+    vector<KernelBenchmarkResult> results = benchmarkResults_;
+    bool sequenceValid = sequenceBenchmarkValid_;
+    SequenceBenchmarkResult sequenceResult = sequenceBenchmark_;
+    lock.unlock();
+    if (fileName.empty()) { return DEVICE_OK; }
+
+    ostringstream out;
+    out << "{\n";
+    out << "  \"schema\": \"ids-peak-benchmark/1\",\n";
+    out << "  \"camera\": \"" << modelName_ << " " << serialNum_ << "\",\n";
+    out << "  \"cores\": " << std::thread::hardware_concurrency() << ",\n";
+    // Percentages, edit them per metric in a stored baseline
+    out << "  \"tolerances\": {\"gb_per_s\": " << tolerancePct << ", \"ns_per_pixel\": " << tolerancePct
+        << ", \"fps\": " << tolerancePct << ", \"p99_ms\": " << tolerancePct
+        << ", \"cpu_ms_per_frame\": " << tolerancePct << ", \"exposure_change_us\": " << tolerancePct
+        << ", \"allocs_per_frame\": " << tolerancePct << "},\n";
+    if (exposureChangeLatencyUs_ > 0)
+    {
+        // Time SetExposure took the last time the exposure was changed
+        out << "  \"exposure\": {\"change_us\": " << exposureChangeLatencyUs_.load() << "},\n";
+    }
+    if (sequenceValid)
+    {
+        out << "  \"sequence\": {\"frames\": " << sequenceResult.frames << ", \"fps\": " << sequenceResult.fps
+            << ", \"p99_wait_ms\": " << sequenceResult.p99WaitMs << ", \"p99_transfer_ms\": " << sequenceResult.p99TransferMs
+            << ", \"p99_insert_ms\": " << sequenceResult.p99InsertMs << ", \"cpu_ms_per_frame\": " << sequenceResult.cpuMsPerFrame;
+        if (sequenceResult.allocsPerFrame >= 0) { out << ", \"allocs_per_frame\": " << sequenceResult.allocsPerFrame; }
+        out << "},\n";
+    }
+    out << "  \"kernels\": [";
+    for (size_t i = 0; i < results.size(); i++)
+    {
+        const KernelBenchmarkResult& result = results[i];
+        out << (i > 0 ? "," : "") << "\n    {\"kernel\": \"" << result.kernel << "\", \"width\": " << result.width
+            << ", \"height\": " << result.height << ", \"threads\": " << result.threads
+            << ", \"gb_per_s\": " << result.gbPerS << ", \"ns_per_pixel\": " << result.nsPerPixel;
+        if (result.allocsPerFrame >= 0) { out << ", \"allocs_per_frame\": " << result.allocsPerFrame; }
+        out << ", \"conformant\": " << (result.conformant ? "true" : "false") << "}";
+    }
+    out << "\n  ]\n}\n";
+
+    std::ofstream file(fileName.c_str(), std::ios::out | std::ios::trunc);
+    if (!file) { return ERR_BENCHMARK_FILE; }
+    file << out.str();
+    return file ? DEVICE_OK : ERR_BENCHMARK_FILE;
+}
+
+/**
+* Compares the current results against the baseline file, with the tolerances
+* stored in the baseline (the tolerance property for missing ones). Higher is
+* better for GB/s and fps, lower for the rest. Results without a counterpart
+* in the baseline are skipped.
+*/
+int CIDSPeak::compareBenchmarkBaseline()
+{
+    // Copies, the property thread may change the settings meanwhile
+    std::unique_lock<std::mutex> lock(benchmarkMutex_);
+    string fileName = baselineFile_;
+    double defaultTolerancePct = benchmarkTolerancePct_;
+    vector<KernelBenchmarkResult> results = benchmarkResults_;
+    bool sequenceValid = sequenceBenchmarkValid_;
+    SequenceBenchmarkResult sequenceResult = sequenceBenchmark_;
+    lock.unlock();
+    if (fileName.empty()) { return DEVICE_OK; }
+
+    std::ifstream file(fileName.c_str());
+    if (!file)
+    {
+        lock.lock();
+        benchmarkComparison_ = "Baseline not readable";
+        benchmarkRegressions_ = -1;
+        return ERR_BENCHMARK_FILE;
+    }
+    string tolerances;
+    string sequence;
+    string exposure;
+    vector<string> kernels;
+    string line;
+    while (std::getline(file, line))
+    {
+        if (line.find("\"tolerances\"") != string::npos) { tolerances = line; }
+        else if (line.find("\"sequence\"") != string::npos) { sequence = line; }
+        else if (line.find("\"exposure\"") != string::npos) { exposure = line; }
+        else if (line.find("\"kernel\"") != string::npos) { kernels.push_back(line); }
+    }
+
+    size_t compared = 0;
+    vector<string> regressions;
+    // higherIsBetter metrics may drop by the tolerance, the others rise by it
+    auto check = [&](const string& what, const char* metric, const char* toleranceKey,
+        double current, const string& baselineObject, bool higherIsBetter) {
+        double baseline;
+        if (!jsonNumber(baselineObject, metric, baseline)) { return; }
+        double tolerancePct = defaultTolerancePct;
+        jsonNumber(tolerances, toleranceKey, tolerancePct);
+        compared++;
+        bool worse = higherIsBetter ? current < baseline * (1 - tolerancePct / 100)
+            : current > baseline * (1 + tolerancePct / 100);
+        if (worse)
+        {
+            ostringstream regression;
+            regression << what << " " << metric << ": " << current << " vs baseline " << baseline << " (tolerance " << tolerancePct << "%)";
+            regressions.push_back(regression.str());
+        }
+    };
+
+    for (size_t i = 0; i < results.size(); i++)
+    {
+        const KernelBenchmarkResult& result = results[i];
+        ostringstream what;
+        what << result.kernel << " " << result.width << "x" << result.height << " " << result.threads << " threads";
+        if (!result.conformant) { regressions.push_back(what.str() + " output differs from the reference"); }
+        for (size_t b = 0; b < kernels.size(); b++)
+        {
+            string name;
+            double width = 0, height = 0, threads = 0;
+            if (!jsonString(kernels[b], "kernel", name) || name != result.kernel) { continue; }
+            jsonNumber(kernels[b], "width", width);
+            jsonNumber(kernels[b], "height", height);
+            jsonNumber(kernels[b], "threads", threads);
+            if ((unsigned)width != result.width || (unsigned)height != result.height || (unsigned)threads != result.threads) { continue; }
+            check(what.str(), "gb_per_s", "gb_per_s", result.gbPerS, kernels[b], true);
+            check(what.str(), "ns_per_pixel", "ns_per_pixel", result.nsPerPixel, kernels[b], false);
+            if (result.allocsPerFrame >= 0) { check(what.str(), "allocs_per_frame", "allocs_per_frame", result.allocsPerFrame, kernels[b], false); }
+        }
+    }
+    if (sequenceValid && !sequence.empty())
+    {
+        check("Sequence", "fps", "fps", sequenceResult.fps, sequence, true);
+        check("Sequence", "p99_wait_ms", "p99_ms", sequenceResult.p99WaitMs, sequence, false);
+        check("Sequence", "p99_transfer_ms", "p99_ms", sequenceResult.p99TransferMs, sequence, false);
+        check("Sequence", "p99_insert_ms", "p99_ms", sequenceResult.p99InsertMs, sequence, false);
+        check("Sequence", "cpu_ms_per_frame", "cpu_ms_per_frame", sequenceResult.cpuMsPerFrame, sequence, false);
+        if (sequenceResult.allocsPerFrame >= 0)
+        {
+            check("Sequence", "allocs_per_frame", "allocs_per_frame", sequenceResult.allocsPerFrame, sequence, false);
+        }
+    }
+    if (exposureChangeLatencyUs_ > 0 && !exposure.empty())
+    {
+        check("Exposure", "change_us", "exposure_change_us", exposureChangeLatencyUs_.load(), exposure, false);
+    }
+
+    ostringstream summary;
+    if (regressions.empty()) { summary << "Pass (" << compared << " metrics compared)"; }
+    else { summary << "FAIL: " << regressions.size() << " regressions in " << compared << " metrics (see log)"; }
+    lock.lock();
+    benchmarkComparison_ = summary.str();
+    benchmarkRegressions_ = (long)regressions.size();
+    lock.unlock();
+    for (size_t i = 0; i < regressions.size(); i++)
+    {
+        logAsync(LogRing::LEVEL_WARNING, ("Benchmark regression: " + regressions[i]).c_str());
+    }
+    return regressions.empty() ? DEVICE_OK : ERR_BENCHMARK_REGRESSION;
+}
+
+/**
+* Prepares the camera for the setting cycle of the current configuration.
+* If allowed and available the cycle is programmed into the camera sequencer
+* and the camera runs free. Otherwise frames are software triggered and the
+* settings are written between frames. The acquisition must be stopped.
+*/
+int CIDSPeak::beginCycle(bool allowSequencer)
+{
+    cycleNext_ = 0;
+    cycleFrameIdValid_ = false;
+    cycleOnSequencer_ = false;
+    publishConfig();
+    std::shared_ptr<const AcqConfig> config = getConfig();
+    if (config->cycle.empty()) { return DEVICE_OK; }
+
+    // Lines switched by the cycle are driven by the camera
+    for (size_t i = 0; i < config->cycleLines.size(); i++)
+    {
+        status = setGFAEnum(hCam, "LineSelector", config->cycleLines[i].c_str());
+        if (status == PEAK_STATUS_SUCCESS) { status = setGFAEnum(hCam, "LineMode", "Output"); }
+        if (status != PEAK_STATUS_SUCCESS) { return ERR_NO_WRITE_ACCESS; }
+    }
+
+    if (allowSequencer && programSequencer(*config) == DEVICE_OK)
+    {
+        cycleOnSequencer_ = true;
+        publishConfig();
+        if (applyTriggerConfig(TRIGGER_CONFIG_FREERUN) != DEVICE_OK)
+            LogMessage("Could not switch the trigger off, assuming the camera runs free");
+        return DEVICE_OK;
+    }
+    return applyTriggerConfig(TRIGGER_CONFIG_SOFTWARE);
+}
+
+/**
+* Stops the sequencer (if used) and restores the settings from before the cycle.
+* The acquisition must be stopped.
+*/
+void CIDSPeak::endCycle(const AcqConfig& config)
+{
+    if (config.cycle.empty()) { return; }
+    if (config.cycleOnSequencer)
+    {
+        setGFAEnum(hCam, "SequencerMode", "Off");
+    }
+    FrameSetting original = { config.exposureMs, config.gainMaster, "" };
+    if (config.roiCycling)
+    {
+        original.roiX = config.roiX;
+        original.roiY = config.roiY;
+    }
+    applyFrameSetting(config, original);
+    if (config.propertySequence)
+    {
+        // Exposure and gain sequences only last for one sequence acquisition
+        {
+            MMThreadGuard g(configWriteLock_);
+            sequenceCycle_.clear();
+        }
+        publishConfig();
+    }
+}
+
+/**
+* Programs one sequencer set per frame setting, each set advancing to the next
+* at the end of its exposure, the last one looping back to the first.
+*/
+int CIDSPeak::programSequencer(const AcqConfig& config)
+{
+    if (!isGFAWritable(hCam, "SequencerConfigurationMode")) { return ERR_NO_WRITE_ACCESS; }
+    setGFAEnum(hCam, "SequencerMode", "Off");
+    if (setGFAEnum(hCam, "SequencerConfigurationMode", "On") != PEAK_STATUS_SUCCESS) { return ERR_NO_WRITE_ACCESS; }
+
+    bool success = true;
+    size_t nSets = config.cycle.size();
+    for (size_t i = 0; i < nSets && success; i++)
+    {
+        const FrameSetting& setting = config.cycle[i];
+        success = setGFAInt(hCam, "SequencerSetSelector", (int64_t)i) == PEAK_STATUS_SUCCESS;
+        if (success && setting.exposureMs > 0)
+        {
+            success = setGFAfloat(hCam, "ExposureTime", setting.exposureMs * 1000) == PEAK_STATUS_SUCCESS;
+        }
+        if (success && setting.gain >= 0)
+        {
+            success = setGFAEnum(hCam, "GainSelector", "DigitalAll") == PEAK_STATUS_SUCCESS
+                && setGFAfloat(hCam, "Gain", setting.gain) == PEAK_STATUS_SUCCESS;
+        }
+        if (success && setting.roiX >= 0)
+        {
+            success = setGFAInt(hCam, "OffsetX", setting.roiX) == PEAK_STATUS_SUCCESS
+                && setGFAInt(hCam, "OffsetY", setting.roiY) == PEAK_STATUS_SUCCESS;
+        }
+        for (size_t l = 0; l < config.cycleLines.size() && success; l++)
+        {
+            const string& line = config.cycleLines[l];
+            success = setGFAEnum(hCam, "LineSelector", line.c_str()) == PEAK_STATUS_SUCCESS
+                && setGFAEnum(hCam, "LineSource", line == setting.outputLine ? "ExposureActive" : "Off") == PEAK_STATUS_SUCCESS;
+        }
+        success = success
+            && setGFAInt(hCam, "SequencerPathSelector", 0) == PEAK_STATUS_SUCCESS
+            && setGFAInt(hCam, "SequencerSetNext", (int64_t)((i + 1) % nSets)) == PEAK_STATUS_SUCCESS
+            && setGFAEnum(hCam, "SequencerTriggerSource", "ExposureEnd") == PEAK_STATUS_SUCCESS
+            && executeGFACommand(hCam, "SequencerSetSave") == PEAK_STATUS_SUCCESS;
+    }
+    success = success && setGFAInt(hCam, "SequencerSetStart", 0) == PEAK_STATUS_SUCCESS;
+    setGFAEnum(hCam, "SequencerConfigurationMode", "Off");
+    success = success && setGFAEnum(hCam, "SequencerMode", "On") == PEAK_STATUS_SUCCESS;
+    if (!success)
+    {
+        setGFAEnum(hCam, "SequencerMode", "Off");
+        LogMessage("Camera sequencer not usable for this cycle, falling back to software triggers");
+        return ERR_NO_WRITE_ACCESS;
+    }
+    return DEVICE_OK;
+}
+
+/**
+* Writes the settings of one frame of the cycle (between frames).
+*/
+peak_status CIDSPeak::applyFrameSetting(const AcqConfig& config, const FrameSetting& setting)
+{
+    peak_status acqStatus = PEAK_STATUS_SUCCESS;
+    if (setting.exposureMs > 0)
+    {
+        acqStatus = peak_ExposureTime_Set(hCam, setting.exposureMs * 1000);
+    }
+    if (acqStatus == PEAK_STATUS_SUCCESS && setting.gain >= 0)
+    {
+        acqStatus = peak_Gain_Set(hCam, PEAK_GAIN_TYPE_DIGITAL, PEAK_GAIN_CHANNEL_MASTER, setting.gain);
+    }
+    if (acqStatus == PEAK_STATUS_SUCCESS && setting.roiX >= 0)
+    {
+        peak_position offset;
+        offset.x = (uint32_t)setting.roiX;
+        offset.y = (uint32_t)setting.roiY;
+        acqStatus = peak_ROI_Offset_Set(hCam, offset);
+    }
+    for (size_t l = 0; l < config.cycleLines.size() && acqStatus == PEAK_STATUS_SUCCESS; l++)
+    {
+        const string& line = config.cycleLines[l];
+        acqStatus = setGFAEnum(hCam, "LineSelector", line.c_str());
+        if (acqStatus == PEAK_STATUS_SUCCESS)
+        {
+            acqStatus = setGFAEnum(hCam, "LineSource", line == setting.outputLine ? "ExposureActive" : "Off");
+        }
+    }
+    return acqStatus;
+}
+
+/**
+* Acquires the next frame of the setting cycle into img. cycleIndex returns the
+* index of the setting the frame was taken with. On the sequencer this follows
+* from the frame ID, so a dropped frame doesn't mix up the settings.
+*/
+int CIDSPeak::acquireCycleFrame(const AcqConfig& config, ImgBuffer& img, size_t& cycleIndex)
+{
+    size_t nSettings = config.cycle.size();
+    peak_status acqStatus = PEAK_STATUS_SUCCESS;
+    uint32_t timeoutMs;
+    if (!config.cycleOnSequencer)
+    {
+        cycleIndex = cycleNext_;
+        cycleNext_ = (cycleNext_ + 1) % nSettings;
+        const FrameSetting& setting = config.cycle[cycleIndex];
+        acqStatus = applyFrameSetting(config, setting);
+        if (acqStatus != PEAK_STATUS_SUCCESS) { return ERR_NO_WRITE_ACCESS; }
+        acqStatus = executeGFACommand(hCam, "TriggerSoftware");
+        if (acqStatus != PEAK_STATUS_SUCCESS) { return ERR_ACQ_START; }
+        double exposureMs = setting.exposureMs > 0 ? setting.exposureMs : config.exposureMs;
+        timeoutMs = (uint32_t)(3 * exposureMs + 1000);
+    }
+    else
+    {
+        timeoutMs = (uint32_t)(3000 / config.framerate + 3 * config.cycleMaxExposureMs + 10);
+    }
+
+    peak_frame_handle hFrame;
+    std::chrono::steady_clock::time_point waitStart = std::chrono::steady_clock::now();
+    acqStatus = peak_Acquisition_WaitForFrame(hCam, timeoutMs, &hFrame);
+    if (acqStatus == PEAK_STATUS_TIMEOUT) { return ERR_ACQ_TIMEOUT; }
+    if (acqStatus != PEAK_STATUS_SUCCESS) { return ERR_ACQ_FRAME; }
+    observeLatency(AcqMetrics::STAGE_WAIT, secondsSince(waitStart));
+    metrics_.Increment(AcqMetrics::FRAMES_ACQUIRED);
+    if (config.cycleOnSequencer)
+    {
+        uint64_t frameId = 0;
+        peak_Frame_ID_Get(hFrame, &frameId);
+        if (!cycleFrameIdValid_)
+        {
+            cycleFirstFrameId_ = frameId;
+            cycleFrameIdValid_ = true;
+        }
+        cycleIndex = (size_t)((frameId - cycleFirstFrameId_) % nSettings);
+    }
+    if (peak_Frame_Timestamp_Get(hFrame, &frameTimestamp_) != PEAK_STATUS_SUCCESS) { frameTimestamp_ = 0; }
+    std::chrono::steady_clock::time_point transferStart = std::chrono::steady_clock::now();
+    int nRet = config.transfer(hCam, hFrame, img, pool_);
+    peak_Frame_Release(hCam, hFrame);
+    double transferS = secondsSince(transferStart);
+    observeLatency(AcqMetrics::STAGE_TRANSFER, transferS);
+    if (nRet == DEVICE_OK) { recordDemosaicCost(config.demosaic, transferS, img); }
+    return nRet;
+}
+
+/**
+* Computes the snap settings that depend on the exposure time. Called once per
+* exposure change instead of once per snap.
+*/
+void CIDSPeak::updateSnapConfig()
+{
+    snapFramerate_ = 1000 / exposureCur_;
+    // Three exposure times, plus some slack for the readout and the transfer
+    snapTimeoutMs_ = (uint32_t)(3 * exposureCur_ + 10.5);
+}
+
+/**
+* Configures the hardware chain: the master (hCam) drives syncMasterLine_ with
+* its exposure active signal, which is wired to syncSlaveLine_ of every slave.
+* The slaves expose on the rising edge, so they start within microseconds of
+* the master.
+*/
+int CIDSPeak::setupSync()
+{
+    syncSlaves_.clear();
+    syncSlaveIds_.clear();
+    vector<int> ids;
+    if (syncSlaveCameras_.empty())
+    {
+        for (size_t i = 0; i < hCams.size(); i++) { ids.push_back((int)i); }
+    }
+    else
+    {
+        stringstream list(syncSlaveCameras_);
+        string id;
+        while (getline(list, id, ',')) { ids.push_back(atoi(id.c_str())); }
+    }
+    for (size_t i = 0; i < ids.size(); i++)
+    {
+        if (ids[i] == CamID_ || ids[i] < 0 || ids[i] >= (int)hCams.size()) { continue; }
+        if (hCams[ids[i]] == PEAK_INVALID_HANDLE) { continue; }
+        if (find(syncSlaves_.begin(), syncSlaves_.end(), hCams[ids[i]]) != syncSlaves_.end()) { continue; }
+        syncSlaves_.push_back(hCams[ids[i]]);
+        syncSlaveIds_.push_back(ids[i]);
+    }
+    if (syncSlaves_.empty()) { return ERR_SYNC_NO_SLAVES; }
+
+    status = setGFAEnum(hCam, "LineSelector", syncMasterLine_.c_str());
+    if (status == PEAK_STATUS_SUCCESS) { status = setGFAEnum(hCam, "LineMode", "Output"); }
+    if (status == PEAK_STATUS_SUCCESS) { status = setGFAEnum(hCam, "LineSource", "ExposureActive"); }
+    for (size_t i = 0; i < syncSlaves_.size() && status == PEAK_STATUS_SUCCESS; i++)
+    {
+        peak_camera_handle hSlave = syncSlaves_[i];
+        status = setGFAEnum(hSlave, "TriggerSelector", "ExposureStart");
+        if (status == PEAK_STATUS_SUCCESS) { status = setGFAEnum(hSlave, "TriggerSource", syncSlaveLine_.c_str()); }
+        if (status == PEAK_STATUS_SUCCESS) { status = setGFAEnum(hSlave, "TriggerActivation", "RisingEdge"); }
+        if (status == PEAK_STATUS_SUCCESS) { status = setGFAEnum(hSlave, "TriggerMode", "On"); }
+    }
+    if (status != PEAK_STATUS_SUCCESS)
+    {
+        teardownSync();
+        return ERR_NO_WRITE_ACCESS;
+    }
+    publishConfig();
+    return DEVICE_OK;
+}
+
+/**
+* Releases the slaves and the master output line.
+*/
+void CIDSPeak::teardownSync()
+{
+    if (setGFAEnum(hCam, "LineSelector", syncMasterLine_.c_str()) == PEAK_STATUS_SUCCESS)
+    {
+        setGFAEnum(hCam, "LineSource", "Off");
+    }
+    for (size_t i = 0; i < syncSlaves_.size(); i++)
+    {
+        setGFAEnum(syncSlaves_[i], "TriggerMode", "Off");
+    }
+    syncSlaves_.clear();
+    syncSlaveIds_.clear();
+    // The composite consists of the synchronized cameras
+    compositeMode_ = COMPOSITE_OFF;
+    compositeSources_.clear();
+    publishConfig();
+}
+
+/**
+* Checks the wiring of the hardware chain. The master is software triggered at
+* irregular intervals, and the intervals between the device timestamps of every
+* slave have to match those of the master within the tolerance. Comparing
+* intervals instead of timestamps makes the check independent of the offsets
+* between the camera clocks. Sync is refused if the check can't be done.
+*/
+int CIDSPeak::validateSync()
+{
+    const int nFrames = 8;
+    if (applyTriggerConfig(TRIGGER_CONFIG_SOFTWARE) != DEVICE_OK)
+    {
+        // A free running master has regular intervals, which a free running
+        // slave at the same frame rate would match without any wiring
+        syncCheck_ = "Failed, master has no software trigger";
+        return ERR_SYNC_UNCHECKED;
+    }
+    uint32_t timeoutMs = (uint32_t)(3 * exposureCur_ + 1000);
+    vector<vector<uint64_t> > timestamps(syncSlaves_.size() + 1);
+    int nRet = DEVICE_OK;
+    size_t nStarted = 0;
+    for (; nStarted < syncSlaves_.size(); nStarted++)
+    {
+        peak_status slaveStatus = peak_Acquisition_Start(syncSlaves_[nStarted], PEAK_INFINITE);
+        if (slaveStatus != PEAK_STATUS_SUCCESS)
+        {
+            ostringstream check;
+            check << "Failed, slave " << nStarted + 1 << " did not start (status " << slaveStatus << ")";
+            syncCheck_ = check.str();
+            nRet = ERR_SYNC_SLAVE_START;
+            break;
+        }
+    }
+    if (nRet == DEVICE_OK)
+    {
+        status = peak_Acquisition_Start(hCam, PEAK_INFINITE);
+        nRet = status == PEAK_STATUS_SUCCESS ? DEVICE_OK : ERR_ACQ_START;
+    }
+    for (int frame = 0; frame < nFrames && nRet == DEVICE_OK; frame++)
+    {
+        if (executeGFACommand(hCam, "TriggerSoftware") != PEAK_STATUS_SUCCESS)
+        {
+            nRet = ERR_ACQ_START;
+            break;
+        }
+        for (size_t c = 0; c <= syncSlaves_.size(); c++)
+        {
+            peak_camera_handle hDev = c == 0 ? hCam : syncSlaves_[c - 1];
+            peak_frame_handle hFrame;
+            uint64_t timestamp = 0;
+            if (peak_Acquisition_WaitForFrame(hDev, timeoutMs, &hFrame) != PEAK_STATUS_SUCCESS)
+            {
+                ostringstream check;
+                check << "Failed, no frame from " << (c == 0 ? "master" : "slave ") << (c == 0 ? "" : CDeviceUtils::ConvertToString((long)c));
+                syncCheck_ = check.str();
+                nRet = ERR_SYNC_WIRING;
+                break;
+            }
+            peak_Frame_Timestamp_Get(hFrame, &timestamp);
+            peak_Frame_Release(hDev, hFrame);
+            timestamps[c].push_back(timestamp);
+        }
+        // Irregular intervals, so a slave running free can't pass by accident
+        std::this_thread::sleep_for(std::chrono::milliseconds(2 + 3 * frame));
+    }
+    peak_Acquisition_Stop(hCam);
+    for (size_t i = 0; i < nStarted; i++)
+    {
+        peak_Acquisition_Stop(syncSlaves_[i]);
+    }
+    if (nRet != DEVICE_OK) { return nRet; }
 
-    if (PEAK_IS_READABLE(
-        peak_GFA_Feature_GetAccessStatus(hCam, PEAK_GFA_MODULE_REMOTE_DEVICE, "DeviceFirmwareVersion")))
+    // Timestamps are in ns
+    double maxErrorUs = 0;
+    for (size_t c = 1; c <= syncSlaves_.size(); c++)
     {
-        // get the length of the feature string
-        status = peak_GFA_Enumeration_GetList(hCam, PEAK_GFA_MODULE_REMOTE_DEVICE, "DeviceTemperatureSelector", NULL, &enumerationEntryCount);
-        status = getGFAfloat("DeviceTemperature", sensorTemp);
+        for (int frame = 1; frame < nFrames; frame++)
+        {
+            double masterInterval = (double)(timestamps[0][frame] - timestamps[0][frame - 1]);
+            double slaveInterval = (double)(timestamps[c][frame] - timestamps[c][frame - 1]);
+            double errorUs = fabs(slaveInterval - masterInterval) / 1000;
+            if (errorUs > maxErrorUs) { maxErrorUs = errorUs; }
+        }
     }
-    else
+    ostringstream check;
+    check << (maxErrorUs <= syncToleranceUs_ ? "OK" : "Failed") << ", max interval error " << maxErrorUs << " us";
+    syncCheck_ = check.str();
+    if (maxErrorUs > syncToleranceUs_) { return ERR_SYNC_WIRING; }
+
+    // Offsets between the clocks (plus trigger latency and delay), which
+    // anchor the first composite set in absolute time
+    syncClockOffsetNs_.assign(syncSlaves_.size(), 0);
+    for (size_t c = 1; c <= syncSlaves_.size(); c++)
     {
-        printf("No read access to device temperature");
+        double sumNs = 0;
+        for (int frame = 0; frame < nFrames; frame++)
+        {
+            sumNs += (double)((int64_t)timestamps[c][frame] - (int64_t)timestamps[0][frame]);
+        }
+        syncClockOffsetNs_[c - 1] = (int64_t)(sumNs / nFrames);
     }
-    return status;
+    syncClockOffsetTime_ = std::chrono::steady_clock::now();
+    return DEVICE_OK;
 }
 
-int CIDSPeak::cleanExit()
+/**
+* Arms the slaves of a sequence acquisition.
+*/
+void CIDSPeak::startSyncSlaves(const AcqConfig& config)
 {
-
-    // Clean up before exit
-    // Stop acquisition, if running
-    if (peak_Acquisition_IsStarted(hCam))
+    syncMasterLastTs_ = 0;
+    syncSlaveLastTs_.assign(config.syncSlaves.size(), 0);
+    resetComposite(config);
+    for (size_t i = 0; i < config.syncSlaves.size(); i++)
     {
-        // Stop acquisition
-        status = peak_Acquisition_Stop(hCam);
-        checkForSuccess(status, PEAK_TRUE);
+        if (peak_Acquisition_Start(config.syncSlaves[i], PEAK_INFINITE) != PEAK_STATUS_SUCCESS)
+        {
+            logAsync(LogRing::LEVEL_WARNING, "Could not start the acquisition of a sync slave");
+        }
     }
+}
 
-    // Close camera, if open
-    if (hCam != PEAK_INVALID_HANDLE)
+void CIDSPeak::stopSyncSlaves(const AcqConfig& config)
+{
+    releaseCompositePending(config);
+    for (size_t i = 0; i < config.syncSlaves.size(); i++)
     {
-        // Close Camera
-        status = peak_Camera_Close(hCam);
-        checkForSuccess(status, PEAK_TRUE);
+        peak_Acquisition_Stop(config.syncSlaves[i]);
     }
-
-    // Exit library
-    status = peak_Library_Exit();
-    checkForSuccess(status, PEAK_TRUE);
-
-    return status;
 }
 
-//Returns PEAK_TRUE, if function was successful.
-//Returns PEAK_FALSE, if function returned with an error. If continueExecution == PEAK_FALSE,
-//the backend is exited.
-peak_bool CIDSPeak::checkForSuccess(peak_status checkStatus, peak_bool continueExecution)
+/**
+* Takes the slave frames belonging to the master frame with masterTimestamp and
+* reports in frameTags how many arrived and how far their frame intervals
+* deviate from the interval of the master (a measure of the trigger jitter).
+*/
+void CIDSPeak::collectSyncFrames(const AcqConfig& config, uint64_t masterTimestamp, map<string, string>& frameTags)
 {
-    if (PEAK_ERROR(checkStatus))
+    uint32_t timeoutMs = (uint32_t)(3 * config.exposureMs + 100);
+    long received = 0;
+    double maxErrorUs = -1;
+    for (size_t i = 0; i < config.syncSlaves.size(); i++)
     {
-        peak_status lastErrorCode = PEAK_STATUS_SUCCESS;
-        size_t lastErrorMessageSize = 0;
-
-        // Get size of error message
-        status = peak_Library_GetLastError(&lastErrorCode, NULL, &lastErrorMessageSize);
-        if (PEAK_ERROR(status))
+        peak_frame_handle hFrame;
+        if (peak_Acquisition_WaitForFrame(config.syncSlaves[i], timeoutMs, &hFrame) != PEAK_STATUS_SUCCESS)
         {
-            // Something went wrong getting the last error!
-            printf("Last-Error: Getting last error code failed! Status: %#06x\n", status);
-            return PEAK_FALSE;
+            // Missed trigger, the next interval is meaningless
+            syncSlaveLastTs_[i] = 0;
+            continue;
         }
-
-        if (checkStatus != lastErrorCode)
+        uint64_t timestamp = 0;
+        peak_Frame_Timestamp_Get(hFrame, &timestamp);
+        peak_Frame_Release(config.syncSlaves[i], hFrame);
+        received++;
+        if (syncSlaveLastTs_[i] != 0 && syncMasterLastTs_ != 0)
         {
-            // Another error occured in the meantime. Proceed with the last error.
-            printf("Last-Error: Another error occured in the meantime!\n");
+            double masterInterval = (double)(masterTimestamp - syncMasterLastTs_);
+            double slaveInterval = (double)(timestamp - syncSlaveLastTs_[i]);
+            double errorUs = fabs(slaveInterval - masterInterval) / 1000;
+            if (errorUs > maxErrorUs) { maxErrorUs = errorUs; }
         }
+        syncSlaveLastTs_[i] = timestamp;
+    }
+    syncMasterLastTs_ = masterTimestamp;
+    frameTags["Sync-Slaves-Received"] = CDeviceUtils::ConvertToString(received);
+    if (maxErrorUs >= 0)
+    {
+        frameTags["Sync-Max-Interval-Error-us"] = CDeviceUtils::ConvertToString(maxErrorUs);
+    }
+}
 
-        // Allocate and zero-initialize the char array for the error message
-        char* lastErrorMessage = (char*)calloc((lastErrorMessageSize) / sizeof(char), sizeof(char));
-        if (lastErrorMessage == NULL)
+/**
+* Sets up the composite of the synchronized cameras. Every slave gets the
+* transfer kernel for its own pixel format, with the output type of the master.
+*/
+int CIDSPeak::setupComposite(int mode)
+{
+    compositeSources_.clear();
+    if (mode == COMPOSITE_OFF)
+    {
+        if (compositeMode_ == COMPOSITE_STAGGERED && !syncSlaves_.empty())
         {
-            // Cannot allocate lastErrorMessage. Most likely not enough Memory.
-            printf("Last-Error: Failed to allocate memory for the error message!\n");
-            free(lastErrorMessage);
-            return PEAK_FALSE;
+            setGFAfloat(syncSlaves_[0], "TriggerDelay", 0);
         }
+        compositeMode_ = COMPOSITE_OFF;
+        publishConfig();
+        return DEVICE_OK;
+    }
+    if (syncSlaves_.empty()) { return ERR_COMPOSITE_NEEDS_SYNC; }
+    if (mode == COMPOSITE_STAGGERED && syncSlaves_.size() != 1) { return ERR_COMPOSITE_FORMAT; }
+    if (transferKernel_ == NULL) { return ERR_COMPOSITE_FORMAT; }
 
-        // Get the error message
-        status = peak_Library_GetLastError(&lastErrorCode, lastErrorMessage, &lastErrorMessageSize);
-        if (PEAK_ERROR(status))
+    CompositeSource master = { hCam, CamID_, NULL, img_.Width(), img_.Height(), 0 };
+    compositeSources_.push_back(master);
+    for (size_t i = 0; i < syncSlaves_.size(); i++)
+    {
+        peak_camera_handle hSlave = syncSlaves_[i];
+        peak_pixel_format format;
+        peak_roi roi;
+        if (peak_PixelFormat_Get(hSlave, &format) != PEAK_STATUS_SUCCESS
+            || peak_ROI_Get(hSlave, &roi) != PEAK_STATUS_SUCCESS)
         {
-            // Unable to get error message. This shouldn't ever happen.
-            printf("Last-Error: Getting last error message failed! Status: %#06x; Last error code: %#06x\n", status,
-                lastErrorCode);
-            free(lastErrorMessage);
-            return PEAK_FALSE;
+            compositeSources_.clear();
+            return ERR_NO_READ_ACCESS;
         }
-
-        printf("Last-Error: %s | Code: %#06x\n", lastErrorMessage, lastErrorCode);
-        free(lastErrorMessage);
-
-        if (!continueExecution)
+        const TransferKernelEntry* kernel = findTransferKernel(format, bitDepth_, demosaicLive_, transferKernel_->pixelType);
+        if (kernel == NULL
+            || (kernel->configure != NULL && kernel->configure(hSlave) != PEAK_STATUS_SUCCESS)
+            || (mode != COMPOSITE_SIDE_BY_SIDE && (roi.size.width != img_.Width() || roi.size.height != img_.Height())))
         {
-            cleanExit();
+            compositeSources_.clear();
+            return ERR_COMPOSITE_FORMAT;
         }
-
-        return PEAK_FALSE;
+        CompositeSource slave = { hSlave, syncSlaveIds_[i], kernel->transfer, roi.size.width, roi.size.height, 0 };
+        compositeSources_.push_back(slave);
     }
-    return PEAK_TRUE;
-}
-
-int CIDSPeak::getSensorInfo()
-{
-    // check if the feature is readable
-    if (PEAK_IS_READABLE(
-        peak_GFA_Feature_GetAccessStatus(hCam, PEAK_GFA_MODULE_REMOTE_DEVICE, "DeviceFirmwareVersion")))
+    compositeMode_ = mode;
+    publishConfig();
+    if (mode == COMPOSITE_STAGGERED)
     {
-        int64_t temp_x;
-        int64_t temp_y;
-        status = getGFAInt("WidthMax", &temp_x);
-        status = getGFAInt("HeightMax", &temp_y);
-        cameraCCDXSize_ = (long)temp_x;
-        cameraCCDYSize_ = (long)temp_y;
+        // The frame rate of a sequence is only known at its start, an
+        // overlap is refused there
+        int nRet = applyStaggerDelay();
+        return nRet == ERR_STAGGER_OVERLAP ? DEVICE_OK : nRet;
     }
-    else
+    for (size_t i = 0; i < syncSlaves_.size(); i++)
     {
-        return ERR_NO_READ_ACCESS;
+        setGFAfloat(syncSlaves_[i], "TriggerDelay", 0);
     }
-    if (status == PEAK_STATUS_SUCCESS) { return DEVICE_OK; }
-    else { return DEVICE_ERR; }
+    return DEVICE_OK;
 }
 
-peak_status CIDSPeak::getGFAString(const char* featureName, char* stringValue)
+/**
+* Delays the trigger of the slave by half the frame period of the master, so
+* the two cameras expose alternately. Both cameras get the exposure time of
+* the master, which has to fit in half a period, overlapping exposures are
+* refused.
+*/
+int CIDSPeak::applyStaggerDelay()
 {
-    size_t stringLength = 0;
-
-    // get the length of the feature string
-    status = peak_GFA_String_Get(hCam, PEAK_GFA_MODULE_REMOTE_DEVICE, featureName, NULL, &stringLength);
-
-    // if successful, read the firmware version
-    if (checkForSuccess(status, PEAK_TRUE))
+    peak_camera_handle hSlave = syncSlaves_[0];
+    double delayUs = 500000 / framerateCur_;
+    if (exposureCur_ * 1000 > delayUs) { return ERR_STAGGER_OVERLAP; }
+    staggerDelayUs_ = delayUs;
+    if (setGFAfloat(hSlave, "TriggerDelay", staggerDelayUs_) != PEAK_STATUS_SUCCESS
+        || peak_ExposureTime_Set(hSlave, exposureCur_ * 1000) != PEAK_STATUS_SUCCESS)
     {
-        // read the string value of featureName
-        status = peak_GFA_String_Get(
-            hCam, PEAK_GFA_MODULE_REMOTE_DEVICE, featureName, stringValue, &stringLength);
+        return ERR_NO_WRITE_ACCESS;
     }
-    return status;
+    publishConfig();
+    return DEVICE_OK;
 }
 
-peak_status CIDSPeak::getGFAInt(const char* featureName, int64_t* intValue)
+/**
+* Starts matching from scratch. The frame numbering of a slave starts with its
+* first frame that was exposed at the same instant as a master frame.
+*/
+void CIDSPeak::resetComposite(const AcqConfig& config)
 {
-    // read the integer value of featureName
-    status = peak_GFA_Integer_Get(
-        hCam, PEAK_GFA_MODULE_REMOTE_DEVICE, featureName, intValue);
-    return status;
+    size_t nSources = config.compositeSources.size();
+    compositeFirstId_.assign(nSources, UINT64_MAX);
+    compositeLastTs_.assign(nSources, 0);
+    compositeLastMasterTs_.assign(nSources, 0);
+    compositePending_.assign(nSources, (peak_frame_handle)NULL);
+    compositeClockOffsetNs_.assign(nSources, INT64_MAX);
+    for (size_t c = 1; c < nSources; c++)
+    {
+        for (size_t i = 0; i < config.syncSlaves.size() && i < syncClockOffsetNs_.size(); i++)
+        {
+            if (config.syncSlaves[i] == config.compositeSources[c].hDev) { compositeClockOffsetNs_[c] = syncClockOffsetNs_[i]; }
+        }
+    }
+    compositeDropped_ = 0;
+    staggerOffsetValid_ = false;
+    MMThreadGuard g(imgPixelsLock_);
+    if (compositeImgs_.size() < nSources) { compositeImgs_.resize(nSources); }
 }
 
-peak_status CIDSPeak::getGFAfloat(const char* featureName, double* floatValue)
+void CIDSPeak::releaseCompositePending(const AcqConfig& config)
 {
-    // read the float value of featureName
-    status = peak_GFA_Float_Get(
-        hCam, PEAK_GFA_MODULE_REMOTE_DEVICE, featureName, floatValue);
-    return status;
+    for (size_t c = 0; c < compositePending_.size() && c < config.compositeSources.size(); c++)
+    {
+        if (compositePending_[c] != NULL)
+        {
+            peak_Frame_Release(config.compositeSources[c].hDev, compositePending_[c]);
+            compositePending_[c] = NULL;
+        }
+    }
 }
 
-void CIDSPeak::initializeAutoWBConversion()
+/**
+* Matches the slave frames to the master frame and transfers all of them into
+* compositeImgs_. The first frame of a slave is anchored in absolute time: its
+* timestamp minus the master's has to match the clock offset measured by the
+* sync check (widened by the clock drift since then), else it belongs to an
+* earlier or later set. From then on frames match when their frame IDs are at
+* the same distance from the anchored ones, and the time since the previous
+* matched set agrees within the sync tolerance on both cameras (intervals,
+* because the camera clocks drift). Stale slave frames are dropped, early ones
+* are kept for the next master frame.
+* Returns ERR_COMPOSITE_INCOMPLETE if not every camera has a matching frame.
+*/
+int CIDSPeak::composeFrame(const AcqConfig& config, peak_frame_handle hMasterFrame, map<string, string>& frameTags)
 {
-    peakAutoToString.insert(pair<int, string>(PEAK_AUTO_FEATURE_MODE_OFF, "Off"));
-    peakAutoToString.insert(pair<int, string>(PEAK_AUTO_FEATURE_MODE_ONCE, "Once"));
-    peakAutoToString.insert(pair<int, string>(PEAK_AUTO_FEATURE_MODE_CONTINUOUS, "Continuous"));
+    size_t nSources = config.compositeSources.size();
+    if (compositeFirstId_.size() != nSources) { resetComposite(config); }
 
-    stringToPeakAuto.insert(pair<string, int>("Off", PEAK_AUTO_FEATURE_MODE_OFF));
-    stringToPeakAuto.insert(pair<string, int>("Once", PEAK_AUTO_FEATURE_MODE_ONCE));
-    stringToPeakAuto.insert(pair<string, int>("Continuous", PEAK_AUTO_FEATURE_MODE_CONTINUOUS));
-}
+    uint64_t masterId = 0;
+    uint64_t masterTs = 0;
+    peak_Frame_ID_Get(hMasterFrame, &masterId);
+    peak_Frame_Timestamp_Get(hMasterFrame, &masterTs);
+    frameTimestamp_ = masterTs;
+    if (compositeFirstId_[0] == UINT64_MAX) { compositeFirstId_[0] = masterId; }
+    uint64_t set = masterId - compositeFirstId_[0];
 
-int CIDSPeak::transferBuffer(peak_frame_handle hFrame, ImgBuffer& img)
-{
-    peak_frame_handle hFrameConverted;
-    peak_buffer peakBuffer;
-    uint8_t* memoryAddress;
-    size_t memorySize;
-    unsigned char* pBuf = (unsigned char*) const_cast<unsigned char*>(img.GetPixels());
-
-    // Convert data types to MM supported data types
-    // Monochrome is natively supported by MM, so no conversion is needed
-    if (nComponents_ == 1)
-    {
-        status = peak_Frame_Buffer_Get(hFrame, &peakBuffer);
-        // Transfer the frame buffer to the img buffer expected by MM.
-        memoryAddress = peakBuffer.memoryAddress;
-        memorySize = peakBuffer.memorySize;
-        memcpy(pBuf, memoryAddress, memorySize);
-    }
-    // Convert all 8bit pixel formats into BGRA8 (8bit format expected by MM)
-    else if (nComponents_ == 4)
-    {
-        status = peak_IPL_PixelFormat_Set(hCam, PEAK_PIXEL_FORMAT_BGRA8);
-        if (status != PEAK_STATUS_SUCCESS) { return DEVICE_UNSUPPORTED_DATA_FORMAT; }
-        status = peak_IPL_ProcessFrame(hCam, hFrame, &hFrameConverted);
-        if (status != PEAK_STATUS_SUCCESS) { return DEVICE_UNSUPPORTED_DATA_FORMAT; }
-        status = peak_Frame_Buffer_Get(hFrameConverted, &peakBuffer);
-        // Transfer the frame buffer to the img buffer expected by MM.
-        memoryAddress = peakBuffer.memoryAddress;
-        memorySize = peakBuffer.memorySize;
-        memcpy(pBuf, memoryAddress, memorySize);
-        peak_Frame_Release(hCam, hFrameConverted);
+    {
+        MMThreadGuard g(imgPixelsLock_);
+        for (size_t c = 0; c < nSources; c++)
+        {
+            const CompositeSource& source = config.compositeSources[c];
+            compositeImgs_[c].Resize(source.width, source.height, config.bytesPerPixel);
+        }
     }
-    else
+    int nRet = config.compositeSources[0].transfer(hCam, hMasterFrame, compositeImgs_[0], pool_);
+    if (nRet != DEVICE_OK) { return nRet; }
+
+    // Staggered slaves expose half a period after the master
+    double delayMs = config.compositeMode == COMPOSITE_STAGGERED ? config.staggerDelayUs / 1000 : 0;
+    uint32_t timeoutMs = (uint32_t)(3 * config.exposureMs + delayMs + 100);
+    double maxErrorUs = 0;
+    bool complete = true;
+    for (size_t c = 1; c < nSources; c++)
     {
-        return DEVICE_UNSUPPORTED_DATA_FORMAT;
+        const CompositeSource& source = config.compositeSources[c];
+        bool matched = false;
+        while (!matched)
+        {
+            peak_frame_handle hFrame = compositePending_[c];
+            compositePending_[c] = NULL;
+            if (hFrame == NULL && peak_Acquisition_WaitForFrame(source.hDev, timeoutMs, &hFrame) != PEAK_STATUS_SUCCESS)
+            {
+                break;
+            }
+            uint64_t id = 0;
+            uint64_t ts = 0;
+            peak_Frame_ID_Get(hFrame, &id);
+            peak_Frame_Timestamp_Get(hFrame, &ts);
+            if (compositeFirstId_[c] == UINT64_MAX)
+            {
+                if (compositeClockOffsetNs_[c] == INT64_MAX)
+                {
+                    // No offset measured for this camera, nothing to anchor it with
+                    peak_Frame_Release(source.hDev, hFrame);
+                    break;
+                }
+                double allowanceNs = (config.syncToleranceUs + SYNC_MAX_CLOCK_DRIFT_PPM * secondsSince(syncClockOffsetTime_)) * 1000;
+                double deviationNs = (double)((int64_t)ts - (int64_t)masterTs - compositeClockOffsetNs_[c]);
+                if (deviationNs < -allowanceNs)
+                {
+                    // Exposed before this master frame, a stale frame
+                    peak_Frame_Release(source.hDev, hFrame);
+                    continue;
+                }
+                if (deviationNs > allowanceNs)
+                {
+                    // The slave missed this trigger, its frame may anchor a later set
+                    compositePending_[c] = hFrame;
+                    break;
+                }
+                compositeFirstId_[c] = id - set;
+            }
+            uint64_t slaveSet = id - compositeFirstId_[c];
+            if (slaveSet > set && slaveSet < (uint64_t)1 << 63)
+            {
+                // This slave missed the trigger of this set, keep its frame for a later one
+                compositePending_[c] = hFrame;
+                break;
+            }
+            if (slaveSet == set)
+            {
+                double errorUs = 0;
+                if (compositeLastTs_[c] != 0)
+                {
+                    double masterInterval = (double)(masterTs - compositeLastMasterTs_[c]);
+                    double slaveInterval = (double)(ts - compositeLastTs_[c]);
+                    errorUs = fabs(slaveInterval - masterInterval) / 1000;
+                }
+                if (errorUs <= config.syncToleranceUs)
+                {
+                    nRet = source.transfer(source.hDev, hFrame, compositeImgs_[c], pool_);
+                    matched = (nRet == DEVICE_OK);
+                    compositeLastTs_[c] = ts;
+                    compositeLastMasterTs_[c] = masterTs;
+                    if (errorUs > maxErrorUs) { maxErrorUs = errorUs; }
+                }
+            }
+            // Stale or mistimed frames are dropped
+            peak_Frame_Release(source.hDev, hFrame);
+            if (slaveSet == set && !matched) { break; }
+        }
+        complete = complete && matched;
+    }
+    if (!complete)
+    {
+        compositeDropped_++;
+        return ERR_COMPOSITE_INCOMPLETE;
     }
 
-    // Exit if something went wrong during the conversion/obtaining the buffer.
-    if (status != PEAK_STATUS_SUCCESS) { return DEVICE_UNSUPPORTED_DATA_FORMAT; }
+    frameTags["Composite-Set"] = CDeviceUtils::ConvertToString((long)set);
+    frameTags["Composite-Dropped-Sets"] = CDeviceUtils::ConvertToString((long)compositeDropped_);
+    frameTags["Composite-Max-Interval-Error-us"] = CDeviceUtils::ConvertToString(maxErrorUs);
+    frameTags["Composite-Cameras"] = CDeviceUtils::ConvertToString((long)nSources);
+    for (size_t c = 0; c < nSources; c++)
+    {
+        ostringstream key;
+        key << "Composite-Camera-" << config.compositeSources[c].cameraID << "-X";
+        frameTags[key.str()] = CDeviceUtils::ConvertToString((long)config.compositeSources[c].xOffset);
+    }
 
+    if (config.compositeMode == COMPOSITE_SIDE_BY_SIDE)
+    {
+        MMThreadGuard g(imgPixelsLock_);
+        compositeImg_.Resize(config.width, config.height, config.bytesPerPixel);
+        unsigned char* pDst = const_cast<unsigned char*>(compositeImg_.GetPixels());
+        memset(pDst, 0, (size_t)config.width * config.height * config.bytesPerPixel);
+        for (size_t c = 0; c < nSources; c++)
+        {
+            const CompositeSource& source = config.compositeSources[c];
+            copySideBySide(pDst, config.width, config.bytesPerPixel, compositeImgs_[c].GetPixels(),
+                source.width, source.height, source.xOffset);
+        }
+    }
     return DEVICE_OK;
 }
 
-int CIDSPeak::updateAutoWhiteBalance()
+/**
+* Inserts the last composed set, as one image or as one channel per camera.
+*/
+int CIDSPeak::insertComposite(const AcqConfig& config, const map<string, string>& frameTags)
 {
-    if (peak_AutoWhiteBalance_GetAccessStatus(hCam) == PEAK_ACCESS_READONLY
-        || peak_AutoWhiteBalance_GetAccessStatus(hCam) == PEAK_ACCESS_READWRITE)
+    if (config.compositeMode == COMPOSITE_SIDE_BY_SIDE)
     {
-        // Update the gain channels
-        status = peak_Gain_Get(hCam, PEAK_GAIN_TYPE_DIGITAL, PEAK_GAIN_CHANNEL_MASTER, &gainMaster_);
-        status = peak_Gain_Get(hCam, PEAK_GAIN_TYPE_DIGITAL, PEAK_GAIN_CHANNEL_RED, &gainRed_);
-        status = peak_Gain_Get(hCam, PEAK_GAIN_TYPE_DIGITAL, PEAK_GAIN_CHANNEL_GREEN, &gainGreen_);
-        status = peak_Gain_Get(hCam, PEAK_GAIN_TYPE_DIGITAL, PEAK_GAIN_CHANNEL_BLUE, &gainBlue_);
-        // Update the auto white balance mode
-        status = peak_AutoWhiteBalance_Mode_Get(hCam, &peakAutoWhiteBalance_);
+        return InsertImage(compositeImg_, frameTags);
     }
-    else { return ERR_NO_READ_ACCESS; }
-
-    if (status == PEAK_STATUS_SUCCESS) { return DEVICE_OK; }
-    else { return DEVICE_ERR; }
+    if (config.compositeMode == COMPOSITE_STAGGERED)
+    {
+        // Map the slave timestamp to the master clock, the offset between the
+        // clocks follows from the first set (where the delay is the nominal one)
+        int64_t masterTs = (int64_t)compositeLastMasterTs_[1];
+        int64_t slaveTs = (int64_t)compositeLastTs_[1];
+        if (!staggerOffsetValid_)
+        {
+            staggerOffsetNs_ = slaveTs - masterTs - (int64_t)(config.staggerDelayUs * 1000);
+            staggerOffsetValid_ = true;
+        }
+        int64_t times[2] = { masterTs, slaveTs - staggerOffsetNs_ };
+        int first = times[1] < times[0] ? 1 : 0;
+        for (int i = 0; i < 2; i++)
+        {
+            int c = i == 0 ? first : 1 - first;
+            if (staggerRemaining_ <= 0) { break; }
+            map<string, string> frameTags2(frameTags);
+            frameTags2["Stagger-Camera"] = CDeviceUtils::ConvertToString((long)config.compositeSources[c].cameraID);
+            frameTags2["Stagger-Device-Time-us"] = CDeviceUtils::ConvertToString((double)times[c] / 1000);
+            int nRet = InsertImage(compositeImgs_[c], frameTags2);
+            if (nRet != DEVICE_OK) { return nRet; }
+            staggerRemaining_--;
+        }
+        return DEVICE_OK;
+    }
+    for (size_t c = 0; c < config.compositeSources.size(); c++)
+    {
+        map<string, string> channelTags(frameTags);
+        char channelName[MM::MaxStrLength];
+        GetChannelName((unsigned)c, channelName);
+        channelTags[MM::g_Keyword_CameraChannelIndex] = CDeviceUtils::ConvertToString((long)c);
+        channelTags[MM::g_Keyword_CameraChannelName] = channelName;
+        int nRet = InsertImage(compositeImgs_[c], channelTags);
+        if (nRet != DEVICE_OK) { return nRet; }
+    }
+    return DEVICE_OK;
 }
 
-int CIDSPeak::framerateSet(double framerate)
+/**
+* Switches the camera between free running and software triggered acquisition.
+* Nothing is written if the camera already is in the requested configuration.
+* The acquisition must be stopped.
+*/
+int CIDSPeak::applyTriggerConfig(int triggerConfig)
 {
-    // Check if interval doesn't exceed framerate limitations of camera
-    // Else set interval to match max framerate
-    if (framerate > framerateMax_)
+    if (triggerConfig == triggerConfig_) { return DEVICE_OK; }
+
+    if (triggerConfig != TRIGGER_CONFIG_WIDTH && triggerConfig_ != TRIGGER_CONFIG_FREERUN
+        && triggerConfig_ != TRIGGER_CONFIG_SOFTWARE)
     {
-        framerate = framerateMax_;
+        // Leaving trigger width (or unknown) mode, cameras without the feature
+        // are always timed
+        setGFAEnum(hCam, "ExposureMode", "Timed");
     }
-    else if (framerate < framerateMin_)
+    status = setGFAEnum(hCam, "TriggerSelector", "ExposureStart");
+    if (status != PEAK_STATUS_SUCCESS) { return ERR_NO_WRITE_ACCESS; }
+    if (triggerConfig == TRIGGER_CONFIG_WIDTH)
     {
-        framerate = framerateMin_;
+        // The exposure lasts as long as the trigger line is at the active level
+        status = setGFAEnum(hCam, "TriggerSource", triggerLine_.c_str());
+        if (status == PEAK_STATUS_SUCCESS)
+        {
+            status = setGFAEnum(hCam, "TriggerActivation", triggerLevelHigh_ ? "LevelHigh" : "LevelLow");
+        }
+        if (status == PEAK_STATUS_SUCCESS && setGFAEnum(hCam, "ExposureMode", "TriggerWidth") != PEAK_STATUS_SUCCESS)
+        {
+            status = setGFAEnum(hCam, "ExposureMode", "TriggerControlled");
+        }
+        if (status == PEAK_STATUS_SUCCESS) { status = setGFAEnum(hCam, "TriggerMode", "On"); }
     }
-
-    if (peak_FrameRate_GetAccessStatus(hCam) == PEAK_ACCESS_READWRITE)
+    else if (triggerConfig == TRIGGER_CONFIG_SOFTWARE)
     {
-        status = peak_FrameRate_Set(hCam, framerate);
-        framerateCur_ = framerate;
+        status = setGFAEnum(hCam, "TriggerSource", "Software");
+        if (status != PEAK_STATUS_SUCCESS) { return ERR_NO_WRITE_ACCESS; }
+        status = setGFAEnum(hCam, "TriggerMode", "On");
     }
     else
     {
+        status = setGFAEnum(hCam, "TriggerMode", "Off");
+    }
+    if (status != PEAK_STATUS_SUCCESS)
+    {
+        triggerConfig_ = TRIGGER_CONFIG_UNKNOWN;
         return ERR_NO_WRITE_ACCESS;
     }
+    triggerConfig_ = triggerConfig;
     return DEVICE_OK;
 }
 
@@ -2015,10 +8248,19 @@ int CIDSPeak::cameraChanged()
     binSize_ = (long)binx;
     nRet = SetBinning(binSize_);
 
+    // Decimation
+    uint32_t decx = 1;
+    uint32_t decy = 1;
+    if (peak_Decimation_Get(hCam, &decx, &decy) == PEAK_STATUS_SUCCESS) { decimation_ = (long)decx; }
+    nRet = SetAllowedDecimation();
+    if (nRet != DEVICE_OK)
+        return nRet;
+
     // PixelType, assumes 8bit mono is always possible
     vector<string> pixelTypeValues;
     pixelTypeValues.push_back(g_PixelType_8bit);
-    if (isColorCamera())
+    bool colorCamera = isColorCamera();
+    if (colorCamera)
     {
         pixelTypeValues.push_back(g_PixelType_32bitRGBA);
     }
@@ -2029,7 +8271,9 @@ int CIDSPeak::cameraChanged()
 
     peak_pixel_format format;
     status = peak_PixelFormat_Get(hCam, &format);
-    if (format == PEAK_PIXEL_FORMAT_MONO8)
+    // Setting the property puts the camera in the matching format (see OnPixelType),
+    // so formats without transfer kernel are replaced by a supported one here.
+    if (format == PEAK_PIXEL_FORMAT_MONO8 || !colorCamera)
     {
         pixelType_ = g_PixelType_8bit;
         nComponents_ = 1;
@@ -2038,25 +8282,71 @@ int CIDSPeak::cameraChanged()
     else
     {
         pixelType_ = g_PixelType_32bitRGBA;
-        nComponents_ = 8;
+        nComponents_ = 4;
         SetProperty(MM::g_Keyword_PixelType, g_PixelType_32bitRGBA);
     }
+    nRet = selectTransferKernel();
+    if (nRet != DEVICE_OK)
+        return nRet;
 
     // Exposure time
-    status = peak_ExposureTime_GetRange(hCam, &exposureMin_, &exposureMax_, &exposureInc_);
-    if (status != PEAK_STATUS_SUCCESS) { return ERR_DEVICE_NOT_AVAILABLE; }
-    exposureMin_ /= 1000;
-    exposureMax_ /= 1000;
-    exposureInc_ /= 1000;
-    nRet = SetPropertyLimits(MM::g_Keyword_Exposure, exposureMin_, exposureMax_);
+    nRet = updateExposureRange();
     if (nRet != DEVICE_OK)
         return nRet;
-    status = peak_ExposureTime_Get(hCam, &exposureCur_);
-    exposureCur_ /= 1000;
+
+    // Shutter mode, cameras without the feature have a single fixed one
+    vector<string> shutterModes;
+    getGFAEnumList(hCam, "SensorShutterMode", shutterModes);
+    if (shutterModes.empty() || getGFAEnum(hCam, "SensorShutterMode", shutterMode_) != PEAK_STATUS_SUCCESS)
+    {
+        shutterModes.assign(1, g_ShutterMode_Default);
+        shutterMode_ = g_ShutterMode_Default;
+    }
+    nRet = ClearAllowedValues("Shutter mode");
+    nRet = SetAllowedValues("Shutter mode", shutterModes);
+    updateShutterTiming();
+
+    // The new camera may be in any trigger mode, and has its own clock
+    triggerConfig_ = TRIGGER_CONFIG_UNKNOWN;
+    clockLatchSupported_ = true;
+    clock_.Reset();
+
+    // I/O lines that can switch the illumination of interleaved channels
+    vector<string> lineValues;
+    lineValues.push_back(g_OutputLine_None);
+    getGFAEnumList(hCam, "LineSelector", lineValues);
+    for (int k = 0; k < MAX_INTERLEAVED_CHANNELS; k++)
+    {
+        ostringstream propName;
+        propName << "Channel " << k + 1 << " output line";
+        if (find(lineValues.begin(), lineValues.end(), channelSettings_[k].outputLine) == lineValues.end())
+        {
+            channelSettings_[k].outputLine = "";
+        }
+        nRet = ClearAllowedValues(propName.str().c_str());
+        nRet = SetAllowedValues(propName.str().c_str(), lineValues);
+    }
+    vector<string> triggerLines(lineValues.begin() + 1, lineValues.end());
+    if (!triggerLines.empty())
+    {
+        if (find(triggerLines.begin(), triggerLines.end(), triggerLine_) == triggerLines.end())
+        {
+            triggerLine_ = triggerLines[0];
+        }
+        nRet = ClearAllowedValues("Trigger line");
+        nRet = SetAllowedValues("Trigger line", triggerLines);
+        if (find(triggerLines.begin(), triggerLines.end(), syncMasterLine_) == triggerLines.end())
+        {
+            syncMasterLine_ = triggerLines.back();
+        }
+        nRet = ClearAllowedValues("Sync master output line");
+        nRet = SetAllowedValues("Sync master output line", triggerLines);
+    }
 
     // Framerate range
     status = peak_FrameRate_GetRange(hCam, &framerateMin_, &framerateMax_, &framerateInc_);
     nRet = SetPropertyLimits("MDA framerate", framerateMin_, framerateMax_);
+    framerateLimitsDirty_ = false;
     status = peak_FrameRate_Get(hCam, &framerateCur_);
 
     // Get sensor size
@@ -2078,7 +8368,8 @@ int CIDSPeak::cameraChanged()
     roiInc_ = roi_size_inc.height;
     status = peak_ROI_Get(hCam, &roi);
     SetROI(roi.offset.x, roi.offset.y, roi.size.width, roi.size.height);
-    img_.Resize(roi.size.width, roi.size.height, nComponents_ * (bitDepth_ / 8));
+    img_.Resize(roi.size.width, roi.size.height, outputBytesPerPixel());
+    publishConfig();
 
     if (nRet != DEVICE_OK)
         return nRet;
@@ -2090,10 +8381,9 @@ bool CIDSPeak::isColorCamera()
 {
     size_t pixelFormatCount = 0;
     status = peak_PixelFormat_GetList(hCam, NULL, &pixelFormatCount);
-    peak_pixel_format* pixelFormatList = (peak_pixel_format*)calloc(
-        pixelFormatCount, sizeof(peak_pixel_format));
-    status = peak_PixelFormat_GetList(hCam, pixelFormatList, &pixelFormatCount);
-    for (int i = 0; i < pixelFormatCount; i++)
+    vector<peak_pixel_format> pixelFormatList(pixelFormatCount);
+    status = peak_PixelFormat_GetList(hCam, pixelFormatList.data(), &pixelFormatCount);
+    for (size_t i = 0; i < pixelFormatCount; i++)
     {
         if (pixelFormatList[i] == PEAK_PIXEL_FORMAT_BAYER_RG8) { return true; }
     }
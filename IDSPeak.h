@@ -39,6 +39,14 @@
 #include <algorithm>
 #include <stdint.h>
 #include <future>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <memory>
+#include <atomic>
+#include <ostream>
+#include <chrono>
 
 #include <ids_peak_comfort_c/ids_peak_comfort_c.h>
 
@@ -66,6 +74,125 @@ using namespace std;
 #define ERR_ACQ_RELEASE          115
 #define ERR_ACQ_TIMEOUT          116
 #define ERR_NO_WRITE_ACCESS      117
+#define ERR_HDR_NEEDS_MONO       118
+#define ERR_HDR_EXPOSURES        119
+#define ERR_CYCLE_CONFLICT       120
+#define ERR_TRIGGER_WIDTH_CONFLICT 121
+#define ERR_SYNC_WIRING          122
+#define ERR_SYNC_NO_SLAVES       123
+#define ERR_COMPOSITE_NEEDS_SYNC 124
+#define ERR_COMPOSITE_FORMAT     125
+#define ERR_COMPOSITE_CONFLICT   126
+#define ERR_COMPOSITE_INCOMPLETE 127 // internal, a set was dropped
+#define ERR_METRICS_FILE         128
+#define ERR_BENCHMARK_FILE       129
+#define ERR_BENCHMARK_REGRESSION 130
+#define ERR_SYNC_UNCHECKED       131
+#define ERR_SYNC_SLAVE_START     132
+#define ERR_STAGGER_OVERLAP      133
+
+////////////////////////////////////////
+// Trigger configurations
+////////////////////////////////////////
+#define TRIGGER_CONFIG_UNKNOWN  -1
+#define TRIGGER_CONFIG_FREERUN   0
+#define TRIGGER_CONFIG_SOFTWARE  1
+#define TRIGGER_CONFIG_WIDTH     2 // Exposure time set by the external trigger pulse
+
+////////////////////////////////////////
+// Multi-camera composite output
+////////////////////////////////////////
+#define COMPOSITE_OFF           0
+#define COMPOSITE_SIDE_BY_SIDE  1
+#define COMPOSITE_CHANNELS      2
+#define COMPOSITE_STAGGERED     3 // two cameras half a period apart, one stream
+
+////////////////////////////////////////
+// HDR output modes
+////////////////////////////////////////
+#define HDR_MODE_OFF    0
+#define HDR_MODE_16BIT  1
+#define HDR_MODE_32BIT  2
+
+#define MAX_INTERLEAVED_CHANNELS 4
+
+////////////////////////////////////////
+// Demosaic algorithms (Bayer formats)
+////////////////////////////////////////
+#define DEMOSAIC_ANY        -1 // non Bayer formats
+#define DEMOSAIC_IPL        0  // IDS image processing library
+#define DEMOSAIC_NEAREST    1
+#define DEMOSAIC_BILINEAR   2
+#define DEMOSAIC_MALVAR     3  // Malvar-He-Cutler gradient corrected
+#define DEMOSAIC_EDGE_AWARE 4  // gradient directed green, color differences
+#define DEMOSAIC_COUNT      5
+
+////////////////////////////////////////
+// Injected faults (recovery testing)
+////////////////////////////////////////
+// The Fault injection properties damage acquisitions on purpose, they only
+// exist in test builds with IDS_PEAK_FAULT_INJECTION defined
+#define FAULT_NONE          0
+#define FAULT_TIMEOUT       1
+#define FAULT_ABORTED       2
+#define FAULT_INCOMPLETE    3
+#define FAULT_DEVICE_LOST   4
+#define FAULT_SLOW_CONTROL  5
+#define FAULT_DEVICE_LOST_MS 2000 // a lost camera is found again after this long
+
+// Fault recovery self test
+#define FAULT_TEST_FRAMERATE        50   // fps, lower if the camera can't
+#define FAULT_TEST_INTERVAL         50   // frames between faults
+#define FAULT_TEST_FRAMES           200  // frames per fault mode
+#define FAULT_TEST_MAX_RECOVERY_MS  1000 // beyond the expected downtime
+
+// Soak self test, the bounds apply to the growth over the sample after the warm up
+#define SOAK_TEST_FRAMES            100  // frames of every live view and sequence
+#define SOAK_TEST_SNAPS             5
+#define SOAK_TEST_WARMUP_ROUNDS     3
+#define SOAK_TEST_MAX_RSS_GROWTH_MB 64
+#define SOAK_TEST_MAX_HANDLE_GROWTH 16
+#define SOAK_TEST_MAX_LATENCY_DRIFT 0.5  // fraction of the p99 processing latency, plus 1 ms
+
+////////////////////////////////////////
+// Region of activity ROI tracking
+////////////////////////////////////////
+#define ROI_TRACK_SAMPLE_STEP   4   // pixels between tested samples
+#define ROI_TRACK_SIZE_STEP     64  // sizes are rounded up to this, to favor offset only moves
+#define ROI_TRACK_SETTLE_FRAMES 5   // frames a shrink or a lost signal must persist
+#define ROI_TRACK_SHRINK_RATIO  0.7 // shrink when the target has less than this fraction of the area
+
+////////////////////////////////////////
+// Exposure
+////////////////////////////////////////
+// Exposures (plus readout) up to this fraction of the shortest frame period
+// leave the frame rate range unchanged, longer ones trigger a re-read
+#define FRAMERATE_LIMIT_EXPOSURE_FRACTION 0.9
+
+////////////////////////////////////////
+// Sequence benchmark
+////////////////////////////////////////
+#define SEQUENCE_BENCH_MAX_SAMPLES 65536 // latencies kept per stage for exact percentiles
+
+////////////////////////////////////////
+// Camera sync
+////////////////////////////////////////
+// Worst case drift between two camera clocks, widens the tolerance of the
+// timestamp offsets measured by the sync check as they age
+#define SYNC_MAX_CLOCK_DRIFT_PPM 100
+
+////////////////////////////////////////
+// Configuration snapshots
+////////////////////////////////////////
+#define CONFIG_SLOTS 4 // published snapshot, plus slots readers may still be copying from
+
+////////////////////////////////////////
+// Thread priorities
+////////////////////////////////////////
+#define THREAD_PRIORITY_LEVEL_NORMAL        0
+#define THREAD_PRIORITY_LEVEL_ABOVE_NORMAL  1
+#define THREAD_PRIORITY_LEVEL_HIGH          2
+#define THREAD_PRIORITY_LEVEL_TIME_CRITICAL 3
 
 const char* NoHubError = "Parent Hub not defined.";
 
@@ -74,6 +201,243 @@ const char* NoHubError = "Parent Hub not defined.";
 //////////////////////////////////////////////////////////////////////////////
 
 class MySequenceThread;
+class WorkerPool;
+
+/**
+* Converts a frame from the camera into the buffer layout Micro-Manager expects.
+* One instantiation exists per source format / destination pixel type / bit depth
+* (and demosaic algorithm for Bayer formats).
+*/
+typedef int (*TransferFunction)(peak_camera_handle hDev, peak_frame_handle hFrame, ImgBuffer& img, WorkerPool* pool);
+
+/**
+* Entry of the table of transfer kernels. configure (may be NULL) is called once
+* when the kernel gets selected, e.g. to set up the IPL output format.
+*/
+struct TransferKernelEntry
+{
+    peak_pixel_format sourceFormat;
+    const char* pixelType;
+    int bitDepth;
+    int demosaic;
+    TransferFunction transfer;
+    peak_status (*configure)(peak_camera_handle hDev);
+};
+
+/**
+* Camera settings for one frame of a cycle (HDR bracket, interleaved channels,
+* ROI cycling). Negative values and an empty output line mean "leave as is".
+*/
+struct FrameSetting
+{
+    double exposureMs;
+    double gain;
+    std::string outputLine;
+    long roiX = -1;
+    long roiY = -1;
+};
+
+/**
+* One camera of a composite image, the master (hCam) comes first.
+*/
+struct CompositeSource
+{
+    peak_camera_handle hDev;
+    int cameraID;
+    TransferFunction transfer;
+    unsigned width;
+    unsigned height;
+    unsigned xOffset; // in the side by side image
+};
+
+/**
+* Immutable copy of the settings the acquisition thread and the image getters
+* depend on. A new snapshot is published (with a higher version) every time one
+* of these settings changes, so readers always see a consistent set of values.
+*/
+struct AcqConfig
+{
+    unsigned long long version;
+    unsigned width;
+    unsigned height;
+    unsigned bytesPerPixel;
+    int bitDepth;
+    int nComponents;
+    long binning;
+    long decimation;
+    std::string shutterMode;
+    unsigned roiX;
+    unsigned roiY;
+    double exposureMs;
+    double framerate;
+    TransferFunction transfer;
+    TransferFunction snapTransfer; // may use another demosaic algorithm
+    int demosaic; // algorithm of transfer and snapTransfer, DEMOSAIC_ANY if none
+    int snapDemosaic;
+    // HDR bracket, with per exposure lookup tables of the merge weight w(z)
+    // and of w(z) * z / t (256 entries per exposure)
+    int hdrMode;
+    std::vector<double> hdrExposures;
+    std::vector<float> hdrLutW;
+    std::vector<float> hdrLutWR;
+    float hdrScale16;
+    // Settings cycled frame by frame, either by the camera sequencer or by
+    // writes between software triggered frames
+    double gainMaster;
+    std::vector<FrameSetting> cycle;
+    std::vector<std::string> cycleLines;
+    double cycleMaxExposureMs;
+    bool cycleOnSequencer;
+    int interleavedChannels;
+    bool separateChannels;
+    bool roiCycling;
+    bool propertySequence;
+    bool triggerWidthExposure;
+    // Slave cameras triggered by the exposure of the master (hCam)
+    std::vector<peak_camera_handle> syncSlaves;
+    // Composite of master and slave frames matched by frame ID and timestamp
+    int compositeMode;
+    std::vector<CompositeSource> compositeSources;
+    double staggerDelayUs;
+    double syncToleranceUs;
+};
+
+/**
+* One measurement of the pixel kernel benchmark: a kernel at one frame size and
+* worker thread count. conformant is false when the output differs from the
+* reference implementation in any bit.
+*/
+struct KernelBenchmarkResult
+{
+    std::string kernel;
+    unsigned width;
+    unsigned height;
+    unsigned threads;
+    double gbPerS;
+    double nsPerPixel;
+    double allocsPerFrame; // per kernel run, -1 when not counted
+    bool conformant;
+};
+
+/**
+* Throughput, latency and CPU cost of the last sequence acquisition, for
+* qualifying builds with real acquisition scenarios.
+*/
+struct SequenceBenchmarkResult
+{
+    uint64_t frames;
+    double fps;
+    double p99WaitMs;
+    double p99TransferMs;
+    double p99InsertMs;
+    double cpuMsPerFrame;
+    double allocsPerFrame; // -1 when not counted
+};
+
+/**
+* Linear model of the host time (MM::MMTime, us) as a function of the camera
+* timestamp (ns), fitted to the most recent pairs of latched camera timestamps
+* and host times. The slope captures the drift between the two clocks.
+*/
+class ClockModel
+{
+public:
+    ClockModel();
+    void Reset();
+    void AddSample(uint64_t deviceNs, double hostUs);
+    bool IsValid() const;
+    double ToHostUs(uint64_t deviceNs) const;
+    double DriftPpm() const;
+    double ResidualUs() const;
+private:
+    void fit();
+    static const size_t maxSamples_ = 32;
+    mutable std::mutex mutex_;
+    std::vector<std::pair<uint64_t, double> > samples_;
+    size_t next_;
+    uint64_t originNs_;
+    double originUs_;
+    double offsetUs_;
+    double slope_; // host us per device ns
+    double residualUs_;
+    bool valid_;
+};
+
+/**
+* Bounded lock free multi producer queue of log messages (Vyukov's bounded
+* MPMC queue). Producers never block or allocate: messages below the minimum
+* level are discarded, over the rate limit or with a full queue they are
+* counted. The log flusher thread hands the messages to the Micro-Manager log.
+*/
+class LogRing
+{
+public:
+    enum Level { LEVEL_DEBUG, LEVEL_INFO, LEVEL_WARNING, LEVEL_ERROR, LEVEL_COUNT };
+
+    LogRing();
+    void SetMinLevel(Level level) { minLevel_.store(level, std::memory_order_relaxed); }
+    Level MinLevel() const { return (Level)minLevel_.load(std::memory_order_relaxed); }
+    bool Push(Level level, const char* message);
+    bool Pop(Level& level, std::string& message);
+    uint64_t TakeDropped() { return dropped_.exchange(0, std::memory_order_relaxed); }
+private:
+    static const size_t capacity_ = 1024; // power of two
+    static const size_t maxLength_ = 256;
+    static const uint32_t maxPerSecond_ = 200; // per level
+    struct Slot
+    {
+        std::atomic<size_t> sequence;
+        Level level;
+        char message[maxLength_];
+    };
+    bool allowRate(Level level);
+    std::unique_ptr<Slot[]> slots_;
+    std::atomic<size_t> enqueuePos_;
+    std::atomic<size_t> dequeuePos_;
+    std::atomic<uint64_t> dropped_;
+    std::atomic<int> minLevel_;
+    std::atomic<int64_t> windowStartMs_;
+    std::atomic<uint32_t> windowCount_[LEVEL_COUNT];
+};
+
+/**
+* Counters and latency histograms of the acquisition. Updated lock free by the
+* acquisition thread, rendered in the Prometheus text format by the metrics
+* writer.
+*/
+class AcqMetrics
+{
+public:
+    enum Counter
+    {
+        FRAMES_ACQUIRED,
+        FRAMES_INSERTED,
+        FRAMES_LOST,
+        INCOMPLETE_SETS,
+        BUFFER_OVERFLOWS,
+        ACQUISITION_ERRORS,
+        RECOVERY_EVENTS,
+        SEQUENCES_STARTED,
+        COUNTER_COUNT
+    };
+    enum Stage { STAGE_WAIT, STAGE_TRANSFER, STAGE_INSERT, STAGE_COUNT };
+
+    AcqMetrics();
+    void Increment(Counter counter) { counters_[counter].fetch_add(1, std::memory_order_relaxed); }
+    void ObserveLatency(Stage stage, double seconds);
+    void FrameInserted();
+    void RecoveryFinished(double seconds, uint64_t lostFrames);
+    uint64_t Count(Counter counter) const { return counters_[counter].load(std::memory_order_relaxed); }
+    void Render(std::ostream& out, const std::string& labels) const;
+private:
+    static const size_t nBuckets_ = 12;
+    static const double bucketBounds_[nBuckets_];
+    std::atomic<uint64_t> counters_[COUNTER_COUNT];
+    std::atomic<uint64_t> buckets_[STAGE_COUNT][nBuckets_ + 1]; // last one is +Inf
+    std::atomic<uint64_t> sumNs_[STAGE_COUNT];
+    std::atomic<int64_t> lastInsertUnixMs_;
+    std::atomic<uint64_t> lastRecoveryUs_;
+};
 
 class CIDSPeak : public CCameraBase<CIDSPeak>
 {
@@ -119,13 +483,19 @@ public:
     int StartSequenceAcquisition(long numImages, double interval_ms, bool stopOnOverflow);
     int StopSequenceAcquisition();
     int InsertImage();
+    int InsertImage(const map<string, string>& frameTags);
+    int InsertImage(const ImgBuffer& img, const map<string, string>& frameTags);
     int RunSequenceOnThread();
+    unsigned GetNumberOfChannels() const;
+    int GetChannelName(unsigned channel, char* name);
+    const unsigned char* GetImageBuffer(unsigned channelNr);
     bool IsCapturing();
     void OnThreadExiting() throw();
     double GetNominalPixelSizeUm() const { return nominalPixelSizeUm_; }
-    double GetPixelSizeUm() const { return nominalPixelSizeUm_ * GetBinning(); }
+    double GetPixelSizeUm() const { return nominalPixelSizeUm_ * GetBinning() * decimation_; }
     int GetBinning() const;
     int SetBinning(int bS);
+    int SetDecimation(int decF);
 
     int IsExposureSequenceable(bool& isSequenceable) const;
     int GetExposureSequenceMaxLength(long& nrEvents) const;
@@ -144,8 +514,50 @@ public:
     int OnSerialNumber(MM::PropertyBase* pProp, MM::ActionType eAct);
     int OnMaxExposure(MM::PropertyBase* pProp, MM::ActionType eAct);
     int OnBinning(MM::PropertyBase* pProp, MM::ActionType eAct);
+    int OnDecimation(MM::PropertyBase* pProp, MM::ActionType eAct);
+    int OnShutterMode(MM::PropertyBase* pProp, MM::ActionType eAct);
+    int OnClockDrift(MM::PropertyBase* pProp, MM::ActionType eAct);
+    int OnDemosaic(MM::PropertyBase* pProp, MM::ActionType eAct, long snap);
+    int OnDemosaicCost(MM::PropertyBase* pProp, MM::ActionType eAct);
+    int OnPreviewDownsampling(MM::PropertyBase* pProp, MM::ActionType eAct);
+    int OnRoiTracking(MM::PropertyBase* pProp, MM::ActionType eAct);
+    int OnRoiTrackingThreshold(MM::PropertyBase* pProp, MM::ActionType eAct);
+    int OnRoiTrackingMargin(MM::PropertyBase* pProp, MM::ActionType eAct);
+    int OnRoiTrackingSearchInterval(MM::PropertyBase* pProp, MM::ActionType eAct);
+    int OnRoiTrackingRegion(MM::PropertyBase* pProp, MM::ActionType eAct);
+    int OnKernelBenchmark(MM::PropertyBase* pProp, MM::ActionType eAct);
+    int OnKernelBenchmarkResult(MM::PropertyBase* pProp, MM::ActionType eAct);
+    int OnBenchmarkFile(MM::PropertyBase* pProp, MM::ActionType eAct, long baseline);
+    int OnBenchmarkTolerance(MM::PropertyBase* pProp, MM::ActionType eAct);
+    int OnBenchmarkComparison(MM::PropertyBase* pProp, MM::ActionType eAct);
+    int OnBenchmarkRegressions(MM::PropertyBase* pProp, MM::ActionType eAct);
+    int OnRecoveryTimeout(MM::PropertyBase* pProp, MM::ActionType eAct);
+    int OnLastRecovery(MM::PropertyBase* pProp, MM::ActionType eAct);
+#ifdef IDS_PEAK_FAULT_INJECTION
+    int OnFaultInjection(MM::PropertyBase* pProp, MM::ActionType eAct);
+    int OnFaultInterval(MM::PropertyBase* pProp, MM::ActionType eAct);
+    int OnFaultTest(MM::PropertyBase* pProp, MM::ActionType eAct);
+    int OnSoakTest(MM::PropertyBase* pProp, MM::ActionType eAct);
+    int OnSoakTestDuration(MM::PropertyBase* pProp, MM::ActionType eAct);
+    int OnRoiTrackTest(MM::PropertyBase* pProp, MM::ActionType eAct);
+    int OnSelfTestResult(MM::PropertyBase* pProp, MM::ActionType eAct);
+    int OnSelfTestFailures(MM::PropertyBase* pProp, MM::ActionType eAct);
+#endif
+    int OnLogLevel(MM::PropertyBase* pProp, MM::ActionType eAct);
+    int OnMetricsFile(MM::PropertyBase* pProp, MM::ActionType eAct);
+    int OnMetricsInterval(MM::PropertyBase* pProp, MM::ActionType eAct);
+    int OnSensorReadoutTime(MM::PropertyBase* pProp, MM::ActionType eAct);
     int OnPixelType(MM::PropertyBase* pProp, MM::ActionType eAct);
     int OnFrameRate(MM::PropertyBase* pProp, MM::ActionType eAct);
+    int OnExposureChangeLatency(MM::PropertyBase* pProp, MM::ActionType eAct);
+    int OnHdrMode(MM::PropertyBase* pProp, MM::ActionType eAct);
+    int OnHdrExposures(MM::PropertyBase* pProp, MM::ActionType eAct);
+    int OnInterleavedChannels(MM::PropertyBase* pProp, MM::ActionType eAct);
+    int OnInterleavedOutput(MM::PropertyBase* pProp, MM::ActionType eAct);
+    int OnMultiROICycling(MM::PropertyBase* pProp, MM::ActionType eAct);
+    int OnChannelExposure(MM::PropertyBase* pProp, MM::ActionType eAct, long channel);
+    int OnChannelGain(MM::PropertyBase* pProp, MM::ActionType eAct, long channel);
+    int OnChannelOutputLine(MM::PropertyBase* pProp, MM::ActionType eAct, long channel);
     int OnReadoutTime(MM::PropertyBase* pProp, MM::ActionType eAct);
     int OnCameraCCDXSize(MM::PropertyBase*, MM::ActionType);
     int OnCameraCCDYSize(MM::PropertyBase*, MM::ActionType);
@@ -154,11 +566,28 @@ public:
     int OnMultiROIFillValue(MM::PropertyBase* pProp, MM::ActionType eAct);
     int OnCCDTemp(MM::PropertyBase* pProp, MM::ActionType eAct);
     int OnIsSequenceable(MM::PropertyBase* pProp, MM::ActionType eAct);
+    int OnIsGainSequenceable(MM::PropertyBase* pProp, MM::ActionType eAct);
+    int OnExposureControl(MM::PropertyBase* pProp, MM::ActionType eAct);
+    int OnTriggerLine(MM::PropertyBase* pProp, MM::ActionType eAct);
+    int OnTriggerLevel(MM::PropertyBase* pProp, MM::ActionType eAct);
+    int OnExternalTriggerTimeout(MM::PropertyBase* pProp, MM::ActionType eAct);
+    int OnCameraSync(MM::PropertyBase* pProp, MM::ActionType eAct);
+    int OnSyncMasterLine(MM::PropertyBase* pProp, MM::ActionType eAct);
+    int OnSyncSlaveLine(MM::PropertyBase* pProp, MM::ActionType eAct);
+    int OnSyncSlaveCameras(MM::PropertyBase* pProp, MM::ActionType eAct);
+    int OnSyncTolerance(MM::PropertyBase* pProp, MM::ActionType eAct);
+    int OnSyncCheck(MM::PropertyBase* pProp, MM::ActionType eAct);
+    int OnCompositeOutput(MM::PropertyBase* pProp, MM::ActionType eAct);
     int OnAutoWhiteBalance(MM::PropertyBase* pProp, MM::ActionType eAct);
     int OnGainMaster(MM::PropertyBase* pProp, MM::ActionType eAct);
     int OnGainRed(MM::PropertyBase* pProp, MM::ActionType eAct);
     int OnGainGreen(MM::PropertyBase* pProp, MM::ActionType eAct);
     int OnGainBlue(MM::PropertyBase* pProp, MM::ActionType eAct);
+    int OnAcqThreadPriority(MM::PropertyBase* pProp, MM::ActionType eAct);
+    int OnAcqThreadCore(MM::PropertyBase* pProp, MM::ActionType eAct);
+    int OnWorkerThreads(MM::PropertyBase* pProp, MM::ActionType eAct);
+    int OnWorkerThreadPriority(MM::PropertyBase* pProp, MM::ActionType eAct);
+    int OnWorkerThreadCore(MM::PropertyBase* pProp, MM::ActionType eAct);
 
     long GetCCDXSize() { return cameraCCDXSize_; }
     long GetCCDYSize() { return cameraCCDYSize_; }
@@ -170,17 +599,97 @@ public:
     peak_status getGFAString(const char* featureName, char* stringValue);
     peak_status getGFAInt(const char* featureName, int64_t* intValue);
     peak_status getGFAfloat(const char* featureName, double* floatValue);
+    peak_status setGFAEnum(peak_camera_handle hDev, const char* featureName, const char* value);
+    peak_status setGFAInt(peak_camera_handle hDev, const char* featureName, int64_t value);
+    peak_status setGFAfloat(peak_camera_handle hDev, const char* featureName, double value);
+    peak_status executeGFACommand(peak_camera_handle hDev, const char* featureName);
+    bool isGFAWritable(peak_camera_handle hDev, const char* featureName);
+    peak_status getGFAEnumList(peak_camera_handle hDev, const char* featureName, vector<string>& values);
+    peak_status getGFAEnum(peak_camera_handle hDev, const char* featureName, string& value);
     peak_status getTemperature(double* sensorTemp);
     void initializeAutoWBConversion();
+    void initializeThreadPriorityConversion();
     int transferBuffer(peak_frame_handle hFrame, ImgBuffer& img);
+    void recordDemosaicCost(int demosaic, double seconds, const ImgBuffer& img);
+    int selectTransferKernel();
     int updateAutoWhiteBalance();
     int framerateSet(double framerate);
+    void updateFramerateLimits();
+    void updateSnapConfig();
+    int applyTriggerConfig(int triggerConfig);
+    unsigned outputBytesPerPixel() const;
+    int acquireHdrBracket(const AcqConfig& config, ImgBuffer& img);
+    int beginCycle(bool allowSequencer);
+    void endCycle(const AcqConfig& config);
+    int programSequencer(const AcqConfig& config);
+    int applyMultiROI();
+    int buildSequenceCycle();
+    int setupSync();
+    void teardownSync();
+    int validateSync();
+    void startSyncSlaves(const AcqConfig& config);
+    void stopSyncSlaves(const AcqConfig& config);
+    int setupComposite(int mode);
+    void resetComposite(const AcqConfig& config);
+    void releaseCompositePending(const AcqConfig& config);
+    int composeFrame(const AcqConfig& config, peak_frame_handle hMasterFrame, map<string, string>& frameTags);
+    int insertComposite(const AcqConfig& config, const map<string, string>& frameTags);
+    int applyStaggerDelay();
+    void collectSyncFrames(const AcqConfig& config, uint64_t masterTimestamp, map<string, string>& frameTags);
+    peak_status applyFrameSetting(const AcqConfig& config, const FrameSetting& setting);
+    int acquireCycleFrame(const AcqConfig& config, ImgBuffer& img, size_t& cycleIndex);
     int cameraChanged();
     bool isColorCamera();
+    void applyAcqThreadScheduling();
+    void publishConfig();
+    std::shared_ptr<const AcqConfig> getConfig() const;
 
 
 private:
     int SetAllowedBinning();
+    int SetAllowedDecimation();
+    int readExposureRange();
+    int updateExposureRange();
+    void updateShutterTiming();
+    void startClockCorrelation();
+    void sampleClock();
+    int runKernelBenchmark();
+    void kernelBenchmarkThread();
+    int startKernelBenchmark();
+    void stopKernelBenchmark();
+    const ImgBuffer& downsamplePreview(const ImgBuffer& img);
+    void beginRoiTracking(const AcqConfig& config);
+    void updateRoiTracking(const AcqConfig& config, const ImgBuffer& img, const peak_roi& frameRoi);
+    void endRoiTracking(const AcqConfig& config);
+    peak_roi clampTrackingRoi(unsigned centerX, unsigned centerY, unsigned width, unsigned height) const;
+    int applyTrackingRoi(const AcqConfig& config, const peak_roi& roi);
+    void beginSequenceBenchmark();
+    void observeLatency(AcqMetrics::Stage stage, double seconds);
+    double latencyPercentileMs(AcqMetrics::Stage stage, double fraction) const;
+    void endSequenceBenchmark();
+    int writeBenchmarkResults();
+    int compareBenchmarkBaseline();
+    int waitForFrameRecovering(const AcqConfig& config, uint32_t timeoutMs, peak_frame_handle& hFrame);
+    bool reopenCamera(const AcqConfig& config);
+#ifdef IDS_PEAK_FAULT_INJECTION
+    peak_status injectFault(peak_frame_handle hFrame, bool& incomplete);
+    int runTestSequence(uint64_t frames, double intervalMs, double timeoutS, bool live);
+    void faultTestThread();
+    int runSoakRound();
+    void soakTestThread();
+    void drawTrackingTestFrame(const AcqConfig& config, ImgBuffer& img, unsigned centerX, unsigned centerY, unsigned size);
+    void roiTrackTestThread();
+    int startSelfTest(void (CIDSPeak::*test)());
+    void stopSelfTest();
+#endif
+    void logAsync(LogRing::Level level, const char* message);
+    void startLogFlusher();
+    void stopLogFlusher();
+    void flushLog();
+    void startMetricsWriter();
+    void stopMetricsWriter();
+    void metricsWriterLoop();
+    int writeMetrics();
     void GenerateEmptyImage(ImgBuffer& img);
     int ResizeImageBuffer();
 
@@ -197,6 +706,66 @@ private:
     double framerateMax_;
     double framerateMin_;
     double framerateInc_;
+    bool framerateLimitsDirty_;
+    std::atomic<double> exposureChangeLatencyUs_;
+    int triggerConfig_;
+    double snapFramerate_;
+    uint32_t snapTimeoutMs_;
+
+    // Exposure time controlled by the width of an external trigger pulse
+    bool triggerWidthExposure_;
+    std::string triggerLine_;
+    bool triggerLevelHigh_;
+    long externalTriggerTimeoutMs_;
+
+    // Hardware chained cameras, the exposure active output of hCam triggers the slaves
+    bool syncEnabled_;
+    std::string syncMasterLine_;
+    std::string syncSlaveLine_;
+    std::string syncSlaveCameras_;
+    double syncToleranceUs_;
+    std::string syncCheck_;
+    std::vector<peak_camera_handle> syncSlaves_;
+    std::vector<int64_t> syncClockOffsetNs_; // slave minus master timestamp of one trigger, per slave
+    std::chrono::steady_clock::time_point syncClockOffsetTime_;
+    uint64_t syncMasterLastTs_;
+    std::vector<uint64_t> syncSlaveLastTs_;
+    std::vector<int> syncSlaveIds_;
+
+    // Composite output, matching state is owned by the acquiring thread
+    int compositeMode_;
+    std::vector<CompositeSource> compositeSources_;
+    ImgBuffer compositeImg_;
+    std::vector<ImgBuffer> compositeImgs_;
+    std::vector<uint64_t> compositeFirstId_;
+    std::vector<uint64_t> compositeLastTs_;
+    std::vector<uint64_t> compositeLastMasterTs_;
+    std::vector<int64_t> compositeClockOffsetNs_;
+    std::vector<peak_frame_handle> compositePending_;
+    unsigned long compositeDropped_;
+    double staggerDelayUs_;
+    int64_t staggerOffsetNs_;
+    bool staggerOffsetValid_;
+    long staggerRemaining_;
+
+    // HDR fusion
+    int hdrMode_;
+    std::vector<double> hdrExposures_;
+    ImgBuffer hdrRaw_;
+    std::vector<float> hdrNum_;
+    std::vector<float> hdrDen_;
+
+    // Frame by frame setting cycles
+    long interleavedChannels_;
+    bool separateChannels_;
+    std::vector<FrameSetting> channelSettings_;
+    std::vector<ImgBuffer> channelImgs_;
+    bool cycleOnSequencer_;
+    size_t cycleNext_;
+    uint64_t cycleFirstFrameId_;
+    bool cycleFrameIdValid_;
+    bool roiCycling_;
+    std::vector<FrameSetting> roiCycleSettings_;
     ImgBuffer img_;
     bool stopOnOverFlow_;
     bool initialized_;
@@ -218,12 +787,112 @@ private:
     unsigned long sequenceIndex_;
     double GetSequenceExposure();
     std::vector<double> exposureSequence_;
+    bool gainSequenceable_;
+    bool gainSequenceRunning_;
+    std::vector<double> gainSequence_;
+    std::vector<FrameSetting> sequenceCycle_;
     long imageCounter_;
     long binSize_;
+    long decimation_;
+    std::string shutterMode_;
+    double sensorReadoutMs_;
+    double serialReadoutMs_; // readout that can't overlap the exposure
+
+    // Camera to host clock correlation, sampled by the acquiring thread
+    ClockModel clock_;
+    bool clockLatchSupported_;
+    MM::MMTime lastClockSample_;
+    uint64_t frameTimestamp_; // device timestamp of the frame in img_
+
+    // Kernel benchmark, run on benchmarkThread_. benchmarkMutex_ guards the results.
+    std::thread benchmarkThread_;
+    std::atomic<bool> benchmarkRunning_;
+    std::atomic<bool> benchmarkStop_;
+    std::atomic<unsigned> benchmarkDone_;
+    std::atomic<unsigned> benchmarkTotal_;
+    std::mutex benchmarkMutex_;
+    std::vector<KernelBenchmarkResult> benchmarkResults_;
+    SequenceBenchmarkResult sequenceBenchmark_;
+    bool sequenceBenchmarkValid_;
+    std::chrono::steady_clock::time_point sequenceBenchStart_;
+    double sequenceBenchCpuStart_;
+    uint64_t sequenceBenchFramesStart_;
+    int64_t sequenceBenchAllocationsStart_;
+    std::vector<float> sequenceBenchLatencies_[AcqMetrics::STAGE_COUNT]; // seconds
+    uint64_t sequenceBenchSamples_[AcqMetrics::STAGE_COUNT];
+    std::string benchmarkFile_;
+    std::string baselineFile_;
+    double benchmarkTolerancePct_;
+    std::string benchmarkComparison_;
+    long benchmarkRegressions_; // of the last comparison, -1 = not compared
+
+    // Recovery of plain acquisitions, and faults injected to test it
+    double recoveryTimeoutMs_;
+    double lastRecoveryMs_;
+    long lastRecoveryLostFrames_;
+    bool acqRestarted_; // restarted without a frame count, stop it at the end
+    uint64_t lastFrameId_;
+    int faultInjection_;
+    long faultInterval_;
+    long faultCounter_;
+    std::chrono::steady_clock::time_point faultDeviceBack_; // end of an injected device loss
+
+    // Self tests of test builds, run on selfTestThread_. benchmarkMutex_ guards the results.
+    std::thread selfTestThread_;
+    std::atomic<bool> selfTestRunning_;
+    std::atomic<bool> selfTestStop_;
+    std::string selfTestResult_;
+    long selfTestFailures_; // failed checks of the last self test, -1 = not run
+    double soakTestMinutes_;
+
+    // Messages from the acquisition and worker threads, flushed in the background
+    LogRing logRing_;
+    std::thread logThread_;
+    std::mutex logMutex_;
+    std::condition_variable logCv_;
+    bool logStop_;
+
+    // Prometheus metrics, rewritten periodically by a writer thread
+    AcqMetrics metrics_;
+    std::string metricsFile_;
+    double metricsIntervalS_;
+    std::thread metricsThread_;
+    std::mutex metricsMutex_;
+    std::condition_variable metricsCv_;
+    bool metricsStop_;
+
     long cameraCCDXSize_;
     long cameraCCDYSize_;
     double ccdT_;
     std::string triggerDevice_;
+    const TransferKernelEntry* transferKernel_;
+    const TransferKernelEntry* snapTransferKernel_;
+    int demosaicLive_;
+    int demosaicSnap_;
+    std::atomic<double> demosaicMsPerMP_[DEMOSAIC_COUNT]; // cost of the last converted frame per algorithm
+    // Live preview downsampling (1, 2, 4 or 8), selected and of the running sequence
+    unsigned previewDownsampling_;
+    std::atomic<unsigned> previewActiveFactor_;
+    std::vector<ImgBuffer> previewLevels_;
+
+    // Live view ROI shrunk to the region of activity, within the user ROI
+    bool roiTracking_;
+    double roiTrackThresholdPct_;
+    long roiTrackMarginPx_;
+    double roiTrackSearchS_;
+    bool roiTrackActive_;
+    double roiTrackFramerate_;
+    peak_roi roiTrackFull_;
+    peak_roi roiTrackPending_;
+    unsigned roiTrackShrinkFrames_;
+    unsigned roiTrackLostFrames_;
+    std::chrono::steady_clock::time_point roiTrackLastSearch_;
+    std::atomic<unsigned> roiTrackX_;
+    std::atomic<unsigned> roiTrackY_;
+    std::atomic<unsigned> roiTrackWidth_; // 0 while not tracking
+    std::atomic<unsigned> roiTrackHeight_;
+    std::atomic<long> roiTrackReconfigurations_;
+    ImgBuffer roiTrackImg_;
     map<int, string> peakTypeToString;
     map<string, int> stringToPeakType;
 
@@ -248,10 +917,36 @@ private:
     std::vector<unsigned> multiROIWidths_;
     std::vector<unsigned> multiROIHeights_;
 
+    // Thread scheduling
+    int acqThreadPriority_;
+    int acqThreadCore_;
+    long workerThreads_;
+    int workerThreadPriority_;
+    int workerThreadCore_;
+    map<int, string> threadPriorityToString;
+    map<string, int> stringToThreadPriority;
+
+    // Configuration snapshot, written by the property thread, read by everyone.
+    // The current snapshot is configSlots_[configCurrent_]; a writer only
+    // reuses a slot that is not current and has no reader copying from it.
+    // threadConfig_ is the acquisition thread's private copy, only refreshed
+    // when configVersion_ moves on.
+    struct ConfigSlot
+    {
+        std::shared_ptr<const AcqConfig> config;
+        std::atomic<unsigned> readers;
+    };
+    mutable ConfigSlot configSlots_[CONFIG_SLOTS];
+    std::atomic<unsigned> configCurrent_;
+    std::atomic<unsigned long long> configVersion_;
+    std::shared_ptr<const AcqConfig> threadConfig_;
+    MMThreadLock configWriteLock_;
+
     MMThreadLock imgPixelsLock_;
     friend class MySequenceThread;
 
     MySequenceThread* thd_;
+    WorkerPool* pool_;
     std::future<void> fut_;
 };
 
@@ -290,5 +985,37 @@ private:
     MMThreadLock suspendLock_;
 };
 
+/**
+* Small fixed-size pool used to split per-frame pixel work into stripes.
+* The calling thread always processes the first stripe itself, so a pool
+* of size 1 runs everything inline without any synchronization.
+*/
+class WorkerPool
+{
+public:
+    WorkerPool();
+    ~WorkerPool();
+    void Resize(unsigned nThreads, int firstCore, int priority);
+    unsigned GetSize() const { return (unsigned)workers_.size() + 1; }
+    void ParallelFor(unsigned count, const std::function<void(unsigned, unsigned)>& fn);
+private:
+    void workerLoop(unsigned index, unsigned long long seenGeneration);
+    void stopWorkers();
+    std::vector<std::thread> workers_;
+    std::mutex callMutex_;
+    std::mutex mutex_;
+    std::condition_variable wake_;
+    std::condition_variable done_;
+    const std::function<void(unsigned, unsigned)>* job_;
+    unsigned jobCount_;
+    unsigned jobStripes_;
+    unsigned long long generation_;
+    unsigned pending_;
+    bool quit_;
+    int firstCore_;
+    int priority_;
+};
+
+bool setCurrentThreadScheduling(int core, int priority);
 
 #endif //_IDSPeak_H_